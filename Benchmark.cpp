@@ -0,0 +1,386 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <sys/time.h>
+#include <tr1/memory>
+#include <vector>
+#include "UniqueNumberCounter.h"
+
+using namespace std;
+using namespace std::tr1;
+
+namespace
+{
+    /**
+     * \brief Options controlling a benchmark run.
+     */
+    struct Options
+    {
+        /**
+         * \brief How keys are given to the counter.
+         */
+        enum Mode
+        {
+            Direct,      /**< One at a time with ProcessNumber. */
+            Partitioned, /**< A batch at a time with ProcessNumbers. */
+            Batched      /**< A batch at a time with ProcessNumbers, without partitioning. */
+        };
+
+        Options() :
+            algorithmType(IUniqueNumberAlgorithm::CompactRadixTree),
+            algorithmName("tree"),
+            numDigits(9),
+            numKeys(10000000),
+            expectedPopulation(0),
+            batchSize(1000000),
+            mode(Direct),
+            numTopItems(0),
+            snapshotInterval(0),
+            metricsPort(0),
+            compactSlice(0)
+        {
+        }
+
+        IUniqueNumberAlgorithm::AlgorithmType algorithmType; /**< Algorithm being measured. */
+        string algorithmName;                                /**< Names the algorithm in metrics. */
+        size_t numDigits;                                    /**< Number of digits in each generated key. */
+        size_t numKeys;                                      /**< Total number of keys to process. */
+        size_t expectedPopulation;                           /**< Population hint given to the algorithm, 0 for none. */
+        size_t batchSize;                                    /**< Number of keys generated and processed at a time. */
+        Mode mode;                                           /**< How keys are given to the counter. */
+        size_t numTopItems;                                  /**< Most frequent keys to report, 0 for no frequency sketch. */
+        string snapshotPath;                                 /**< File background snapshots are written to, if set. */
+        size_t snapshotInterval;                             /**< Keys processed between the starts of snapshots. */
+        unsigned short metricsPort;                          /**< Loopback port serving Prometheus metrics, 0 for none. */
+        size_t compactSlice;                                 /**< Most nodes compacted after each batch, 0 for none. */
+    };
+
+    /**
+     * \brief Returns the current wall clock time in seconds.
+     */
+    double GetTime()
+    {
+        timeval now;
+        gettimeofday(&now, NULL);
+        return now.tv_sec + now.tv_usec / 1e6;
+    }
+
+    /**
+     * \brief Generates uniformly distributed random keys with a fixed number of digits. A private generator
+     *        is used because rand() only yields 31 bits on most platforms.
+     */
+    class KeyGenerator
+    {
+    public:
+        /**
+         * \brief Seeds the generator.
+         *
+         * @param[in] numDigits Number of digits in each generated key.
+         */
+        explicit KeyGenerator(const size_t numDigits) :
+            m_NumDigits(numDigits),
+            m_State(0x9E3779B97F4A7C15ULL)
+        {
+        }
+
+        /**
+         * \brief Replaces the contents of keys with count newly generated keys.
+         */
+        void Generate(const size_t count, vector<string> &keys)
+        {
+            keys.resize(count);
+            for (vector<string>::iterator key(keys.begin()); key != keys.end(); ++key)
+            {
+                key->resize(m_NumDigits);
+                uint64_t value(m_Next());
+                for (size_t digit(m_NumDigits); digit > 0; --digit)
+                {
+                    (*key)[digit - 1] = static_cast<char>('0' + value % 10);
+                    value /= 10;
+                    if (value == 0)
+                        value = m_Next();
+                }
+            }
+        }
+
+    private:
+        /**
+         * \brief xorshift64*
+         */
+        uint64_t m_Next()
+        {
+            m_State ^= m_State >> 12;
+            m_State ^= m_State << 25;
+            m_State ^= m_State >> 27;
+            return m_State * 0x2545F4914F6CDD1DULL;
+        }
+
+        const size_t m_NumDigits; /**< Number of digits in each generated key. */
+        uint64_t m_State;         /**< Generator state. */
+    };
+
+    /**
+     * \brief Returns the kilobytes of memory only this process has written to, which while a snapshot is being
+     *        written by a child is roughly the pages copied since the fork. Returns 0 where /proc isn't available.
+     */
+    size_t GetPrivateDirtyKb()
+    {
+        ifstream smaps("/proc/self/smaps_rollup");
+        string field;
+        size_t kb(0);
+        while (smaps >> field)
+        {
+            if (field == "Private_Dirty:")
+            {
+                smaps >> kb;
+                break;
+            }
+        }
+        return kb;
+    }
+
+    /**
+     * \brief Counts finished snapshots.
+     */
+    class SnapshotCounter : public SnapshotListener
+    {
+    public:
+        SnapshotCounter() :
+            numSucceeded(0),
+            numFailed(0)
+        {
+        }
+
+        virtual void OnSnapshotComplete(const string &, const bool succeeded)
+        {
+            ++(succeeded ? numSucceeded : numFailed);
+        }
+
+        size_t numSucceeded; /**< Snapshots written. */
+        size_t numFailed;    /**< Snapshots that couldn't be written. */
+    };
+
+    /**
+     * \brief Prints the command line usage and exits.
+     */
+    void Usage(const char *program)
+    {
+        cerr << "usage: " << program << " [--algorithm tree|set|interval|bitmap|hash|theta|cuckoo|blocks|btree|bittree|swiss] [--digits N] [--keys N] [--expected N]"
+             << " [--batch N] [--mode direct|partitioned|batched] [--top N] [--snapshot PATH] [--snapshot-every N] [--metrics-port N]"
+             << " [--compact N]" << endl;
+        exit(1);
+    }
+
+    /**
+     * \brief Parses the command line into options.
+     */
+    Options ParseOptions(int argc, char **argv)
+    {
+        Options options;
+        for (int arg(1); arg < argc; ++arg)
+        {
+            const string name(argv[arg]);
+            if (arg + 1 >= argc)
+                Usage(argv[0]);
+            const string value(argv[++arg]);
+            if (name == "--algorithm")
+            {
+                options.algorithmName = value;
+                if (value == "tree")
+                    options.algorithmType = IUniqueNumberAlgorithm::CompactRadixTree;
+                else if (value == "set")
+                    options.algorithmType = IUniqueNumberAlgorithm::Set;
+                else if (value == "interval")
+                    options.algorithmType = IUniqueNumberAlgorithm::IntervalSet;
+                else if (value == "bitmap")
+                    options.algorithmType = IUniqueNumberAlgorithm::SparseBitmap;
+                else if (value == "hash")
+                    options.algorithmType = IUniqueNumberAlgorithm::Hash;
+                else if (value == "theta")
+                    options.algorithmType = IUniqueNumberAlgorithm::Theta;
+                else if (value == "cuckoo")
+                    options.algorithmType = IUniqueNumberAlgorithm::Cuckoo;
+                else if (value == "blocks")
+                    options.algorithmType = IUniqueNumberAlgorithm::SortedBlocks;
+                else if (value == "btree")
+                    options.algorithmType = IUniqueNumberAlgorithm::BTree;
+                else if (value == "bittree")
+                    options.algorithmType = IUniqueNumberAlgorithm::BitmapTree;
+                else if (value == "swiss")
+                    options.algorithmType = IUniqueNumberAlgorithm::SwissHash;
+                else
+                    Usage(argv[0]);
+            }
+            else if (name == "--digits")
+                options.numDigits = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--keys")
+                options.numKeys = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--expected")
+                options.expectedPopulation = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--batch")
+                options.batchSize = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--top")
+                options.numTopItems = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--snapshot")
+                options.snapshotPath = value;
+            else if (name == "--snapshot-every")
+                options.snapshotInterval = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--metrics-port")
+                options.metricsPort = static_cast<unsigned short>(strtoul(value.c_str(), NULL, 10));
+            else if (name == "--compact")
+                options.compactSlice = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--mode")
+            {
+                if (value == "direct")
+                    options.mode = Options::Direct;
+                else if (value == "partitioned")
+                    options.mode = Options::Partitioned;
+                else if (value == "batched")
+                    options.mode = Options::Batched;
+                else
+                    Usage(argv[0]);
+            }
+            else
+                Usage(argv[0]);
+        }
+        if ((options.numDigits == 0) || (options.batchSize == 0))
+            Usage(argv[0]);
+        if (!options.snapshotPath.empty() && (options.snapshotInterval == 0))
+            options.snapshotInterval = max<size_t>(options.numKeys / 2, 1);
+        return options;
+    }
+}
+
+/**
+ * \brief Feeds randomly generated keys through a UniqueNumberCounter and reports throughput. Keys are
+ *        generated a batch at a time so that runs of 10^8 to 10^9 keys don't need to hold every key in
+ *        memory; only the time spent processing is measured. With --snapshot, background snapshots are
+ *        started between batches, and the time each start paused ingestion and the most memory copied while
+ *        one was being written are reported. With --compact, a slice of compaction runs after each batch, and
+ *        the passes finished and the time the slices took, which isn't counted as processing, are reported.
+ *        With --metrics-port, the counter's memory is measured between batches every 30 seconds, which isn't
+ *        counted as processing either.
+ */
+int main(int argc, char **argv)
+{
+    const Options options(ParseOptions(argc, argv));
+    IUniqueNumberAlgorithm::Options hints;
+    hints.numExpectedDigits = options.numDigits;
+    hints.expectedPopulation = options.expectedPopulation;
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(options.algorithmType, hints));
+    UniqueNumberCounter counter(algorithm, options.numDigits);
+    if (options.mode == Options::Batched)
+        counter.SetNumPartitionDigits(0);
+    KeyGenerator generator(options.numDigits);
+    shared_ptr<CountMinSketch> sketch;
+    if (options.numTopItems > 0)
+    {
+        sketch.reset(new CountMinSketch(65536, 4, options.numTopItems));
+        counter.SetFrequencySketch(sketch);
+    }
+    const shared_ptr<MetricsRegistry> registry(new MetricsRegistry);
+    shared_ptr<MetricsEndpoint> endpoint;
+    if (options.metricsPort != 0)
+    {
+        const shared_ptr<CounterMetrics> metrics(new CounterMetrics("benchmark", options.algorithmName));
+        counter.SetMetrics(metrics);
+        registry->Add(metrics);
+        endpoint.reset(new MetricsEndpoint(registry, options.metricsPort));
+    }
+
+    vector<string> batch;
+    double elapsed(0);
+    const shared_ptr<SnapshotCounter> snapshots(new SnapshotCounter);
+    size_t nextSnapshot(options.snapshotInterval);
+    double maxPause(0);
+    double totalPause(0);
+    size_t maxCopiedKb(0);
+    size_t numPasses(0);
+    double compactTime(0);
+    double maxSlice(0);
+    const double MemoryInterval(30);
+    double nextMeasurement(0);
+    for (size_t processed(0); processed < options.numKeys; processed += batch.size())
+    {
+        generator.Generate(min(options.batchSize, options.numKeys - processed), batch);
+        const double start(GetTime());
+        if (options.mode != Options::Direct)
+            counter.ProcessNumbers(batch);
+        else
+        {
+            for (vector<string>::const_iterator key(batch.begin()); key != batch.end(); ++key)
+                counter.ProcessNumber(*key);
+        }
+        elapsed += GetTime() - start;
+
+        if (!options.snapshotPath.empty())
+        {
+            if (counter.PollSnapshot())
+                maxCopiedKb = max(maxCopiedKb, GetPrivateDirtyKb());
+            else if (processed + batch.size() >= nextSnapshot)
+            {
+                const double pauseStart(GetTime());
+                counter.StartSnapshot(options.snapshotPath, snapshots);
+                const double pause(GetTime() - pauseStart);
+                elapsed += pause;
+                totalPause += pause;
+                maxPause = max(maxPause, pause);
+                nextSnapshot += options.snapshotInterval;
+            }
+        }
+
+        if (options.compactSlice > 0)
+        {
+            const double sliceStart(GetTime());
+            if (algorithm->Compact(options.compactSlice))
+                numPasses++;
+            const double slice(GetTime() - sliceStart);
+            compactTime += slice;
+            maxSlice = max(maxSlice, slice);
+        }
+
+        if ((options.metricsPort != 0) && (GetTime() >= nextMeasurement))
+        {
+            counter.MeasureMemory();
+            nextMeasurement = GetTime() + MemoryInterval;
+        }
+    }
+    if (counter.PollSnapshot())
+        maxCopiedKb = max(maxCopiedKb, GetPrivateDirtyKb());
+    counter.PollSnapshot(true);
+
+    cout << "keys=" << options.numKeys
+         << " unique=" << counter.GetCount()
+         << " seconds=" << elapsed
+         << " keys/sec=" << (elapsed > 0 ? options.numKeys / elapsed : 0)
+         << " bytes=" << algorithm->GetMemoryUsage()
+         << " bytes/key=" << (counter.GetCount() > 0 ? static_cast<double>(algorithm->GetMemoryUsage()) / counter.GetCount() : 0)
+         << endl;
+    if (!options.snapshotPath.empty())
+    {
+        cout << "snapshots=" << snapshots->numSucceeded
+             << " failed=" << snapshots->numFailed
+             << " max_pause_ms=" << maxPause * 1000
+             << " total_pause_ms=" << totalPause * 1000
+             << " max_copied_kb=" << maxCopiedKb
+             << endl;
+    }
+    if (options.compactSlice > 0)
+    {
+        cout << "compaction_passes=" << numPasses
+             << " compact_ms=" << compactTime * 1000
+             << " max_slice_ms=" << maxSlice * 1000
+             << endl;
+    }
+    if (sketch.get() != NULL)
+    {
+        vector<pair<string, uint32_t> > items;
+        sketch->GetTopItems(items);
+        for (vector<pair<string, uint32_t> >::const_iterator item(items.begin()); item != items.end(); ++item)
+            cout << item->first << " " << item->second << endl;
+    }
+    return 0;
+}
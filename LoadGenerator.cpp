@@ -0,0 +1,507 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <tr1/memory>
+#include <unistd.h>
+#include <vector>
+#include "ServerProtocol.h"
+
+using namespace std;
+using namespace std::tr1;
+
+namespace
+{
+    /**
+     * \brief Options controlling a load run.
+     */
+    struct Options
+    {
+        Options() :
+            port(0),
+            counterName("load"),
+            opcode(ServerProtocol::ProcessNumbers),
+            numDigits(9),
+            numKeys(10000000),
+            batchSize(1000),
+            depth(16),
+            numConnections(4)
+        {
+        }
+
+        string socketPath;             /**< Unix domain socket the server listens on, if set. */
+        unsigned short port;           /**< Loopback TCP port the server listens on, if socketPath isn't set. */
+        string counterName;            /**< Counter the requests go to. */
+        ServerProtocol::Opcode opcode; /**< ProcessNumbers or Contains. */
+        size_t numDigits;              /**< Number of digits in each generated key. */
+        size_t numKeys;                /**< Total number of keys to send. */
+        size_t batchSize;              /**< Number of keys per request. */
+        size_t depth;                  /**< Requests each connection keeps in flight. */
+        size_t numConnections;         /**< Connections requests are spread over. */
+    };
+
+    /**
+     * \brief Returns the current wall clock time in seconds.
+     */
+    double GetTime()
+    {
+        timeval now;
+        gettimeofday(&now, NULL);
+        return now.tv_sec + now.tv_usec / 1e6;
+    }
+
+    /**
+     * \brief Throws an exception describing the last system call's failure.
+     */
+    void RaiseSystemError(const string &message)
+    {
+        throw runtime_error(message + ": " + strerror(errno));
+    }
+
+    /**
+     * \brief Generates uniformly distributed random keys with a fixed number of digits, as Benchmark does.
+     */
+    class KeyGenerator
+    {
+    public:
+        /**
+         * \brief Seeds the generator.
+         *
+         * @param[in] numDigits Number of digits in each generated key.
+         * @param[in] seed      Distinguishes the keys of one connection from another's.
+         */
+        KeyGenerator(const size_t numDigits, const uint64_t seed) :
+            m_NumDigits(numDigits),
+            m_State(0x9E3779B97F4A7C15ULL ^ (seed * 0xBF58476D1CE4E5B9ULL))
+        {
+        }
+
+        /**
+         * \brief Replaces key with a newly generated key.
+         */
+        void Generate(string &key)
+        {
+            key.resize(m_NumDigits);
+            uint64_t value(m_Next());
+            for (size_t digit(m_NumDigits); digit > 0; --digit)
+            {
+                key[digit - 1] = static_cast<char>('0' + value % 10);
+                value /= 10;
+                if (value == 0)
+                    value = m_Next();
+            }
+        }
+
+    private:
+        /**
+         * \brief xorshift64*
+         */
+        uint64_t m_Next()
+        {
+            m_State ^= m_State >> 12;
+            m_State ^= m_State << 25;
+            m_State ^= m_State >> 27;
+            return m_State * 0x2545F4914F6CDD1DULL;
+        }
+
+        const size_t m_NumDigits; /**< Number of digits in each generated key. */
+        uint64_t m_State;         /**< Generator state. */
+    };
+
+    /**
+     * \brief A connection to the server with the requests it has in flight.
+     */
+    class Client
+    {
+    public:
+        /**
+         * \brief Connects to the server.
+         */
+        Client(const Options &options, const uint64_t seed) :
+            m_Generator(options.numDigits, seed),
+            m_Fd(-1),
+            m_OutputOffset(0),
+            m_InputOffset(0)
+        {
+            if (!options.socketPath.empty())
+            {
+                sockaddr_un address;
+                memset(&address, 0, sizeof(address));
+                address.sun_family = AF_UNIX;
+                if (options.socketPath.size() >= sizeof(address.sun_path))
+                    throw runtime_error("The socket path is too long");
+                strcpy(address.sun_path, options.socketPath.c_str());
+                m_Connect(AF_UNIX, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+            }
+            else
+            {
+                sockaddr_in address;
+                memset(&address, 0, sizeof(address));
+                address.sin_family = AF_INET;
+                address.sin_port = htons(options.port);
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                m_Connect(AF_INET, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+                const int enabled(1);
+                setsockopt(m_Fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+            }
+            const int flags(fcntl(m_Fd, F_GETFL));
+            if ((flags < 0) || (fcntl(m_Fd, F_SETFL, flags | O_NONBLOCK) < 0))
+                RaiseSystemError("Couldn't make the socket non-blocking");
+        }
+
+        /**
+         * \brief Closes the connection.
+         */
+        ~Client()
+        {
+            close(m_Fd);
+        }
+
+        int GetFd() const { return m_Fd; }
+        size_t GetNumInFlight() const { return m_SendTimes.size(); }
+        bool HasOutput() const { return m_OutputOffset < m_Output.size(); }
+
+        /**
+         * \brief Queues a request for a batch of newly generated keys.
+         */
+        void SendBatch(const Options &options)
+        {
+            const size_t start(ServerProtocol::BeginFrame(m_Output));
+            m_Output.push_back(static_cast<unsigned char>(options.opcode));
+            ServerProtocol::AppendString(options.counterName, m_Output);
+            ServerProtocol::AppendVarint(options.batchSize, m_Output);
+            string key;
+            for (size_t number(0); number < options.batchSize; ++number)
+            {
+                m_Generator.Generate(key);
+                ServerProtocol::AppendString(key, m_Output);
+            }
+            ServerProtocol::EndFrame(m_Output, start);
+            m_SendTimes.push_back(GetTime());
+        }
+
+        /**
+         * \brief Queues a request for the counter's count.
+         */
+        void SendGetCount(const Options &options)
+        {
+            const size_t start(ServerProtocol::BeginFrame(m_Output));
+            m_Output.push_back(static_cast<unsigned char>(ServerProtocol::GetCount));
+            ServerProtocol::AppendString(options.counterName, m_Output);
+            ServerProtocol::EndFrame(m_Output, start);
+            m_SendTimes.push_back(GetTime());
+        }
+
+        /**
+         * \brief Sends as much queued output as the socket takes.
+         */
+        void Write()
+        {
+            while (m_OutputOffset < m_Output.size())
+            {
+                const ssize_t written(send(m_Fd, &m_Output[m_OutputOffset], m_Output.size() - m_OutputOffset, MSG_NOSIGNAL));
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                        break;
+                    RaiseSystemError("Couldn't send a request");
+                }
+                m_OutputOffset += static_cast<size_t>(written);
+            }
+            if (m_OutputOffset == m_Output.size())
+            {
+                m_Output.clear();
+                m_OutputOffset = 0;
+            }
+            else if (m_OutputOffset * 2 >= m_Output.size())
+            {
+                m_Output.erase(m_Output.begin(), m_Output.begin() + m_OutputOffset);
+                m_OutputOffset = 0;
+            }
+        }
+
+        /**
+         * \brief Reads what the socket holds and completes every response received.
+         *
+         * @param[out] latencies Receives the seconds each completed request took.
+         * @param[out] value     Receives the varint of the last response, if it has one.
+         */
+        void Read(vector<double> &latencies, uint64_t &value)
+        {
+            const size_t ReadSize(65536);
+            const size_t size(m_Input.size());
+            m_Input.resize(size + ReadSize);
+            ssize_t numRead;
+            do
+                numRead = read(m_Fd, &m_Input[size], ReadSize);
+            while ((numRead < 0) && (errno == EINTR));
+            if (numRead < 0)
+            {
+                m_Input.resize(size);
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    return;
+                RaiseSystemError("Couldn't read a response");
+            }
+            if (numRead == 0)
+                throw runtime_error("The server closed the connection");
+            m_Input.resize(size + static_cast<size_t>(numRead));
+
+            const double now(GetTime());
+            size_t frameSize;
+            while (ServerProtocol::GetFrame(m_Input, m_InputOffset, frameSize))
+            {
+                size_t offset(m_InputOffset + ServerProtocol::FrameHeaderSize);
+                const size_t end(offset + frameSize);
+                if ((offset == end) || m_SendTimes.empty())
+                    throw runtime_error("Malformed response");
+                if (m_Input[offset++] != ServerProtocol::Ok)
+                {
+                    string message;
+                    ServerProtocol::ReadString(m_Input, offset, end, message);
+                    throw runtime_error("The server failed a request: " + message);
+                }
+                ServerProtocol::ReadVarint(m_Input, offset, end, value);
+                latencies.push_back(now - m_SendTimes.front());
+                m_SendTimes.pop_front();
+                m_InputOffset = end;
+            }
+            if (m_InputOffset == m_Input.size())
+            {
+                m_Input.clear();
+                m_InputOffset = 0;
+            }
+            else if (m_InputOffset * 2 >= m_Input.size())
+            {
+                m_Input.erase(m_Input.begin(), m_Input.begin() + m_InputOffset);
+                m_InputOffset = 0;
+            }
+        }
+
+    private:
+        Client(const Client &);
+        Client &operator=(const Client &);
+
+        /**
+         * \brief Creates the socket and connects it.
+         */
+        void m_Connect(const int domain, const sockaddr *address, const socklen_t size)
+        {
+            m_Fd = socket(domain, SOCK_STREAM, 0);
+            if (m_Fd < 0)
+                RaiseSystemError("Couldn't create a socket");
+            if (connect(m_Fd, address, size) != 0)
+            {
+                close(m_Fd);
+                RaiseSystemError("Couldn't connect to the server");
+            }
+        }
+
+        KeyGenerator m_Generator;       /**< Generates the keys this connection sends. */
+        int m_Fd;                       /**< The socket. */
+        vector<unsigned char> m_Output; /**< Requests not yet sent, from m_OutputOffset on. */
+        size_t m_OutputOffset;          /**< Bytes at the start of m_Output already sent. */
+        vector<unsigned char> m_Input;  /**< Bytes received, from m_InputOffset on. */
+        size_t m_InputOffset;           /**< Bytes at the start of m_Input already handled. */
+        deque<double> m_SendTimes;      /**< When each request in flight was queued, oldest first. */
+    };
+
+    /**
+     * \brief Sends and receives on every client until none has a request in flight.
+     *
+     * @param[in]  clients   The clients.
+     * @param[in]  refill    Called before each wait to queue more requests.
+     * @param[out] latencies Receives the seconds each completed request took.
+     * @param[out] value     Receives the varint of the last response.
+     */
+    template <typename Refill>
+    void Drive(vector<shared_ptr<Client> > &clients, Refill refill, vector<double> &latencies, uint64_t &value)
+    {
+        vector<pollfd> requests(clients.size());
+        for (;;)
+        {
+            refill();
+            size_t numInFlight(0);
+            for (size_t client(0); client < clients.size(); ++client)
+            {
+                clients[client]->Write();
+                requests[client].fd = clients[client]->GetFd();
+                requests[client].events = POLLIN | (clients[client]->HasOutput() ? POLLOUT : 0);
+                requests[client].revents = 0;
+                numInFlight += clients[client]->GetNumInFlight();
+            }
+            if (numInFlight == 0)
+                return;
+            if ((poll(&requests[0], requests.size(), -1) < 0) && (errno != EINTR))
+                RaiseSystemError("Couldn't poll the server");
+            for (size_t client(0); client < clients.size(); ++client)
+                if ((requests[client].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+                    clients[client]->Read(latencies, value);
+        }
+    }
+
+    /**
+     * \brief Keeps each client's pipeline full of batches until every key has been sent.
+     */
+    class BatchRefill
+    {
+    public:
+        BatchRefill(const Options &options, vector<shared_ptr<Client> > &clients, size_t &numSent) :
+            m_Options(options),
+            m_Clients(clients),
+            m_NumSent(numSent)
+        {
+        }
+
+        void operator()()
+        {
+            for (vector<shared_ptr<Client> >::iterator client(m_Clients.begin()); client != m_Clients.end(); ++client)
+            {
+                while (((*client)->GetNumInFlight() < m_Options.depth) && (m_NumSent < m_Options.numKeys))
+                {
+                    (*client)->SendBatch(m_Options);
+                    m_NumSent += m_Options.batchSize;
+                }
+            }
+        }
+
+    private:
+        const Options &m_Options;               /**< Batch size, depth and total number of keys. */
+        vector<shared_ptr<Client> > &m_Clients; /**< The clients. */
+        size_t &m_NumSent;                      /**< Keys sent so far. */
+    };
+
+    /**
+     * \brief Queues nothing.
+     */
+    void NoRefill()
+    {
+    }
+
+    /**
+     * \brief Returns the latency at a quantile of the sorted latencies.
+     */
+    double GetQuantile(const vector<double> &latencies, const double quantile)
+    {
+        if (latencies.empty())
+            return 0;
+        return latencies[min(latencies.size() - 1, static_cast<size_t>(quantile * latencies.size()))];
+    }
+
+    /**
+     * \brief Prints the command line usage and exits.
+     */
+    void Usage(const char *program)
+    {
+        cerr << "usage: " << program << " (--socket PATH | --port N) [--counter NAME] [--op process|contains] [--digits N]"
+             << " [--keys N] [--batch N] [--depth N] [--connections N]" << endl;
+        exit(1);
+    }
+
+    /**
+     * \brief Parses the command line into options.
+     */
+    Options ParseOptions(int argc, char **argv)
+    {
+        Options options;
+        for (int arg(1); arg < argc; ++arg)
+        {
+            const string name(argv[arg]);
+            if (arg + 1 >= argc)
+                Usage(argv[0]);
+            const string value(argv[++arg]);
+            if (name == "--socket")
+                options.socketPath = value;
+            else if (name == "--port")
+                options.port = static_cast<unsigned short>(strtoul(value.c_str(), NULL, 10));
+            else if (name == "--counter")
+                options.counterName = value;
+            else if (name == "--op")
+            {
+                if (value == "process")
+                    options.opcode = ServerProtocol::ProcessNumbers;
+                else if (value == "contains")
+                    options.opcode = ServerProtocol::Contains;
+                else
+                    Usage(argv[0]);
+            }
+            else if (name == "--digits")
+                options.numDigits = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--keys")
+                options.numKeys = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--batch")
+                options.batchSize = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--depth")
+                options.depth = strtoul(value.c_str(), NULL, 10);
+            else if (name == "--connections")
+                options.numConnections = strtoul(value.c_str(), NULL, 10);
+            else
+                Usage(argv[0]);
+        }
+        if ((options.socketPath.empty() && (options.port == 0)) || (options.numDigits == 0) || (options.batchSize == 0) ||
+            (options.depth == 0) || (options.numConnections == 0))
+            Usage(argv[0]);
+        return options;
+    }
+}
+
+/**
+ * \brief Sends batches of randomly generated keys to a Server over several connections, each keeping a number
+ *        of requests in flight, and reports requests and keys per second and the latency from queuing each
+ *        request to receiving its response.
+ */
+int main(int argc, char **argv)
+{
+    const Options options(ParseOptions(argc, argv));
+    try
+    {
+        vector<shared_ptr<Client> > clients;
+        for (size_t client(0); client < options.numConnections; ++client)
+            clients.push_back(shared_ptr<Client>(new Client(options, client + 1)));
+
+        vector<double> latencies;
+        uint64_t value(0);
+        size_t numSent(0);
+        const double start(GetTime());
+        Drive(clients, BatchRefill(options, clients, numSent), latencies, value);
+        const double elapsed(GetTime() - start);
+
+        vector<double> countLatencies;
+        uint64_t count(0);
+        clients.front()->SendGetCount(options);
+        Drive(clients, NoRefill, countLatencies, count);
+
+        sort(latencies.begin(), latencies.end());
+        cout << "requests=" << latencies.size()
+             << " keys=" << numSent
+             << " unique=" << count
+             << " seconds=" << elapsed
+             << " requests/sec=" << (elapsed > 0 ? latencies.size() / elapsed : 0)
+             << " keys/sec=" << (elapsed > 0 ? numSent / elapsed : 0)
+             << " p50_ms=" << GetQuantile(latencies, 0.5) * 1000
+             << " p99_ms=" << GetQuantile(latencies, 0.99) * 1000
+             << " max_ms=" << GetQuantile(latencies, 1) * 1000
+             << endl;
+    }
+    catch (const exception &error)
+    {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,639 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tr1/memory>
+#include <unistd.h>
+#include <vector>
+#include "ServerProtocol.h"
+#include "UniqueNumberCounter.h"
+
+using namespace std;
+using namespace std::tr1;
+
+namespace
+{
+    /**
+     * \brief Options controlling the server.
+     */
+    struct Options
+    {
+        Options() :
+            algorithmType(IUniqueNumberAlgorithm::CompactRadixTree),
+            algorithmName("tree"),
+            numDigits(9),
+            port(0),
+            metricsPort(0)
+        {
+        }
+
+        IUniqueNumberAlgorithm::AlgorithmType algorithmType; /**< Algorithm each counter uses. */
+        string algorithmName;                                /**< Names the algorithm in metrics. */
+        size_t numDigits;                                    /**< Number of digits in each number. */
+        string socketPath;                                   /**< Unix domain socket to listen on, if set. */
+        unsigned short port;                                 /**< Loopback TCP port to listen on, 0 for none. */
+        unsigned short metricsPort;                          /**< Loopback port serving Prometheus metrics, 0 for none. */
+    };
+
+    /**
+     * \brief Set by SIGINT and SIGTERM to end the event loop.
+     */
+    volatile sig_atomic_t stopping(0);
+
+    void Stop(int)
+    {
+        stopping = 1;
+    }
+
+    /**
+     * \brief Throws an exception describing the last system call's failure.
+     */
+    void RaiseSystemError(const string &message)
+    {
+        throw runtime_error(message + ": " + strerror(errno));
+    }
+
+    /**
+     * \brief Makes a descriptor's reads and writes return EAGAIN rather than block.
+     */
+    void MakeNonBlocking(const int fd)
+    {
+        const int flags(fcntl(fd, F_GETFL));
+        if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+            RaiseSystemError("Couldn't make a socket non-blocking");
+    }
+
+    /**
+     * \brief Hosts named counters, each created by the first batch of numbers sent to its name, and serves
+     *        pipelined requests from any number of clients on a single thread. Sockets are non-blocking and
+     *        watched with epoll; each connection buffers the requests it has only partly received and the
+     *        responses the client hasn't read yet, and stops being read while too many responses are waiting.
+     */
+    class Server
+    {
+    public:
+        /**
+         * \brief Creates the listening sockets.
+         *
+         * @param[in] options Where to listen and how to create counters.
+         */
+        explicit Server(const Options &options) :
+            m_Options(options),
+            m_Epoll(epoll_create(1)),
+            m_MemoryTime(time(NULL))
+        {
+            if (m_Epoll < 0)
+                RaiseSystemError("Couldn't create the epoll instance");
+            if (!options.socketPath.empty())
+                m_ListenUnix(options.socketPath);
+            if (options.port != 0)
+                m_ListenTcp(options.port);
+            if (options.metricsPort != 0)
+            {
+                m_Registry.reset(new MetricsRegistry);
+                m_Endpoint.reset(new MetricsEndpoint(m_Registry, options.metricsPort));
+            }
+        }
+
+        /**
+         * \brief Closes every socket and removes the Unix domain socket's file.
+         */
+        ~Server()
+        {
+            for (ConnectionMap::iterator connection(m_Connections.begin()); connection != m_Connections.end(); ++connection)
+                close(connection->first);
+            for (vector<int>::const_iterator listener(m_Listeners.begin()); listener != m_Listeners.end(); ++listener)
+                close(*listener);
+            if (!m_Options.socketPath.empty())
+                unlink(m_Options.socketPath.c_str());
+            close(m_Epoll);
+        }
+
+        /**
+         * \brief Serves clients until SIGINT or SIGTERM. While metrics are served, the counters' memory is
+         *        measured between requests every MemoryInterval seconds.
+         */
+        void Run()
+        {
+            const int MaxEvents(64);
+            epoll_event events[MaxEvents];
+            const int timeout(m_Registry.get() != NULL ? MemoryInterval * 1000 : -1);
+            while (!stopping)
+            {
+                if ((m_Registry.get() != NULL) && (time(NULL) - m_MemoryTime >= MemoryInterval))
+                {
+                    for (map<string, NamedCounter>::iterator named(m_Counters.begin()); named != m_Counters.end(); ++named)
+                        named->second.counter->MeasureMemory();
+                    m_MemoryTime = time(NULL);
+                }
+
+                const int numEvents(epoll_wait(m_Epoll, events, MaxEvents, timeout));
+                if (numEvents < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    RaiseSystemError("Couldn't wait for events");
+                }
+                for (int event(0); event < numEvents; ++event)
+                {
+                    const int fd(events[event].data.fd);
+                    if (find(m_Listeners.begin(), m_Listeners.end(), fd) != m_Listeners.end())
+                    {
+                        m_Accept(fd);
+                        continue;
+                    }
+
+                    // An earlier event in this round may have closed the connection
+                    const ConnectionMap::iterator connection(m_Connections.find(fd));
+                    if (connection == m_Connections.end())
+                        continue;
+                    bool isOpen(true);
+                    if ((events[event].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+                        isOpen = m_Read(*connection->second);
+                    if (isOpen)
+                        isOpen = m_Write(*connection->second);
+
+                    // A client that has finished sending is closed once it has been sent every response
+                    if (isOpen && connection->second->isReadClosed && connection->second->output.empty())
+                        isOpen = false;
+                    if (isOpen)
+                        m_Watch(*connection->second, EPOLL_CTL_MOD);
+                    else
+                        m_Close(fd);
+                }
+            }
+        }
+
+    private:
+        Server(const Server &);
+        Server &operator=(const Server &);
+
+        /**
+         * \brief A counter and the algorithm it uses, which answers Contains.
+         */
+        struct NamedCounter
+        {
+            shared_ptr<IUniqueNumberAlgorithm> algorithm; /**< The counter's algorithm. */
+            shared_ptr<UniqueNumberCounter> counter;      /**< The counter. */
+            shared_ptr<CounterMetrics> metrics;           /**< The counter's metrics, if they're served. */
+        };
+
+        /**
+         * \brief A client's socket and its buffers.
+         */
+        struct Connection
+        {
+            explicit Connection(const int fd) :
+                fd(fd),
+                inputOffset(0),
+                outputOffset(0),
+                events(0),
+                isReadClosed(false)
+            {
+            }
+
+            int fd;                       /**< The socket. */
+            vector<unsigned char> input;  /**< Bytes received, from inputOffset on. */
+            size_t inputOffset;           /**< Bytes at the start of input already handled. */
+            vector<unsigned char> output; /**< Responses not yet sent, from outputOffset on. */
+            size_t outputOffset;          /**< Bytes at the start of output already sent. */
+            uint32_t events;              /**< Events epoll watches the socket for. */
+            bool isReadClosed;            /**< True once the client has finished sending. */
+        };
+
+        typedef map<int, shared_ptr<Connection> > ConnectionMap;
+
+        /**
+         * \brief Bytes read from a socket at a time.
+         */
+        static const size_t ReadSize = 65536;
+
+        /**
+         * \brief Unsent response bytes above which a connection stops being read until the client catches up.
+         */
+        static const size_t MaxPendingOutput = 16 << 20;
+
+        /**
+         * \brief Seconds between measuring the counters' memory, which walks every number for some algorithms.
+         */
+        static const int MemoryInterval = 30;
+
+        /**
+         * \brief Starts listening on a Unix domain socket, replacing a stale socket file.
+         */
+        void m_ListenUnix(const string &path)
+        {
+            sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+                throw runtime_error("The socket path is too long");
+            strcpy(address.sun_path, path.c_str());
+            unlink(path.c_str());
+            const int fd(socket(AF_UNIX, SOCK_STREAM, 0));
+            if (fd < 0)
+                RaiseSystemError("Couldn't create a socket");
+            m_Listeners.push_back(fd);
+            if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+                RaiseSystemError("Couldn't bind " + path);
+            m_Listen(fd);
+        }
+
+        /**
+         * \brief Starts listening on a TCP port of the loopback interface.
+         */
+        void m_ListenTcp(const unsigned short port)
+        {
+            sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            const int fd(socket(AF_INET, SOCK_STREAM, 0));
+            if (fd < 0)
+                RaiseSystemError("Couldn't create a socket");
+            m_Listeners.push_back(fd);
+            const int enabled(1);
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+            if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+                RaiseSystemError("Couldn't bind the port");
+            m_Listen(fd);
+        }
+
+        /**
+         * \brief Listens on a bound socket and watches it for clients.
+         */
+        void m_Listen(const int fd)
+        {
+            MakeNonBlocking(fd);
+            if (listen(fd, SOMAXCONN) != 0)
+                RaiseSystemError("Couldn't listen");
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+                RaiseSystemError("Couldn't watch a socket");
+        }
+
+        /**
+         * \brief Accepts every client waiting on a listening socket.
+         */
+        void m_Accept(const int listener)
+        {
+            for (;;)
+            {
+                const int fd(accept(listener, NULL, NULL));
+                if (fd < 0)
+                {
+                    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) && (errno != ECONNABORTED))
+                        cerr << "Couldn't accept a client: " << strerror(errno) << endl;
+                    if (errno == EINTR)
+                        continue;
+                    return;
+                }
+                MakeNonBlocking(fd);
+
+                // Responses are written whole, so there is nothing to gain from waiting to fill a packet
+                const int enabled(1);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+                const shared_ptr<Connection> connection(new Connection(fd));
+                m_Connections[fd] = connection;
+                m_Watch(*connection, EPOLL_CTL_ADD);
+            }
+        }
+
+        /**
+         * \brief Watches a connection for reads unless the client has finished sending or too many responses are
+         *        waiting, and for writes while any are.
+         *
+         * @param[in] connection The connection.
+         * @param[in] operation  EPOLL_CTL_ADD for a new connection, otherwise EPOLL_CTL_MOD.
+         */
+        void m_Watch(Connection &connection, const int operation)
+        {
+            const size_t pending(connection.output.size() - connection.outputOffset);
+            const bool isReading(!connection.isReadClosed && (pending < MaxPendingOutput));
+            const uint32_t events((isReading ? static_cast<uint32_t>(EPOLLIN) : 0) |
+                                  (pending > 0 ? static_cast<uint32_t>(EPOLLOUT) : 0));
+            if ((operation == EPOLL_CTL_MOD) && (events == connection.events))
+                return;
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = events;
+            event.data.fd = connection.fd;
+            if (epoll_ctl(m_Epoll, operation, connection.fd, &event) != 0)
+                RaiseSystemError("Couldn't watch a socket");
+            connection.events = events;
+        }
+
+        /**
+         * \brief Closes a connection.
+         */
+        void m_Close(const int fd)
+        {
+            epoll_ctl(m_Epoll, EPOLL_CTL_DEL, fd, NULL);
+            close(fd);
+            m_Connections.erase(fd);
+        }
+
+        /**
+         * \brief Reads from a connection and handles every request that is complete.
+         *
+         * @return Returns false if the connection should be closed.
+         */
+        bool m_Read(Connection &connection)
+        {
+            if (connection.isReadClosed)
+                return true;
+            const size_t size(connection.input.size());
+            connection.input.resize(size + ReadSize);
+            ssize_t numRead;
+            do
+                numRead = read(connection.fd, &connection.input[size], ReadSize);
+            while ((numRead < 0) && (errno == EINTR));
+            if (numRead <= 0)
+            {
+                // At the end of the stream the responses already queued are still sent before closing
+                connection.input.resize(size);
+                if (numRead == 0)
+                    connection.isReadClosed = true;
+                return (numRead == 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK);
+            }
+            connection.input.resize(size + static_cast<size_t>(numRead));
+
+            size_t frameSize;
+            while (ServerProtocol::GetFrame(connection.input, connection.inputOffset, frameSize))
+            {
+                const size_t start(connection.inputOffset + ServerProtocol::FrameHeaderSize);
+                m_HandleRequest(connection.input, start, start + frameSize, connection.output);
+                connection.inputOffset = start + frameSize;
+            }
+            if (frameSize > ServerProtocol::MaxFrameSize)
+                return false;
+
+            // Only move a partial request down once it's at most half the buffer, so that moving it is amortized
+            if (connection.inputOffset == connection.input.size())
+            {
+                connection.input.clear();
+                connection.inputOffset = 0;
+            }
+            else if (connection.inputOffset * 2 >= connection.input.size())
+            {
+                connection.input.erase(connection.input.begin(), connection.input.begin() + connection.inputOffset);
+                connection.inputOffset = 0;
+            }
+            return true;
+        }
+
+        /**
+         * \brief Sends as many waiting responses as the socket takes.
+         *
+         * @return Returns false if the connection should be closed.
+         */
+        bool m_Write(Connection &connection)
+        {
+            while (connection.outputOffset < connection.output.size())
+            {
+                const ssize_t written(send(connection.fd, &connection.output[connection.outputOffset],
+                                           connection.output.size() - connection.outputOffset, MSG_NOSIGNAL));
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                        break;
+                    return false;
+                }
+                connection.outputOffset += static_cast<size_t>(written);
+            }
+            if (connection.outputOffset == connection.output.size())
+            {
+                connection.output.clear();
+                connection.outputOffset = 0;
+            }
+            else if (connection.outputOffset * 2 >= connection.output.size())
+            {
+                connection.output.erase(connection.output.begin(), connection.output.begin() + connection.outputOffset);
+                connection.outputOffset = 0;
+            }
+            return true;
+        }
+
+        /**
+         * \brief Creates a counter for a name, which isn't hosted until m_AddCounter is called.
+         */
+        NamedCounter m_CreateCounter(const string &name) const
+        {
+            IUniqueNumberAlgorithm::Options hints;
+            hints.numExpectedDigits = m_Options.numDigits;
+            NamedCounter named;
+            named.algorithm = IUniqueNumberAlgorithm::CreateInstance(m_Options.algorithmType, hints);
+            named.counter.reset(new UniqueNumberCounter(named.algorithm, m_Options.numDigits));
+            if (m_Registry.get() != NULL)
+            {
+                named.metrics.reset(new CounterMetrics(name, m_Options.algorithmName));
+                named.counter->SetMetrics(named.metrics);
+            }
+            return named;
+        }
+
+        /**
+         * \brief Hosts a counter made by m_CreateCounter and publishes its metrics.
+         */
+        void m_AddCounter(const string &name, const NamedCounter &named)
+        {
+            m_Counters[name] = named;
+            if (named.metrics.get() != NULL)
+                m_Registry->Add(named.metrics);
+        }
+
+        /**
+         * \brief Reads the numbers that end a ProcessNumbers or Contains request into m_Numbers.
+         */
+        void m_ReadNumbers(const vector<unsigned char> &input, size_t &offset, const size_t end)
+        {
+            uint64_t count;
+            if (!ServerProtocol::ReadVarint(input, offset, end, count) || (count > end - offset))
+                throw runtime_error("Malformed request");
+            m_Numbers.resize(static_cast<size_t>(count));
+            for (vector<string>::iterator number(m_Numbers.begin()); number != m_Numbers.end(); ++number)
+                if (!ServerProtocol::ReadString(input, offset, end, *number))
+                    throw runtime_error("Malformed request");
+            if (offset != end)
+                throw runtime_error("Malformed request");
+        }
+
+        /**
+         * \brief Handles a request and appends its response. A request that fails, e.g. because a number has the
+         *        wrong number of digits, gets an error response and leaves its counter as it was.
+         *
+         * @param[in]  input  The bytes received.
+         * @param[in]  offset Where the request starts.
+         * @param[in]  end    Where the request ends.
+         * @param[out] output The responses to send, which the response is appended to.
+         */
+        void m_HandleRequest(const vector<unsigned char> &input, size_t offset, const size_t end,
+                             vector<unsigned char> &output)
+        {
+            const size_t start(ServerProtocol::BeginFrame(output));
+            try
+            {
+                string name;
+                if (offset == end)
+                    throw runtime_error("Malformed request");
+                const unsigned char opcode(input[offset++]);
+                if (!ServerProtocol::ReadString(input, offset, end, name))
+                    throw runtime_error("Malformed request");
+                const map<string, NamedCounter>::const_iterator named(m_Counters.find(name));
+                switch (opcode)
+                {
+                case ServerProtocol::ProcessNumbers:
+                {
+                    // A name's counter is only kept once its first batch has been accepted
+                    m_ReadNumbers(input, offset, end);
+                    const bool isNew(named == m_Counters.end());
+                    const NamedCounter counter(isNew ? m_CreateCounter(name) : named->second);
+                    const size_t count(counter.counter->GetCount());
+                    counter.counter->ProcessNumbers(m_Numbers);
+                    if (isNew)
+                        m_AddCounter(name, counter);
+                    output.push_back(ServerProtocol::Ok);
+                    ServerProtocol::AppendVarint(counter.counter->GetCount() - count, output);
+                    break;
+                }
+                case ServerProtocol::Contains:
+                {
+                    m_ReadNumbers(input, offset, end);
+                    output.push_back(ServerProtocol::Ok);
+                    const size_t bitmap(output.size());
+                    output.resize(bitmap + (m_Numbers.size() + 7) / 8, 0);
+                    if (named != m_Counters.end())
+                        for (size_t number(0); number < m_Numbers.size(); ++number)
+                            if (named->second.algorithm->Contains(m_Numbers[number]))
+                                output[bitmap + number / 8] |= static_cast<unsigned char>(1 << (number % 8));
+                    break;
+                }
+                case ServerProtocol::GetCount:
+                    if (offset != end)
+                        throw runtime_error("Malformed request");
+                    output.push_back(ServerProtocol::Ok);
+                    ServerProtocol::AppendVarint(named != m_Counters.end() ? named->second.counter->GetCount() : 0, output);
+                    break;
+                default:
+                    throw runtime_error("Unknown request");
+                }
+            }
+            catch (const exception &error)
+            {
+                output.resize(start + ServerProtocol::FrameHeaderSize);
+                output.push_back(ServerProtocol::Failed);
+                ServerProtocol::AppendString(error.what(), output);
+            }
+            ServerProtocol::EndFrame(output, start);
+        }
+
+        const Options m_Options;                /**< Where to listen and how to create counters. */
+        const int m_Epoll;                      /**< The epoll instance watching every socket. */
+        time_t m_MemoryTime;                    /**< When the counters' memory was last measured. */
+        vector<int> m_Listeners;                /**< Listening sockets. */
+        ConnectionMap m_Connections;            /**< Clients, by socket. */
+        map<string, NamedCounter> m_Counters;   /**< Counters, by name. */
+        vector<string> m_Numbers;               /**< Numbers of the request being handled. */
+        shared_ptr<MetricsRegistry> m_Registry; /**< Metrics of every counter, if they're served. */
+        shared_ptr<MetricsEndpoint> m_Endpoint; /**< Serves m_Registry. */
+    };
+
+    /**
+     * \brief Prints the command line usage and exits.
+     */
+    void Usage(const char *program)
+    {
+        cerr << "usage: " << program << " [--socket PATH] [--port N] [--algorithm tree|set|interval|bitmap|hash|btree|bittree|swiss]"
+             << " [--digits N] [--metrics-port N]" << endl;
+        exit(1);
+    }
+}
+
+/**
+ * \brief Serves named counters to local clients over a Unix domain socket and/or a loopback TCP port. See
+ *        ServerProtocol.h for the requests it answers, and LoadGenerator for measuring it.
+ */
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int arg(1); arg < argc; ++arg)
+    {
+        const string name(argv[arg]);
+        if (arg + 1 >= argc)
+            Usage(argv[0]);
+        const string value(argv[++arg]);
+        if (name == "--socket")
+            options.socketPath = value;
+        else if (name == "--port")
+            options.port = static_cast<unsigned short>(strtoul(value.c_str(), NULL, 10));
+        else if (name == "--digits")
+            options.numDigits = strtoul(value.c_str(), NULL, 10);
+        else if (name == "--metrics-port")
+            options.metricsPort = static_cast<unsigned short>(strtoul(value.c_str(), NULL, 10));
+        else if (name == "--algorithm")
+        {
+            options.algorithmName = value;
+            if (value == "tree")
+                options.algorithmType = IUniqueNumberAlgorithm::CompactRadixTree;
+            else if (value == "set")
+                options.algorithmType = IUniqueNumberAlgorithm::Set;
+            else if (value == "interval")
+                options.algorithmType = IUniqueNumberAlgorithm::IntervalSet;
+            else if (value == "bitmap")
+                options.algorithmType = IUniqueNumberAlgorithm::SparseBitmap;
+            else if (value == "hash")
+                options.algorithmType = IUniqueNumberAlgorithm::Hash;
+            else if (value == "btree")
+                options.algorithmType = IUniqueNumberAlgorithm::BTree;
+            else if (value == "bittree")
+                options.algorithmType = IUniqueNumberAlgorithm::BitmapTree;
+            else if (value == "swiss")
+                options.algorithmType = IUniqueNumberAlgorithm::SwissHash;
+            else
+                Usage(argv[0]);
+        }
+        else
+            Usage(argv[0]);
+    }
+    if ((options.socketPath.empty() && (options.port == 0)) || (options.numDigits == 0))
+        Usage(argv[0]);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = Stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    try
+    {
+        Server server(options);
+        server.Run();
+    }
+    catch (const exception &error)
+    {
+        cerr << error.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * \brief The wire format spoken by Server and LoadGenerator. Every request and response is a frame: a 4 byte
+ *        little-endian length followed by that many bytes. A request is an opcode byte, the counter's name as a
+ *        varint length and its characters, then for ProcessNumbers and Contains a varint count and each number
+ *        as a varint length and its characters. A response is a status byte followed, on success, by a varint
+ *        (the numbers that became unique for ProcessNumbers, the count for GetCount) or, for Contains, a bitmap
+ *        of one bit per number, least significant bit first; on failure it is followed by the error message.
+ *        Clients may send any number of requests before reading, and responses arrive in request order.
+ */
+namespace ServerProtocol
+{
+    /**
+     * \brief What a request asks for.
+     */
+    enum Opcode
+    {
+        ProcessNumbers = 1, /**< Processes a batch of numbers, creating the counter if needed. */
+        Contains = 2,       /**< Checks a batch of numbers without storing them. */
+        GetCount = 3        /**< Returns the counter's count, or 0 if it doesn't exist. */
+    };
+
+    /**
+     * \brief Whether a request succeeded.
+     */
+    enum Status
+    {
+        Ok = 0,    /**< The response holds the result. */
+        Failed = 1 /**< The response holds an error message. */
+    };
+
+    /**
+     * \brief Bytes in the length at the start of each frame.
+     */
+    const size_t FrameHeaderSize = 4;
+
+    /**
+     * \brief Largest frame either side accepts, so that a corrupt length can't exhaust memory.
+     */
+    const size_t MaxFrameSize = 64 << 20;
+
+    /**
+     * \brief Appends a value 7 bits per byte, least significant first, with the top bit set on all but the last.
+     */
+    inline void AppendVarint(uint64_t value, std::vector<unsigned char> &buffer)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<unsigned char>(value));
+    }
+
+    /**
+     * \brief Reads a value written by AppendVarint.
+     *
+     * @param[in]     buffer The bytes.
+     * @param[in,out] offset Where the value starts, advanced past it.
+     * @param[in]     end    Where the frame holding the value ends.
+     * @param[out]    value  Receives the value.
+     *
+     * @return Returns false if the value runs past end.
+     */
+    inline bool ReadVarint(const std::vector<unsigned char> &buffer, size_t &offset, const size_t end, uint64_t &value)
+    {
+        value = 0;
+        for (size_t shift(0); (offset < end) && (shift < 64); shift += 7)
+        {
+            const unsigned char byte(buffer[offset++]);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * \brief Appends a string as its varint length and its characters.
+     */
+    inline void AppendString(const std::string &value, std::vector<unsigned char> &buffer)
+    {
+        AppendVarint(value.size(), buffer);
+        buffer.insert(buffer.end(), value.begin(), value.end());
+    }
+
+    /**
+     * \brief Reads a string written by AppendString.
+     *
+     * @return Returns false if the string runs past end.
+     */
+    inline bool ReadString(const std::vector<unsigned char> &buffer, size_t &offset, const size_t end, std::string &value)
+    {
+        uint64_t size;
+        if (!ReadVarint(buffer, offset, end, size) || (size > end - offset))
+            return false;
+        value.assign(buffer.begin() + offset, buffer.begin() + offset + static_cast<size_t>(size));
+        offset += static_cast<size_t>(size);
+        return true;
+    }
+
+    /**
+     * \brief Reserves the length of a new frame at the end of buffer.
+     *
+     * @return Returns where the frame starts, to be given to EndFrame.
+     */
+    inline size_t BeginFrame(std::vector<unsigned char> &buffer)
+    {
+        const size_t start(buffer.size());
+        buffer.resize(start + FrameHeaderSize);
+        return start;
+    }
+
+    /**
+     * \brief Fills in the length of the frame started at start, which runs to the end of buffer.
+     */
+    inline void EndFrame(std::vector<unsigned char> &buffer, const size_t start)
+    {
+        const size_t size(buffer.size() - start - FrameHeaderSize);
+        for (size_t byte(0); byte < FrameHeaderSize; ++byte)
+            buffer[start + byte] = static_cast<unsigned char>(size >> (8 * byte));
+    }
+
+    /**
+     * \brief Finds the frame starting at offset.
+     *
+     * @param[in]  buffer The bytes received.
+     * @param[in]  offset Where the frame starts.
+     * @param[out] size   Receives the size of the frame after its length, or 0 if the length hasn't arrived.
+     *
+     * @return Returns false if the frame hasn't been received completely.
+     */
+    inline bool GetFrame(const std::vector<unsigned char> &buffer, const size_t offset, size_t &size)
+    {
+        size = 0;
+        if (buffer.size() - offset < FrameHeaderSize)
+            return false;
+        for (size_t byte(0); byte < FrameHeaderSize; ++byte)
+            size |= static_cast<size_t>(buffer[offset + byte]) << (8 * byte);
+        return buffer.size() - offset - FrameHeaderSize >= size;
+    }
+}
@@ -1,9 +1,17 @@
+#include <algorithm>
+#include <arpa/inet.h>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <gtest/gtest.h>
+#include <iomanip>
+#include <netinet/in.h>
 #include <set>
 #include <sstream>
 #include <string>
+#include <sys/socket.h>
 #include <tr1/memory>
+#include <unistd.h>
 #include <vector>
 #include "UniqueNumberCounter.h"
 
@@ -22,6 +30,8 @@ namespace
         counter.ProcessNumber("442");
         counter.ProcessNumber("441");
         EXPECT_EQ(5, counter.GetCount());
+        EXPECT_EQ(5, algorithm->GetCount());
+        EXPECT_GT(algorithm->GetMemoryUsage(), 0);
     }
 
     void TestFullData(shared_ptr<IUniqueNumberAlgorithm> algorithm)
@@ -35,6 +45,7 @@ namespace
             counter.ProcessNumber(out.str());
         }
         EXPECT_EQ(numDigits * 10, counter.GetCount());
+        EXPECT_EQ(numDigits * 10, algorithm->GetCount());
     }
 
     void TestAlgorithm(shared_ptr<IUniqueNumberAlgorithm> algorithm)
@@ -52,6 +63,41 @@ namespace
             counter.ProcessNumber(*entry);
         return counter.GetCount();
     }
+
+    /**
+     * \brief Collects the numbers it visits, stopping after a limit.
+     */
+    class CollectingVisitor : public IUniqueNumberAlgorithm::Visitor
+    {
+    public:
+        explicit CollectingVisitor(const size_t limit = ~static_cast<size_t>(0)) : m_Limit(limit) {}
+
+        virtual bool Visit(const string &number)
+        {
+            numbers.push_back(number);
+            return numbers.size() < m_Limit;
+        }
+
+        Dataset numbers;
+
+    private:
+        size_t m_Limit;
+    };
+
+    Dataset GenerateDataset(const size_t numDigits, const size_t size)
+    {
+        Dataset dataset;
+        for (size_t count(0); count < size; ++count)
+        {
+            ostringstream out;
+            out << setw(numDigits) << setfill('0') << rand();
+            string value(out.str());
+            if (value.size() > numDigits)
+                value.resize(numDigits);
+            dataset.push_back(value);
+        }
+        return dataset;
+    }
 }
 
 TEST(TestUniqueNumberCounter, NullAlgorithm)
@@ -80,21 +126,275 @@ TEST(TestUniqueNumberCounter, CompactRadixTreeAlgorithmSmallDataSet)
     TestAlgorithm(algorithm);
 }
 
-TEST(TestUniqueNumberCounter, LargeDataSet)
+TEST(TestUniqueNumberCounter, SwissHashAlgorithmSmallDataSet)
 {
-    // Generate a large data set
+    TestAlgorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SwissHash));
+}
+
+TEST(TestUniqueNumberCounter, SwissHashAlgorithmBatches)
+{
+    const size_t numDigits(7);
+    const Dataset dataset(GenerateDataset(numDigits, 200000));
+    const size_t expectedCount(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)));
+
+    // Unpartitioned batches go through InsertBatch, which grows the table part way through
+    IUniqueNumberAlgorithm::Options options;
+    options.numExpectedDigits = numDigits;
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SwissHash, options));
+    UniqueNumberCounter counter(algorithm, numDigits);
+    counter.SetNumPartitionDigits(0);
+    counter.ProcessNumbers(Dataset(dataset.begin(), dataset.begin() + 1000));
+    counter.ProcessNumbers(dataset);
+    EXPECT_EQ(expectedCount, counter.GetCount());
+    EXPECT_EQ(expectedCount, algorithm->GetCount());
+
+    // At most 7/8 full, and never less than a quarter full after growing
+    EXPECT_LT(algorithm->GetMemoryUsage(), expectedCount * 9 * 4 + 1024);
+    EXPECT_FALSE(algorithm->IsUnique(dataset.back()));
+}
+
+TEST(TestUniqueNumberCounter, IntervalSetAlgorithmSmallDataSet)
+{
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::IntervalSet));
+    TestAlgorithm(algorithm);
+}
+
+TEST(TestUniqueNumberCounter, IntervalSetAlgorithmRuns)
+{
+    // Runs of consecutive numbers arriving out of order, so intervals are extended at both ends and merged
+    const size_t numDigits(5);
     Dataset dataset;
-    const size_t maxDigits(static_cast<size_t>(log10(RAND_MAX)));
-    for (size_t count(0); count < 1000000; ++count)
+    for (size_t run(0); run < 500; ++run)
+    {
+        const size_t start(rand() % 99000);
+        const size_t length(rand() % 200);
+        for (size_t offset(0); offset < length; ++offset)
+        {
+            ostringstream out;
+            out << setw(numDigits) << setfill('0') << start + offset;
+            dataset.push_back(out.str());
+        }
+    }
+    random_shuffle(dataset.begin(), dataset.end());
+
+    const size_t expectedCount(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)));
+    EXPECT_EQ(expectedCount, ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::IntervalSet)));
+
+    // Filling every gap collapses everything into a single interval
+    Dataset all;
+    for (size_t number(0); number < 100000; ++number)
+    {
+        ostringstream out;
+        out << setw(numDigits) << setfill('0') << number;
+        all.push_back(out.str());
+    }
+    random_shuffle(all.begin(), all.end());
+    EXPECT_EQ(all.size(), ProcessDataset(numDigits, all, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::IntervalSet)));
+}
+
+TEST(TestUniqueNumberCounter, SparseBitmapAlgorithmSmallDataSet)
+{
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SparseBitmap));
+    TestAlgorithm(algorithm);
+}
+
+TEST(TestUniqueNumberCounter, SparseBitmapAlgorithmWideNumbers)
+{
+    // A handful of 12 digit numbers only touches a handful of 64 KB blocks out of a 125 GB universe
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SparseBitmap));
+    UniqueNumberCounter counter(algorithm, 12);
+    counter.ProcessNumber("000000000000");
+    counter.ProcessNumber("999999999999");
+    counter.ProcessNumber("500000000000");
+    counter.ProcessNumber("500000000001");
+    counter.ProcessNumber("999999999999");
+    EXPECT_EQ(4, counter.GetCount());
+    EXPECT_EQ(4, algorithm->GetCount());
+    EXPECT_LT(algorithm->GetMemoryUsage(), 1024 * 1024);
+
+    UniqueNumberCounter wideCounter(algorithm, 13);
+    EXPECT_THROW(wideCounter.ProcessNumber("1000000000000"), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, SortedBlockAlgorithmSmallDataSet)
+{
+    TestAlgorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SortedBlocks));
+}
+
+TEST(TestUniqueNumberCounter, SortedBlockAlgorithmWideNumbers)
+{
+    // Numbers far enough apart that they can't share a block, arriving in descending order so that every
+    // insert lowers a block's minimum
+    const size_t numDigits(19);
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SortedBlocks));
+    UniqueNumberCounter counter(algorithm, numDigits);
+    for (size_t block(0); block < 10; ++block)
+    {
+        for (size_t number(2000); number > 0; --number)
+        {
+            ostringstream out;
+            out << block << setw(numDigits - 1) << setfill('0') << number * 997;
+            counter.ProcessNumber(out.str());
+            counter.ProcessNumber(out.str());
+        }
+    }
+    EXPECT_EQ(20000, counter.GetCount());
+
+    // Moderately dense numbers take a couple of bytes each
+    const size_t population(100000);
+    shared_ptr<IUniqueNumberAlgorithm> dense(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SortedBlocks));
+    UniqueNumberCounter denseCounter(dense, 9);
+    for (size_t number(0); number < population; ++number)
     {
         ostringstream out;
-        out << setw(maxDigits) << setfill('0') << rand();
-        string value(out.str());
-        if (value.size() > maxDigits)
-            value.resize(maxDigits);
-        dataset.push_back(value);
+        out << setw(9) << setfill('0') << (number * 7919) % 100000007 % 10000000;
+        denseCounter.ProcessNumber(out.str());
+    }
+    EXPECT_EQ(population, denseCounter.GetCount());
+    EXPECT_LT(dense->GetMemoryUsage(), 3 * population);
+}
+
+TEST(TestUniqueNumberCounter, BTreeAlgorithmSmallDataSet)
+{
+    TestAlgorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BTree));
+}
+
+TEST(TestUniqueNumberCounter, BTreeAlgorithmOrderedVisits)
+{
+    const size_t numDigits(6);
+    const Dataset dataset(GenerateDataset(numDigits, 50000));
+    const set<string> expected(dataset.begin(), dataset.end());
+
+    // Insert one at a time and bulk load, both of which must visit the same sorted numbers
+    shared_ptr<IUniqueNumberAlgorithm> inserted(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BTree));
+    EXPECT_EQ(expected.size(), ProcessDataset(numDigits, dataset, inserted));
+    shared_ptr<IUniqueNumberAlgorithm> loaded(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BTree));
+    EXPECT_EQ(expected.size(), loaded->InsertBatch(dataset));
+    EXPECT_EQ(0, loaded->InsertBatch(Dataset(dataset.begin(), dataset.begin() + 100)));
+    EXPECT_FALSE(loaded->IsUnique(dataset[0]));
+
+    for (size_t index(0); index < 2; ++index)
+    {
+        const IUniqueNumberAlgorithm &algorithm(index == 0 ? *inserted : *loaded);
+        CollectingVisitor all;
+        algorithm.Visit(all);
+        EXPECT_TRUE(all.numbers == Dataset(expected.begin(), expected.end()));
+
+        CollectingVisitor range;
+        algorithm.VisitRange("250000", "259999", range);
+        EXPECT_TRUE(range.numbers == Dataset(expected.lower_bound("250000"), expected.upper_bound("259999")));
+
+        CollectingVisitor limited(10);
+        algorithm.VisitRange("500000", "999999", limited);
+        EXPECT_EQ(10, limited.numbers.size());
+    }
+
+    CollectingVisitor visitor;
+    EXPECT_THROW(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash)->Visit(visitor), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, BitmapTreeAlgorithmSmallDataSet)
+{
+    TestAlgorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BitmapTree));
+}
+
+TEST(TestUniqueNumberCounter, BitmapTreeAlgorithmSuccessors)
+{
+    const size_t numDigits(9);
+    const Dataset dataset(GenerateDataset(numDigits, 20000));
+    const set<string> expected(dataset.begin(), dataset.end());
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BitmapTree));
+    EXPECT_EQ(expected.size(), ProcessDataset(numDigits, dataset, algorithm));
+
+    // Query stored numbers and the numbers either side of them
+    string result;
+    for (size_t index(0); index < 2000; ++index)
+    {
+        const string queries[] = { dataset[index], GenerateDataset(numDigits, 1)[0] };
+        for (size_t query(0); query < 2; ++query)
+        {
+            const set<string>::const_iterator next(expected.upper_bound(queries[query]));
+            EXPECT_EQ(next != expected.end(), algorithm->GetSuccessor(queries[query], result));
+            if (next != expected.end())
+            {
+                EXPECT_EQ(*next, result);
+            }
+
+            const set<string>::const_iterator previous(expected.lower_bound(queries[query]));
+            EXPECT_EQ(previous != expected.begin(), algorithm->GetPredecessor(queries[query], result));
+            if (previous != expected.begin())
+            {
+                EXPECT_EQ(*--set<string>::const_iterator(previous), result);
+            }
+        }
     }
 
+    // Numbers beyond the largest stored one, including longer ones
+    EXPECT_FALSE(algorithm->GetSuccessor(*expected.rbegin(), result));
+    EXPECT_TRUE(algorithm->GetPredecessor("9999999999999", result));
+    EXPECT_EQ(*expected.rbegin(), result);
+    EXPECT_TRUE(algorithm->GetSuccessor("12", result));
+    EXPECT_EQ(*expected.begin(), result);
+    EXPECT_FALSE(algorithm->GetPredecessor(*expected.begin(), result));
+
+    CollectingVisitor all;
+    algorithm->Visit(all);
+    EXPECT_TRUE(all.numbers == Dataset(expected.begin(), expected.end()));
+    CollectingVisitor range;
+    algorithm->VisitRange("100000000", "199999999", range);
+    EXPECT_TRUE(range.numbers == Dataset(expected.lower_bound("100000000"), expected.upper_bound("199999999")));
+
+    EXPECT_THROW(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)->GetSuccessor("1", result), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, HashAlgorithmSmallDataSet)
+{
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash));
+    TestAlgorithm(algorithm);
+}
+
+TEST(TestUniqueNumberCounter, WideNumbers)
+{
+    // 16 digit card numbers and 30 digit identifiers, built from a small pool of halves so there are duplicates
+    const size_t widths[] = { 16, 30 };
+    for (size_t width(0); width < sizeof(widths) / sizeof(widths[0]); ++width)
+    {
+        const size_t numDigits(widths[width]);
+        Dataset dataset;
+        for (size_t count(0); count < 20000; ++count)
+        {
+            ostringstream out;
+            out << setw(numDigits - 8) << setfill('0') << rand() % 100 << setw(8) << setfill('0') << rand() % 1000;
+            dataset.push_back(out.str());
+        }
+        const size_t expectedCount(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)));
+
+        IUniqueNumberAlgorithm::Options options;
+        options.numExpectedDigits = numDigits;
+        const IUniqueNumberAlgorithm::AlgorithmType algorithmTypes[] = { IUniqueNumberAlgorithm::Set,
+                                                                         IUniqueNumberAlgorithm::Hash,
+                                                                         IUniqueNumberAlgorithm::CompactRadixTree };
+        for (size_t type(0); type < sizeof(algorithmTypes) / sizeof(algorithmTypes[0]); ++type)
+        {
+            EXPECT_EQ(expectedCount, ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(algorithmTypes[type], options)));
+            EXPECT_EQ(expectedCount, ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(algorithmTypes[type])));
+        }
+    }
+
+    // Packing is length-aware, so numbers that only differ in leading zeros stay distinct
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash));
+    EXPECT_TRUE(algorithm->IsUnique("0123"));
+    EXPECT_TRUE(algorithm->IsUnique("123"));
+    EXPECT_FALSE(algorithm->IsUnique("0123"));
+    EXPECT_THROW(algorithm->IsUnique(string(39, '1')), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, LargeDataSet)
+{
+    // Generate a large data set
+    const size_t maxDigits(static_cast<size_t>(log10(RAND_MAX)));
+    const Dataset dataset(GenerateDataset(maxDigits, 1000000));
+
     size_t firstCount(0);
     {
         shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set));
@@ -108,4 +408,972 @@ TEST(TestUniqueNumberCounter, LargeDataSet)
         secondCount = ProcessDataset(maxDigits, dataset, algorithm);
     }
     EXPECT_EQ(firstCount, secondCount);
+
+    size_t thirdCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::IntervalSet));
+        thirdCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, thirdCount);
+
+    size_t fourthCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SparseBitmap));
+        fourthCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, fourthCount);
+
+    size_t fifthCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash));
+        fifthCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, fifthCount);
+
+    size_t sixthCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SortedBlocks));
+        sixthCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, sixthCount);
+
+    size_t seventhCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BTree));
+        seventhCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, seventhCount);
+
+    size_t eighthCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::BitmapTree));
+        eighthCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, eighthCount);
+
+    size_t ninthCount(0);
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::SwissHash));
+        ninthCount = ProcessDataset(maxDigits, dataset, algorithm);
+    }
+    EXPECT_EQ(firstCount, ninthCount);
+}
+
+TEST(TestUniqueNumberCounter, PartitionedBatches)
+{
+    const size_t numDigits(6);
+    const Dataset dataset(GenerateDataset(numDigits, 100000));
+    const IUniqueNumberAlgorithm::AlgorithmType algorithmTypes[] = { IUniqueNumberAlgorithm::Set,
+                                                                     IUniqueNumberAlgorithm::CompactRadixTree };
+    for (size_t type(0); type < sizeof(algorithmTypes) / sizeof(algorithmTypes[0]); ++type)
+    {
+        const size_t expectedCount(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(algorithmTypes[type])));
+        for (size_t numPartitionDigits(0); numPartitionDigits <= numDigits; numPartitionDigits += 2)
+        {
+            UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(algorithmTypes[type]), numDigits);
+            counter.SetNumPartitionDigits(numPartitionDigits);
+            const size_t half(dataset.size() / 2);
+            counter.ProcessNumbers(Dataset(dataset.begin(), dataset.begin() + half));
+            counter.ProcessNumbers(Dataset(dataset.begin() + half, dataset.end()));
+            EXPECT_EQ(expectedCount, counter.GetCount());
+        }
+    }
+}
+
+TEST(TestUniqueNumberCounter, PartitionedBatchRejectedAsWhole)
+{
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree), 3);
+    EXPECT_THROW(counter.SetNumPartitionDigits(4), runtime_error);
+
+    Dataset dataset;
+    dataset.push_back("123");
+    dataset.push_back("12a");
+    EXPECT_THROW(counter.ProcessNumbers(dataset), runtime_error);
+    EXPECT_EQ(0, counter.GetCount());
+
+    dataset[1] = "124";
+    counter.ProcessNumbers(dataset);
+    EXPECT_EQ(2, counter.GetCount());
+}
+
+TEST(TestUniqueNumberCounter, CompactRadixTreeDirectory)
+{
+    EXPECT_EQ(0, IUniqueNumberAlgorithm::Options().expectedPopulation);
+
+    const size_t numDigits(6);
+    const Dataset dataset(GenerateDataset(numDigits, 100000));
+    const size_t expectedCount(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)));
+
+    IUniqueNumberAlgorithm::Options options;
+    options.numExpectedDigits = numDigits;
+    options.expectedPopulation = dataset.size();
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree, options));
+    EXPECT_EQ(expectedCount, ProcessDataset(numDigits, dataset, algorithm));
+
+    // The directory resolves leading digits, so shorter numbers can't be stored
+    EXPECT_THROW(ProcessDataset(3, Dataset(1, "123"), algorithm), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, CompactRadixTreeLeafMemory)
+{
+    // Most edges are leaves, which are packed into their node's slot rather than allocated, so the tree stays
+    // well under the ~370 bytes per number it took when each carried a child node
+    const size_t numDigits(9);
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree));
+    const size_t count(ProcessDataset(numDigits, GenerateDataset(numDigits, 100000), algorithm));
+    EXPECT_LT(algorithm->GetMemoryUsage(), 100 * count);
+}
+
+TEST(TestUniqueNumberCounter, CompactRadixTreeInlineLeaves)
+{
+    // Leaves packed inline are expanded when a second number arrives under them, whether it's longer, shorter
+    // or diverges, and leaves too long to pack are kept as edges
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree));
+    EXPECT_TRUE(algorithm->IsUnique("123456789"));
+    EXPECT_FALSE(algorithm->IsUnique("123456789"));
+    EXPECT_TRUE(algorithm->IsUnique("123456780"));
+    EXPECT_TRUE(algorithm->IsUnique("1234"));
+    EXPECT_TRUE(algorithm->IsUnique("1234567890"));
+    EXPECT_TRUE(algorithm->IsUnique("100000000000000000000000"));
+    EXPECT_TRUE(algorithm->IsUnique("100000000000000000000001"));
+    EXPECT_FALSE(algorithm->IsUnique("123456789"));
+    EXPECT_FALSE(algorithm->IsUnique("1234"));
+    EXPECT_FALSE(algorithm->IsUnique("100000000000000000000000"));
+    EXPECT_TRUE(algorithm->IsUnique("12345678"));
+    EXPECT_EQ(7, algorithm->GetCount());
+}
+
+TEST(TestUniqueNumberCounter, CompactRadixTreeFreeze)
+{
+    // Every prefix has the same suffixes, so freezing shares one copy of them
+    const char *suffixes[] = {"000", "017", "042", "999"};
+    Dataset dataset;
+    for (size_t prefix(0); prefix < 1000; ++prefix)
+    {
+        for (size_t suffix(0); suffix < 4; ++suffix)
+        {
+            ostringstream out;
+            out << setw(3) << setfill('0') << prefix << suffixes[suffix];
+            dataset.push_back(out.str());
+        }
+    }
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree));
+    EXPECT_EQ(dataset.size(), ProcessDataset(6, dataset, algorithm));
+    const size_t memoryUsage(algorithm->GetMemoryUsage());
+    algorithm->Freeze();
+    EXPECT_LT(algorithm->GetMemoryUsage(), memoryUsage / 4);
+    EXPECT_EQ(dataset.size(), algorithm->GetCount());
+
+    for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+        EXPECT_TRUE(algorithm->Contains(*number));
+    EXPECT_FALSE(algorithm->Contains("123001"));
+    EXPECT_FALSE(algorithm->Contains("12300"));
+    EXPECT_FALSE(algorithm->Contains("1230000"));
+    EXPECT_FALSE(algorithm->IsUnique("123017"));
+    EXPECT_THROW(algorithm->IsUnique("123001"), runtime_error);
+
+    algorithm->Reset();
+    EXPECT_TRUE(algorithm->IsUnique("123001"));
+
+    shared_ptr<IUniqueNumberAlgorithm> hash(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash));
+    EXPECT_THROW(hash->Freeze(), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, CompactRadixTreeCompact)
+{
+    // Slices of each pass are interleaved with inserts, which land both before and after where it has got to
+    const size_t numDigits(9);
+    const Dataset dataset(GenerateDataset(numDigits, 40000));
+    IUniqueNumberAlgorithm::Options options;
+    options.numExpectedDigits = numDigits;
+    options.expectedPopulation = dataset.size();
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree, options));
+    shared_ptr<IUniqueNumberAlgorithm> expected(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set));
+    for (size_t index(0); index < dataset.size(); ++index)
+    {
+        EXPECT_EQ(expected->IsUnique(dataset[index]), algorithm->IsUnique(dataset[index]));
+        if ((index >= dataset.size() / 2) && (index % 10 == 0))
+            algorithm->Compact(100);
+    }
+    while (!algorithm->Compact(100))
+        ;
+    EXPECT_EQ(expected->GetCount(), algorithm->GetCount());
+    CollectingVisitor visited;
+    CollectingVisitor expectedVisited;
+    algorithm->Export(visited);
+    expected->Export(expectedVisited);
+    EXPECT_TRUE(visited.numbers == expectedVisited.numbers);
+    for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+        EXPECT_TRUE(algorithm->Contains(*number));
+    EXPECT_TRUE(algorithm->IsUnique(dataset[0] + "1"));
+    EXPECT_FALSE(algorithm->Contains(dataset[0] + "2"));
+    EXPECT_THROW(algorithm->Compact(0), runtime_error);
+
+    // A frozen tree still shares its subtrees after they move
+    shared_ptr<IUniqueNumberAlgorithm> frozen(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree));
+    const size_t count(ProcessDataset(numDigits, Dataset(dataset.begin(), dataset.begin() + 5000), frozen));
+    frozen->Freeze();
+    const size_t memoryUsage(frozen->GetMemoryUsage());
+    while (!frozen->Compact(7))
+        ;
+    EXPECT_EQ(memoryUsage, frozen->GetMemoryUsage());
+    EXPECT_EQ(count, frozen->GetCount());
+    for (Dataset::const_iterator number(dataset.begin()); number != dataset.begin() + 5000; ++number)
+        EXPECT_TRUE(frozen->Contains(*number));
+
+    shared_ptr<IUniqueNumberAlgorithm> hash(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash));
+    EXPECT_THROW(hash->Compact(100), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, PrefixCounts)
+{
+    const size_t numDigits(6);
+    Dataset dataset(GenerateDataset(numDigits, 20000));
+    vector<size_t> expectedCounts;
+    for (size_t length(1); length <= numDigits; ++length)
+    {
+        set<string> prefixes;
+        for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+            prefixes.insert(number->substr(0, length));
+        expectedCounts.push_back(prefixes.size());
+    }
+
+    // With and without a directory resolving the leading digits
+    for (size_t expectedPopulation(0); expectedPopulation <= dataset.size(); expectedPopulation += dataset.size())
+    {
+        IUniqueNumberAlgorithm::Options options;
+        options.numExpectedDigits = numDigits;
+        options.expectedPopulation = expectedPopulation;
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree, options));
+        UniqueNumberCounter counter(algorithm, numDigits);
+        counter.ProcessNumbers(dataset);
+        vector<size_t> counts;
+        counter.GetPrefixCounts(counts);
+        EXPECT_TRUE(counts == expectedCounts);
+    }
+
+    // Sorted numbers are counted by the counter itself
+    sort(dataset.begin(), dataset.end());
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits);
+    counter.SetOrdering(UniqueNumberCounter::Sorted);
+    counter.ProcessNumbers(dataset);
+    vector<size_t> counts;
+    counter.GetPrefixCounts(counts);
+    EXPECT_TRUE(counts == expectedCounts);
+}
+
+namespace
+{
+    /**
+     * \brief Records the outcome of a background snapshot.
+     */
+    class RecordingListener : public SnapshotListener
+    {
+    public:
+        RecordingListener() :
+            numCompleted(0),
+            succeeded(false)
+        {
+        }
+
+        virtual void OnSnapshotComplete(const string &, const bool snapshotSucceeded)
+        {
+            ++numCompleted;
+            succeeded = snapshotSucceeded;
+        }
+
+        size_t numCompleted; /**< Number of snapshots that have finished. */
+        bool succeeded;      /**< Outcome of the last snapshot. */
+    };
+}
+
+TEST(TestUniqueNumberCounter, Contains)
+{
+    // Half of the numbers are stored, so the other half probes between and around them
+    const size_t numDigits(9);
+    const Dataset dataset(GenerateDataset(numDigits, 40000));
+    const Dataset stored(dataset.begin(), dataset.begin() + dataset.size() / 2);
+    set<string> expected(stored.begin(), stored.end());
+    const IUniqueNumberAlgorithm::AlgorithmType exactTypes[] = { IUniqueNumberAlgorithm::CompactRadixTree,
+                                                                 IUniqueNumberAlgorithm::Set,
+                                                                 IUniqueNumberAlgorithm::IntervalSet,
+                                                                 IUniqueNumberAlgorithm::SparseBitmap,
+                                                                 IUniqueNumberAlgorithm::Hash,
+                                                                 IUniqueNumberAlgorithm::SortedBlocks,
+                                                                 IUniqueNumberAlgorithm::BTree,
+                                                                 IUniqueNumberAlgorithm::BitmapTree,
+                                                                 IUniqueNumberAlgorithm::SwissHash };
+    for (size_t index(0); index < sizeof(exactTypes) / sizeof(exactTypes[0]); ++index)
+    {
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(exactTypes[index]));
+        ProcessDataset(numDigits, stored, algorithm);
+        size_t numWrong(0);
+        for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+            if (algorithm->Contains(*number) != (expected.count(*number) != 0))
+                numWrong++;
+        EXPECT_EQ(0, numWrong);
+    }
+
+    // Runs of consecutive numbers are merged into intervals, whose ends must still be exact
+    shared_ptr<IUniqueNumberAlgorithm> intervals(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::IntervalSet));
+    for (size_t value(100); value < 200; ++value)
+    {
+        ostringstream out;
+        out << setw(numDigits) << setfill('0') << value;
+        intervals->IsUnique(out.str());
+    }
+    EXPECT_FALSE(intervals->Contains("000000099"));
+    EXPECT_TRUE(intervals->Contains("000000100"));
+    EXPECT_TRUE(intervals->Contains("000000150"));
+    EXPECT_TRUE(intervals->Contains("000000199"));
+    EXPECT_FALSE(intervals->Contains("000000200"));
+
+    shared_ptr<IUniqueNumberAlgorithm> theta(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Theta));
+    EXPECT_THROW(theta->Contains(dataset[0]), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, Snapshots)
+{
+    const string path("TestSnapshot.bin");
+    const size_t numDigits(7);
+    const Dataset dataset(GenerateDataset(numDigits, 50000));
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree), numDigits);
+    counter.ProcessNumbers(dataset);
+
+    // Written in the foreground
+    counter.WriteSnapshot(path);
+    shared_ptr<IUniqueNumberAlgorithm> restored(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set));
+    UniqueNumberCounter restoredCounter(restored, numDigits);
+    restoredCounter.LoadSnapshot(path);
+    EXPECT_EQ(counter.GetCount(), restoredCounter.GetCount());
+    for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+        EXPECT_FALSE(restored->IsUnique(*number));
+
+    // Written by a child process while the parent carries on
+    shared_ptr<RecordingListener> listener(new RecordingListener);
+    counter.StartSnapshot(path, listener);
+    EXPECT_THROW(counter.StartSnapshot(path), runtime_error);
+    counter.ProcessNumber("0000000");
+    counter.PollSnapshot(true);
+    EXPECT_EQ(1, listener->numCompleted);
+    EXPECT_TRUE(listener->succeeded);
+    EXPECT_FALSE(counter.PollSnapshot());
+    UniqueNumberCounter backgroundCounter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits);
+    backgroundCounter.LoadSnapshot(path);
+    EXPECT_EQ(restoredCounter.GetCount(), backgroundCounter.GetCount());
+
+    // Every exact algorithm can list its numbers
+    const IUniqueNumberAlgorithm::AlgorithmType exactTypes[] = { IUniqueNumberAlgorithm::IntervalSet,
+                                                                 IUniqueNumberAlgorithm::SparseBitmap,
+                                                                 IUniqueNumberAlgorithm::SortedBlocks,
+                                                                 IUniqueNumberAlgorithm::BTree,
+                                                                 IUniqueNumberAlgorithm::BitmapTree,
+                                                                 IUniqueNumberAlgorithm::SwissHash };
+    for (size_t index(0); index < sizeof(exactTypes) / sizeof(exactTypes[0]); ++index)
+    {
+        UniqueNumberCounter exactCounter(IUniqueNumberAlgorithm::CreateInstance(exactTypes[index]), numDigits);
+        exactCounter.ProcessNumbers(dataset);
+        exactCounter.WriteSnapshot(path);
+        shared_ptr<IUniqueNumberAlgorithm> exactRestored(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set));
+        UniqueNumberCounter exactRestoredCounter(exactRestored, numDigits);
+        exactRestoredCounter.LoadSnapshot(path);
+        EXPECT_EQ(restoredCounter.GetCount(), exactRestoredCounter.GetCount());
+        size_t numMissing(0);
+        for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+            if (exactRestored->IsUnique(*number))
+                numMissing++;
+        EXPECT_EQ(0, numMissing);
+    }
+
+    // A DetectSorted run is included before it reaches the algorithm
+    UniqueNumberCounter sortedCounter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), 3);
+    sortedCounter.SetOrdering(UniqueNumberCounter::DetectSorted);
+    sortedCounter.ProcessNumber("007");
+    sortedCounter.ProcessNumber("010");
+    sortedCounter.WriteSnapshot(path);
+    UniqueNumberCounter sortedRestored(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), 3);
+    sortedRestored.LoadSnapshot(path);
+    EXPECT_EQ(2, sortedRestored.GetCount());
+
+    // Approximate algorithms can't list their numbers, and a failed snapshot leaves the last one in place
+    UniqueNumberCounter thetaCounter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Theta), numDigits);
+    EXPECT_THROW(thetaCounter.WriteSnapshot(path), runtime_error);
+    thetaCounter.StartSnapshot(path, listener);
+    thetaCounter.PollSnapshot(true);
+    EXPECT_EQ(2, listener->numCompleted);
+    EXPECT_FALSE(listener->succeeded);
+    sortedRestored.LoadSnapshot(path);
+    EXPECT_EQ(2, sortedRestored.GetCount());
+
+    // A corrupt length is rejected rather than allocated
+    const unsigned char corrupt[] = { 'U', 'N', 'C', '1', UniqueNumberCounter::FullSnapshot, 1, 1,
+                                      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+    FILE *file(fopen(path.c_str(), "wb"));
+    ASSERT_TRUE(file != NULL);
+    ASSERT_EQ(sizeof(corrupt), fwrite(corrupt, 1, sizeof(corrupt), file));
+    fclose(file);
+    EXPECT_THROW(sortedRestored.LoadSnapshot(path), runtime_error);
+    vector<string> corruptChain(1, path);
+    EXPECT_THROW(UniqueNumberCounter::CompactSnapshots(corruptChain, "TestCompacted.bin"), runtime_error);
+
+    remove(path.c_str());
+    EXPECT_THROW(sortedRestored.LoadSnapshot(path), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, DeltaSnapshots)
+{
+    const size_t numDigits(7);
+    const Dataset first(GenerateDataset(numDigits, 20000));
+    const Dataset second(GenerateDataset(numDigits, 20000));
+    const Dataset third(GenerateDataset(numDigits, 20000));
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree), numDigits);
+    counter.SetDeltaTracking(true);
+    EXPECT_THROW(counter.WriteSnapshot("TestDelta1.bin", UniqueNumberCounter::DeltaSnapshot), runtime_error);
+
+    // A base followed by a delta written in the foreground and one written by a child process
+    counter.ProcessNumbers(first);
+    counter.WriteSnapshot("TestBase.bin");
+    counter.ProcessNumbers(second);
+    counter.WriteSnapshot("TestDelta1.bin", UniqueNumberCounter::DeltaSnapshot);
+    counter.ProcessNumbers(third);
+    counter.StartSnapshot("TestDelta2.bin", shared_ptr<SnapshotListener>(), UniqueNumberCounter::DeltaSnapshot);
+    counter.PollSnapshot(true);
+
+    // Deltas only load onto the checkpoint before them
+    UniqueNumberCounter restored(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits);
+    EXPECT_THROW(restored.LoadSnapshot("TestDelta1.bin"), runtime_error);
+    restored.LoadSnapshot("TestBase.bin");
+    EXPECT_THROW(restored.LoadSnapshot("TestDelta2.bin"), runtime_error);
+    restored.LoadSnapshot("TestDelta1.bin");
+    restored.LoadSnapshot("TestDelta2.bin");
+    EXPECT_EQ(counter.GetCount(), restored.GetCount());
+
+    // Compaction folds the chain into a base that the next delta follows
+    vector<string> chain;
+    chain.push_back("TestBase.bin");
+    chain.push_back("TestDelta2.bin");
+    EXPECT_THROW(UniqueNumberCounter::CompactSnapshots(chain, "TestBase.bin"), runtime_error);
+    chain.insert(chain.begin() + 1, "TestDelta1.bin");
+    UniqueNumberCounter::CompactSnapshots(chain, "TestBase.bin");
+    counter.ProcessNumber("0000000");
+    counter.ProcessNumber("9999999");
+    counter.WriteSnapshot("TestDelta3.bin", UniqueNumberCounter::DeltaSnapshot);
+    UniqueNumberCounter compacted(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits);
+    compacted.LoadSnapshot("TestBase.bin");
+    EXPECT_EQ(restored.GetCount(), compacted.GetCount());
+    compacted.LoadSnapshot("TestDelta3.bin");
+    EXPECT_EQ(counter.GetCount(), compacted.GetCount());
+
+    // Numbers counted while tracking was off can't be in a delta until a full snapshot has been written
+    counter.SetDeltaTracking(false);
+    counter.ProcessNumber("0000001");
+    counter.SetDeltaTracking(true);
+    counter.ProcessNumber("0000002");
+    EXPECT_THROW(counter.WriteSnapshot("TestDelta4.bin", UniqueNumberCounter::DeltaSnapshot), runtime_error);
+    EXPECT_THROW(counter.StartSnapshot("TestDelta4.bin", shared_ptr<SnapshotListener>(), UniqueNumberCounter::DeltaSnapshot),
+                 runtime_error);
+    counter.WriteSnapshot("TestBase.bin");
+    counter.ProcessNumber("0000003");
+    counter.WriteSnapshot("TestDelta4.bin", UniqueNumberCounter::DeltaSnapshot);
+    UniqueNumberCounter late(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits);
+    late.ProcessNumber("0000004");
+    late.SetDeltaTracking(true);
+    late.WriteSnapshot("TestDelta5.bin");
+    late.ProcessNumber("0000005");
+    late.WriteSnapshot("TestDelta5.bin", UniqueNumberCounter::DeltaSnapshot);
+
+    // A failed delta's numbers aren't put back once tracking has been turned off
+    late.ProcessNumber("0000006");
+    late.StartSnapshot("NoSuchDirectory/TestDelta6.bin", shared_ptr<SnapshotListener>(), UniqueNumberCounter::DeltaSnapshot);
+    late.SetDeltaTracking(false);
+    late.PollSnapshot(true);
+    late.SetDeltaTracking(true);
+    EXPECT_THROW(late.WriteSnapshot("TestDelta5.bin", UniqueNumberCounter::DeltaSnapshot), runtime_error);
+    remove("TestDelta4.bin");
+    remove("TestDelta5.bin");
+
+    remove("TestBase.bin");
+    remove("TestDelta1.bin");
+    remove("TestDelta2.bin");
+    remove("TestDelta3.bin");
+}
+
+TEST(TestUniqueNumberCounter, Replication)
+{
+    const size_t numDigits(7);
+    const Dataset first(GenerateDataset(numDigits, 20000));
+    const Dataset second(GenerateDataset(numDigits, 20000));
+    const Dataset third(GenerateDataset(numDigits, 20000));
+    int descriptors[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, descriptors));
+    UniqueNumberCounter primary(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree), numDigits);
+    primary.ProcessNumbers(first);
+    const size_t numBeforeStream(primary.GetCount());
+
+    // The stream starts before the snapshot the standby catches up from, so nothing falls between them
+    const shared_ptr<ReplicationSender> sender(new ReplicationSender(descriptors[0], 1000));
+    primary.SetReplicationSender(sender);
+    primary.ProcessNumbers(second);
+    primary.WriteSnapshot("TestPrimary.bin");
+    primary.ProcessNumbers(third);
+    primary.ProcessNumber("0000000");
+    primary.ProcessNumber("9999999");
+    sender->Flush();
+
+    UniqueNumberCounter standby(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits);
+    ReplicationReceiver receiver(descriptors[1], standby);
+    receiver.CatchUp("TestPrimary.bin");
+    while (receiver.GetSequence() < sender->GetSequence())
+    {
+        sender->Flush();
+        receiver.Receive(true);
+    }
+    EXPECT_EQ(primary.GetCount(), standby.GetCount());
+    EXPECT_EQ(0, sender->GetBacklogSize());
+    EXPECT_EQ(0, receiver.GetPendingSize());
+    EXPECT_EQ(sender->GetSequence(), receiver.GetNumBatches());
+    EXPECT_EQ(primary.GetCount() - numBeforeStream, receiver.GetNumNumbers());
+    EXPECT_GE(receiver.GetMaxLagSeconds(), receiver.GetLagSeconds());
+
+    // The stream ends when the primary closes it
+    close(descriptors[0]);
+    EXPECT_FALSE(receiver.Receive(true));
+    close(descriptors[1]);
+
+    // A standby that has gone stops the stream without disturbing the primary
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, descriptors));
+    close(descriptors[1]);
+    ReplicationSender orphan(descriptors[0]);
+    orphan.Add("1234567");
+    orphan.Flush();
+    EXPECT_TRUE(orphan.IsBroken());
+    EXPECT_EQ(0, orphan.GetBacklogSize());
+    close(descriptors[0]);
+
+    // A batch whose sequence never ends is reported as corrupt
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, descriptors));
+    const unsigned char corrupt[] = { 12, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(corrupt)), write(descriptors[0], corrupt, sizeof(corrupt)));
+    ReplicationReceiver corruptReceiver(descriptors[1], standby);
+    EXPECT_THROW(corruptReceiver.Receive(true), runtime_error);
+    EXPECT_TRUE(corruptReceiver.IsBroken());
+    EXPECT_THROW(corruptReceiver.Receive(), runtime_error);
+    close(descriptors[0]);
+    close(descriptors[1]);
+
+    // A batch the standby rejects breaks the receiver too, and removals can't be replicated
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, descriptors));
+    UniqueNumberCounter cuckoo(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Cuckoo), numDigits);
+    cuckoo.SetReplicationSender(shared_ptr<ReplicationSender>(new ReplicationSender(descriptors[0], 1)));
+    cuckoo.ProcessNumber("1234567");
+    EXPECT_THROW(cuckoo.RemoveNumber("1234567"), runtime_error);
+    UniqueNumberCounter narrowStandby(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash), numDigits - 1);
+    ReplicationReceiver narrowReceiver(descriptors[1], narrowStandby);
+    EXPECT_THROW(narrowReceiver.Receive(true), runtime_error);
+    EXPECT_TRUE(narrowReceiver.IsBroken());
+    close(descriptors[0]);
+    close(descriptors[1]);
+    remove("TestPrimary.bin");
+}
+
+TEST(TestUniqueNumberCounter, Metrics)
+{
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree), 3);
+    const shared_ptr<CounterMetrics> metrics(new CounterMetrics("test", "tree"));
+    counter.SetMetrics(metrics);
+    vector<string> batch;
+    batch.push_back("001");
+    batch.push_back("002");
+    batch.push_back("001");
+    counter.ProcessNumbers(batch);
+    EXPECT_THROW(counter.ProcessNumber("12"), runtime_error);
+    batch.assign(1, "003");
+    counter.ProcessNumbers(batch);
+
+    CounterMetrics::Snapshot snapshot;
+    metrics->GetSnapshot(snapshot);
+    EXPECT_EQ(3, snapshot.numUnique);
+    EXPECT_EQ(4, snapshot.numProcessed);
+    EXPECT_EQ(1, snapshot.numRejected);
+    EXPECT_EQ(2, snapshot.numBatches);
+    EXPECT_EQ(0, snapshot.memoryUsage);
+
+    // Memory is only measured when asked, which isn't a batch
+    counter.MeasureMemory();
+    metrics->GetSnapshot(snapshot);
+    EXPECT_GT(snapshot.memoryUsage, 0);
+    EXPECT_EQ(2, snapshot.numBatches);
+
+    // Scraped over HTTP
+    const shared_ptr<MetricsRegistry> registry(new MetricsRegistry);
+    registry->Add(metrics);
+    MetricsEndpoint endpoint(registry, 0);
+    const int fd(socket(AF_INET, SOCK_STREAM, 0));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(endpoint.GetPort());
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(0, connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+    const string request("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    ASSERT_EQ(static_cast<ssize_t>(request.size()), send(fd, request.data(), request.size(), 0));
+    string response;
+    char buffer[4096];
+    for (ssize_t numRead; (numRead = recv(fd, buffer, sizeof(buffer), 0)) > 0; )
+        response.append(buffer, numRead);
+    close(fd);
+    EXPECT_EQ(0, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_NE(string::npos, response.find("unique_number_counter_unique_numbers{counter=\"test\",algorithm=\"tree\"} 3\n"));
+    EXPECT_NE(string::npos, response.find("unique_number_counter_rejected_total{counter=\"test\",algorithm=\"tree\"} 1\n"));
+    EXPECT_NE(string::npos, response.find("unique_number_counter_memory_measurement_seconds{counter=\"test\",algorithm=\"tree\"} "));
+    EXPECT_NE(string::npos, response.find("unique_number_counter_batch_duration_seconds_count{counter=\"test\",algorithm=\"tree\"} 2\n"));
+    EXPECT_NE(string::npos, response.find("unique_number_counter_batch_duration_seconds_bucket{counter=\"test\",algorithm=\"tree\",le=\"+Inf\"} 2\n"));
+}
+
+TEST(TestUniqueNumberCounter, SortedInput)
+{
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set));
+    UniqueNumberCounter counter(algorithm, 3);
+    counter.SetOrdering(UniqueNumberCounter::Sorted);
+    counter.ProcessNumber("007");
+    counter.ProcessNumber("007");
+    counter.ProcessNumber("010");
+    counter.ProcessNumber("999");
+    EXPECT_EQ(3, counter.GetCount());
+    EXPECT_THROW(counter.ProcessNumber("500"), runtime_error);
+    EXPECT_THROW(counter.SetOrdering(UniqueNumberCounter::Unsorted), runtime_error);
+
+    // A batch that breaks the order is rejected as a whole
+    vector<string> batch;
+    batch.push_back("999");
+    batch.push_back("000");
+    EXPECT_THROW(counter.ProcessNumbers(batch), runtime_error);
+    batch.assign(1, "998");
+    EXPECT_THROW(counter.ProcessNumbers(batch), runtime_error);
+    batch.assign(1, "1000");
+    batch.push_back("1001");
+    batch.push_back("1002");
+    UniqueNumberCounter wideCounter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set), 4);
+    wideCounter.SetOrdering(UniqueNumberCounter::Sorted);
+    wideCounter.ProcessNumbers(batch);
+    batch[0] = "1003";
+    EXPECT_THROW(wideCounter.ProcessNumbers(batch), runtime_error);
+    EXPECT_EQ(3, wideCounter.GetCount());
+    EXPECT_EQ(3, counter.GetCount());
+
+    // Nothing was given to the algorithm
+    EXPECT_TRUE(algorithm->IsUnique("007"));
+}
+
+TEST(TestUniqueNumberCounter, DetectSortedInput)
+{
+    const size_t numDigits(6);
+    Dataset dataset(GenerateDataset(numDigits, 50000));
+    sort(dataset.begin(), dataset.begin() + dataset.size() / 2);
+    const size_t expectedCount(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)));
+
+    shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree));
+    UniqueNumberCounter counter(algorithm, numDigits);
+    counter.SetOrdering(UniqueNumberCounter::DetectSorted);
+    counter.ProcessNumbers(Dataset(dataset.begin(), dataset.begin() + dataset.size() / 2));
+    EXPECT_EQ(UniqueNumberCounter::DetectSorted, counter.GetOrdering());
+    counter.ProcessNumbers(Dataset(dataset.begin() + dataset.size() / 2, dataset.end()));
+    EXPECT_EQ(UniqueNumberCounter::Unsorted, counter.GetOrdering());
+    EXPECT_EQ(expectedCount, counter.GetCount());
+
+    // The sorted run was handed to the algorithm when the order was broken
+    EXPECT_FALSE(algorithm->IsUnique(dataset[0]));
+}
+
+TEST(TestUniqueNumberCounter, VariableLengthNumbers)
+{
+    // Numbers that are prefixes of each other, including ones that end part way along an existing edge
+    const char *numbers[] = { "123", "1234", "12", "12", "1", "123", "0123", "1235", "99", "9" };
+    const IUniqueNumberAlgorithm::AlgorithmType algorithmTypes[] = { IUniqueNumberAlgorithm::CompactRadixTree,
+                                                                     IUniqueNumberAlgorithm::Set,
+                                                                     IUniqueNumberAlgorithm::IntervalSet,
+                                                                     IUniqueNumberAlgorithm::SparseBitmap,
+                                                                     IUniqueNumberAlgorithm::Hash,
+                                                                     IUniqueNumberAlgorithm::SortedBlocks,
+                                                                     IUniqueNumberAlgorithm::BTree,
+                                                                     IUniqueNumberAlgorithm::BitmapTree,
+                                                                     IUniqueNumberAlgorithm::SwissHash };
+    for (size_t type(0); type < sizeof(algorithmTypes) / sizeof(algorithmTypes[0]); ++type)
+    {
+        UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(algorithmTypes[type]), 1, 4);
+        for (size_t number(0); number < sizeof(numbers) / sizeof(numbers[0]); ++number)
+            counter.ProcessNumber(numbers[number]);
+        EXPECT_EQ(8, counter.GetCount());
+        EXPECT_THROW(counter.ProcessNumber("12345"), runtime_error);
+    }
+
+    // Mixed 7 to 10 digit numbers drawn from a few digits, so that many are prefixes of others
+    Dataset dataset;
+    for (size_t count(0); count < 50000; ++count)
+    {
+        string number;
+        for (size_t digit(7 + rand() % 4); digit > 0; --digit)
+            number += static_cast<char>('0' + rand() % 3);
+        dataset.push_back(number);
+    }
+    UniqueNumberCounter expected(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set), 7, 10);
+    expected.ProcessNumbers(dataset);
+
+    IUniqueNumberAlgorithm::Options options;
+    options.numExpectedDigits = 10;
+    options.minExpectedDigits = 7;
+    options.expectedPopulation = dataset.size();
+    for (size_t type(0); type < sizeof(algorithmTypes) / sizeof(algorithmTypes[0]); ++type)
+    {
+        UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(algorithmTypes[type], options), 7, 10);
+        counter.ProcessNumbers(dataset);
+        EXPECT_EQ(expected.GetCount(), counter.GetCount());
+        EXPECT_THROW(counter.SetNumPartitionDigits(8), runtime_error);
+        EXPECT_THROW(counter.SetOrdering(UniqueNumberCounter::Sorted), runtime_error);
+    }
+}
+
+TEST(TestUniqueNumberCounter, Alphabets)
+{
+    const IUniqueNumberAlgorithm::Alphabet alphabets[] = { IUniqueNumberAlgorithm::Hexadecimal,
+                                                           IUniqueNumberAlgorithm::Base36,
+                                                           IUniqueNumberAlgorithm::Byte };
+    const char *characters[] = { "0123456789abcdef", "0123456789abcdefghijklmnopqrstuvwxyz", NULL };
+    const size_t numDigits(5);
+    for (size_t index(0); index < sizeof(alphabets) / sizeof(alphabets[0]); ++index)
+    {
+        // A few characters from each end of the alphabet, so that the tree shares many prefixes
+        Dataset dataset;
+        for (size_t count(0); count < 50000; ++count)
+        {
+            string number;
+            for (size_t digit(0); digit < numDigits; ++digit)
+            {
+                const size_t choice(rand() % 6);
+                if (characters[index] == NULL)
+                    number += static_cast<char>(choice < 3 ? choice : 255 - choice);
+                else
+                {
+                    const size_t size(strlen(characters[index]));
+                    number += characters[index][choice < 3 ? choice : size - choice];
+                }
+            }
+            dataset.push_back(number);
+        }
+
+        IUniqueNumberAlgorithm::Options options;
+        options.alphabet = alphabets[index];
+        UniqueNumberCounter expected(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set, options), numDigits);
+        expected.SetAlphabet(alphabets[index]);
+        expected.ProcessNumbers(dataset);
+
+        options.numExpectedDigits = numDigits;
+        options.expectedPopulation = dataset.size();
+        shared_ptr<IUniqueNumberAlgorithm> algorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree, options));
+        UniqueNumberCounter counter(algorithm, numDigits);
+        counter.SetAlphabet(alphabets[index]);
+        counter.ProcessNumbers(dataset);
+        EXPECT_EQ(expected.GetCount(), counter.GetCount());
+        EXPECT_EQ(expected.GetCount(), algorithm->GetCount());
+        EXPECT_THROW(counter.SetOrdering(UniqueNumberCounter::DetectSorted), runtime_error);
+
+        // Bytes are kept in ordered edges, whose keys go stale when an edge splits
+        size_t numMissing(0);
+        for (Dataset::const_iterator number(dataset.begin()); number != dataset.end(); ++number)
+            if (!algorithm->Contains(*number))
+                numMissing++;
+        EXPECT_EQ(0, numMissing);
+        string absent(dataset[0]);
+        absent[numDigits / 2] = (characters[index] == NULL) ? static_cast<char>(100) : characters[index][6];
+        EXPECT_FALSE(algorithm->Contains(absent));
+
+        if (characters[index] != NULL)
+        {
+            EXPECT_THROW(counter.ProcessNumber("0000A"), runtime_error);
+            EXPECT_THROW(algorithm->IsUnique("0000A"), runtime_error);
+        }
+        EXPECT_THROW(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Hash, options), runtime_error);
+    }
+
+    // Decimal counters reject other alphabets' characters
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::CompactRadixTree), 3);
+    EXPECT_THROW(counter.ProcessNumber("12a"), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, ThetaSketchSmallDataSet)
+{
+    // Exact until more than k numbers have been seen
+    TestAlgorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Theta));
+}
+
+TEST(TestUniqueNumberCounter, ThetaSketchSetOperations)
+{
+    const size_t numDigits(8);
+    shared_ptr<ThetaSketch> first(new ThetaSketch(1024));
+    shared_ptr<ThetaSketch> second(new ThetaSketch(1024));
+    UniqueNumberCounter firstCounter(first, numDigits);
+    UniqueNumberCounter secondCounter(second, numDigits);
+    EXPECT_THROW(firstCounter.SetOrdering(UniqueNumberCounter::Sorted), runtime_error);
+    for (size_t number(0); number < 150000; ++number)
+    {
+        ostringstream out;
+        out << setw(numDigits) << setfill('0') << number * 7919 % 100000000;
+        if (number < 100000)
+            firstCounter.ProcessNumber(out.str());
+        if (number >= 50000)
+            secondCounter.ProcessNumber(out.str());
+    }
+    EXPECT_NEAR(100000, firstCounter.GetCount(), 10000);
+    EXPECT_EQ(first->GetCount(), firstCounter.GetCount());
+    EXPECT_LT(first->GetTheta(), 1.0);
+
+    vector<unsigned char> buffer;
+    first->Serialize(buffer);
+    EXPECT_LT(buffer.size(), 1024 * sizeof(uint64_t));
+    shared_ptr<ThetaSketch> copy(ThetaSketch::Deserialize(buffer));
+    EXPECT_EQ(first->GetEstimate(), copy->GetEstimate());
+    EXPECT_THROW(ThetaSketch::Deserialize(vector<unsigned char>(1, 0)), runtime_error);
+
+    ThetaSketch both(*first);
+    both.Merge(*second);
+    EXPECT_NEAR(150000, both.GetEstimate(), 15000);
+
+    ThetaSketch common(*first);
+    common.Intersect(*second);
+    EXPECT_NEAR(50000, common.GetEstimate(), 10000);
+
+    copy->Subtract(*second);
+    EXPECT_NEAR(50000, copy->GetEstimate(), 10000);
+}
+
+TEST(TestUniqueNumberCounter, FrequencySketch)
+{
+    // A few heavy hitters among many numbers seen once
+    const size_t numDigits(6);
+    Dataset dataset(GenerateDataset(numDigits, 100000));
+    for (size_t count(0); count < 2000; ++count)
+    {
+        dataset.push_back("000001");
+        if (count % 2 == 0)
+            dataset.push_back("000002");
+        if (count % 4 == 0)
+            dataset.push_back("000003");
+    }
+    random_shuffle(dataset.begin(), dataset.end());
+
+    shared_ptr<CountMinSketch> sketch(new CountMinSketch(4096, 4, 3));
+    const size_t memoryUsage(sketch->GetMemoryUsage());
+    UniqueNumberCounter counter(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set), numDigits);
+    counter.SetFrequencySketch(sketch);
+    const size_t half(dataset.size() / 2);
+    for (size_t index(0); index < half; ++index)
+        counter.ProcessNumber(dataset[index]);
+    counter.ProcessNumbers(Dataset(dataset.begin() + half, dataset.end()));
+    EXPECT_EQ(ProcessDataset(numDigits, dataset, IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set)),
+              counter.GetCount());
+    EXPECT_EQ(dataset.size(), sketch->GetTotal());
+
+    // Estimates never undercount
+    EXPECT_GE(sketch->GetEstimate("000001"), 2000);
+    EXPECT_LE(sketch->GetEstimate("000001"), 2100);
+    EXPECT_GE(sketch->GetEstimate("000003"), 500);
+
+    vector<pair<string, uint32_t> > items;
+    sketch->GetTopItems(items);
+    ASSERT_EQ(3, items.size());
+    EXPECT_EQ("000001", items[0].first);
+    EXPECT_EQ("000002", items[1].first);
+    EXPECT_EQ("000003", items[2].first);
+    EXPECT_GE(sketch->GetMemoryUsage(), memoryUsage);
+    EXPECT_LT(sketch->GetMemoryUsage(), memoryUsage + 1024);
+
+    // Only accepted numbers are counted, and loading a snapshot counts nothing again
+    UniqueNumberCounter sorted(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set), numDigits);
+    sorted.SetOrdering(UniqueNumberCounter::Sorted);
+    sorted.SetFrequencySketch(sketch);
+    sorted.ProcessNumber("000005");
+    const uint64_t total(sketch->GetTotal());
+    EXPECT_THROW(sorted.ProcessNumber("000004"), runtime_error);
+    vector<string> batch(1, "000006");
+    batch.push_back("000004");
+    EXPECT_THROW(sorted.ProcessNumbers(batch), runtime_error);
+    EXPECT_EQ(total, sketch->GetTotal());
+    counter.WriteSnapshot("TestSketch.bin");
+    UniqueNumberCounter restored(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set), numDigits);
+    restored.SetFrequencySketch(sketch);
+    restored.LoadSnapshot("TestSketch.bin");
+    EXPECT_EQ(counter.GetCount(), restored.GetCount());
+    EXPECT_EQ(total, sketch->GetTotal());
+    remove("TestSketch.bin");
+}
+
+TEST(TestUniqueNumberCounter, CuckooFilterSmallDataSet)
+{
+    TestAlgorithm(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Cuckoo));
+}
+
+TEST(TestUniqueNumberCounter, CuckooFilterRemove)
+{
+    const size_t numDigits(8);
+    shared_ptr<CuckooFilter> filter(new CuckooFilter(100000, 8, 4));
+    EXPECT_NEAR(2.0 * 4 / 256, filter->GetFalsePositiveRate(), 1e-9);
+    UniqueNumberCounter counter(filter, numDigits);
+    for (size_t number(0); number < 200000; ++number)
+    {
+        ostringstream out;
+        out << setw(numDigits) << setfill('0') << number;
+        counter.ProcessNumber(out.str());
+        if (number >= 100000)
+        {
+            // Expire numbers from a sliding window of 100000
+            ostringstream expired;
+            expired << setw(numDigits) << setfill('0') << number - 100000;
+            counter.RemoveNumber(expired.str());
+        }
+    }
+
+    // Numbers mistaken for duplicates are never stored, so the count can only fall short
+    EXPECT_LE(counter.GetCount(), 100000);
+    EXPECT_GE(counter.GetCount(), 100000 * (1 - filter->GetFalsePositiveRate()));
+    EXPECT_EQ(counter.GetCount(), filter->GetCount());
+    EXPECT_GT(filter->GetLoadFactor(), 0.5);
+    EXPECT_LT(filter->GetLoadFactor(), 1.0);
+    EXPECT_LT(filter->GetMemoryUsage(), 200000);
+
+    // Numbers from the expired half of the stream are mostly unique again
+    size_t numUnique(0);
+    for (size_t number(0); number < 10000; ++number)
+    {
+        ostringstream out;
+        out << setw(numDigits) << setfill('0') << number;
+        if (filter->IsUnique(out.str()))
+            numUnique++;
+    }
+    EXPECT_GE(numUnique, 10000 * (1 - 2 * filter->GetFalsePositiveRate()));
+
+    UniqueNumberCounter exact(IUniqueNumberAlgorithm::CreateInstance(IUniqueNumberAlgorithm::Set), 3);
+    EXPECT_THROW(exact.RemoveNumber("123"), runtime_error);
+}
+
+TEST(TestUniqueNumberCounter, CuckooFilterFull)
+{
+    CuckooFilter filter(1000, 16, 2);
+    bool full(false);
+    for (size_t number(0); (number < 100000) && !full; ++number)
+    {
+        ostringstream out;
+        out << number;
+        try
+        {
+            filter.IsUnique(out.str());
+        }
+        catch (const runtime_error &)
+        {
+            full = true;
+        }
+    }
+    EXPECT_TRUE(full);
+    EXPECT_GT(filter.GetLoadFactor(), 0.8);
+    EXPECT_THROW(CuckooFilter(1000, 3, 4), runtime_error);
+    EXPECT_THROW(CuckooFilter(1000, 8, 9), runtime_error);
 }
@@ -1,18 +1,65 @@
 #include "UniqueNumberCounter.h" // Main header
 
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iomanip>
 #include <iostream>
 #include <list>
 #include <map>
+#include <netinet/in.h>
+#include <new>
+#include <poll.h>
+#include <sched.h>
 #include <set>
+#include <sstream>
 #include <stdexcept>
+#include <stdint.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <tr1/array>
+#include <unistd.h>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 using namespace std;
 using namespace std::tr1;
 
 namespace
 {
+    /**
+     * \brief Default number of leading digits used to partition batches. 1000 partitions keep the staging
+     *        buffers (one cache line each) within the L2 cache.
+     */
+    const size_t DefaultNumPartitionDigits(3);
+
+    /**
+     * \brief Most partitions SetAlphabet chooses for alphabets larger than Decimal.
+     */
+    const size_t MaxNumPartitions(4096);
+
+    /**
+     * \brief Number of entries in each partition's staging buffer, sized to fill one cache line.
+     */
+    const size_t NumStagingEntries(64 / sizeof(const string *));
+
     /**
      * \brief Throws an exception containing the specified message.
      *
@@ -24,544 +71,5942 @@ namespace
     }
 
     /**
-     * \brief Implements the unique number algorithm using a compact radix tree, which is slower but
-     *        uses memory more efficiently.
+     * \brief Converts a run of at most 19 digits to an unsigned 64 bit integer.
+     *
+     * @param[in] begin First digit.
+     * @param[in] end   One past the last digit.
      */
-    class CompactRadixTreeAlgorithm : public IUniqueNumberAlgorithm
+    uint64_t ParseDigits(const char *begin, const char *end)
     {
-    public:
-        /**
-         * \brief Initializes the root node of the tree.
-         */
-        CompactRadixTreeAlgorithm() :
-            m_Root(new Node)
+        uint64_t value(0);
+        for (const char *ch(begin); ch != end; ++ch)
+            value = value * 10 + (*ch - '0');
+        return value;
+    }
+
+    /**
+     * \brief Converts a number to an unsigned 64 bit integer.
+     *
+     * @param[in] number A number that has already been checked, with at most 19 digits.
+     */
+    uint64_t ParseNumber(const string &number)
+    {
+        if (number.size() > 19)
+            RaiseError("number is too long for a 64 bit key");
+        return ParseDigits(number.data(), number.data() + number.size());
+    }
+
+    /**
+     * \brief Formats a value as a number with the specified number of digits, padded with leading zeros.
+     */
+    string FormatNumber(uint64_t value, const size_t numDigits)
+    {
+        string number(numDigits, '0');
+        for (size_t digit(numDigits); (digit > 0) && (value > 0); --digit)
         {
+            number[digit - 1] = static_cast<char>('0' + value % 10);
+            value /= 10;
         }
+        return number;
+    }
 
-        /**
-         * \brief Deletes all nodes in the tree.
-         */
-        virtual void Reset()
+    /**
+     * \brief Appends a value to a buffer using a variable length encoding of 7 bits per byte, so that
+     *        small values take a single byte.
+     */
+    void AppendVarint(uint64_t value, vector<unsigned char> &buffer)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<unsigned char>(value));
+    }
+
+    /**
+     * \brief Reads a value written by AppendVarint from bytes that may be corrupt, e.g. received from a stream.
+     *
+     * @param[in]     buffer The buffer to read from.
+     * @param[in,out] offset Offset of the value in buffer, which is advanced past it.
+     * @param[in]     end    Offset in buffer that the value must end by.
+     * @param[out]    value  Receives the value.
+     *
+     * @return Returns false if the value runs past end or has more bytes than a 64 bit value needs.
+     */
+    bool ReadVarint(const vector<unsigned char> &buffer, size_t &offset, const size_t end, uint64_t &value)
+    {
+        value = 0;
+        for (size_t shift(0); (offset < end) && (shift < 64); shift += 7)
         {
-            m_Root.reset(new Node);
+            const unsigned char byte(buffer[offset++]);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
         }
+        return false;
+    }
+
+    /**
+     * \brief Reads a value written by AppendVarint, throwing if it's truncated or too long.
+     *
+     * @param[in]     buffer The buffer to read from.
+     * @param[in,out] offset Offset of the value in buffer, which is advanced past it.
+     */
+    uint64_t ReadVarint(const vector<unsigned char> &buffer, size_t &offset)
+    {
+        uint64_t value;
+        if (!ReadVarint(buffer, offset, buffer.size(), value))
+            RaiseError("varint is truncated or too long");
+        return value;
+    }
+
+    /**
+     * \brief Estimated size of the control block that a shared_ptr allocates alongside the object it owns.
+     */
+    const size_t SharedPtrControlBlockSize(2 * sizeof(void *) + 2 * sizeof(int));
+
+    /**
+     * \brief Estimates the heap memory owned by a string. Short strings are assumed to be stored inside the
+     *        string object itself, as common standard libraries do.
+     */
+    size_t GetHeapUsage(const string &value)
+    {
+        const size_t ShortStringCapacity(15);
+        return value.capacity() > ShortStringCapacity ? value.capacity() + 1 : 0;
+    }
+
+    /**
+     * \brief Returns base raised to the specified power.
+     */
+    size_t Power(const size_t base, const size_t exponent)
+    {
+        size_t value(1);
+        for (size_t count(0); count < exponent; ++count)
+            value *= base;
+        return value;
+    }
 
+    /**
+     * \brief Maps the characters of an alphabet to their positions in it. Characters outside of the alphabet
+     *        map to a position past its end.
+     */
+    class AlphabetTable
+    {
+    public:
         /**
-         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         * \brief Creates a table for the specified characters.
+         *
+         * @param[in] characters The characters in the alphabet, in order.
          */
-        virtual bool IsUnique(const string &value)
+        explicit AlphabetTable(const char *characters) :
+            m_Size(0)
         {
-            bool isUnique(false);
-            string remainder(value);
-            shared_ptr<Node> current(m_Root);
-            while (!remainder.empty())
-                current = current->Eat(remainder, isUnique);
-            return isUnique;
+            fill(m_Indexes, m_Indexes + 256, static_cast<unsigned short>(256));
+            for (; *characters != '\0'; ++characters)
+                m_Indexes[static_cast<unsigned char>(*characters)] = static_cast<unsigned short>(m_Size++);
         }
 
         /**
-         * \brief Prints the contents of the tree to standard out.
+         * \brief Creates a table for the alphabet of all bytes.
          */
-        void Print() const
+        AlphabetTable() :
+            m_Size(256)
         {
-            cout << "PRINTING" << endl;
-            if (m_Root.get() != NULL)
-                m_Root->Print(0);
-            cout << "DONE" << endl;
+            for (size_t index(0); index < 256; ++index)
+                m_Indexes[index] = static_cast<unsigned short>(index);
         }
 
-    private:
-        class Node;
+        /**
+         * \brief Returns the number of characters in the alphabet.
+         */
+        size_t GetSize() const { return m_Size; }
 
         /**
-         * \brief Represents a single edge in the tree.
+         * \brief Returns the position of a character in the alphabet, or a value of at least GetSize() if it
+         *        isn't in the alphabet.
          */
-        class Edge
+        size_t GetIndex(const char ch) const { return m_Indexes[static_cast<unsigned char>(ch)]; }
+
+    private:
+        unsigned short m_Indexes[256]; /**< Position of each character. */
+        size_t m_Size;                 /**< Number of characters in the alphabet. */
+    };
+
+    const AlphabetTable DecimalTable("0123456789");
+    const AlphabetTable HexadecimalTable("0123456789abcdef");
+    const AlphabetTable Base36Table("0123456789abcdefghijklmnopqrstuvwxyz");
+    const AlphabetTable ByteTable;
+
+    /**
+     * \brief Returns the table for the specified alphabet.
+     */
+    const AlphabetTable &GetAlphabetTable(const IUniqueNumberAlgorithm::Alphabet alphabet)
+    {
+        switch (alphabet)
         {
-        public:
-            /**
-             * \brief Intializes an edge and attaches the specified node.
-             *
-             * @param[in] value The string required to transition to the next node using this edge.
-             * @param[in] next  Optional, The next node in the tree when following this edge. If NULL,
-             *                  an empty node will be created.
-             */
-            Edge(const string &value, shared_ptr<Node> next = shared_ptr<Node>()) :
-                m_Value(value),
-                m_Next(next)
-            {
-                if (m_Next.get() == NULL)
-                   m_Next.reset(new Node);
-            }
+            case IUniqueNumberAlgorithm::Decimal:
+                return DecimalTable;
+            case IUniqueNumberAlgorithm::Hexadecimal:
+                return HexadecimalTable;
+            case IUniqueNumberAlgorithm::Base36:
+                return Base36Table;
+            case IUniqueNumberAlgorithm::Byte:
+                return ByteTable;
+        }
+        RaiseError("Invalid alphabet");
+        return DecimalTable;
+    }
 
-            /**
-             * \brief Returns the string required to transition to the next node using this edge.
-             */
-            const string &GetValue() const { return m_Value; }
+    /**
+     * \brief The decimal digits, mapped by subtraction rather than through a table.
+     */
+    struct DecimalAlphabet
+    {
+        static const size_t Size = 10;    /**< Number of characters. */
+        static const bool Indexed = true; /**< True if nodes should index their edges directly. */
 
-            /**
-             * \brief Returns the next node in the tree when following this edge.
-             */
-            const Node &GetNext() const { return *m_Next; }
+        static size_t GetIndex(const char ch) { return static_cast<unsigned char>(ch - '0'); }
+        static char GetCharacter(const size_t index) { return static_cast<char>('0' + index); }
+    };
 
-            /**
-             * \brief Returns the number of common characters between the value stored in this edge
-             *        and the specified string.
-             *
-             * @param[in] remainder The string to compare against this value.
-             *
-             * @return Returns the number of common characters.
-             */
-            size_t GetNumCommonChars(const string &remainder) const
-            {
-                // Check arguments
-                if (remainder.empty())
-                    RaiseError("invalid remainder");
+    /**
+     * \brief The lower case hexadecimal digits.
+     */
+    struct HexadecimalAlphabet
+    {
+        static const size_t Size = 16;    /**< Number of characters. */
+        static const bool Indexed = true; /**< True if nodes should index their edges directly. */
 
-                // How many chacters are common between this edge and the new value
-                size_t numCommonChars(0);
-                for (; (numCommonChars < m_Value.size()) && (numCommonChars < remainder.size()); ++numCommonChars)
-                    if (m_Value[numCommonChars] != remainder[numCommonChars])
-                        break;
-                return numCommonChars;
-            }
+        static size_t GetIndex(const char ch) { return HexadecimalTable.GetIndex(ch); }
+        static char GetCharacter(const size_t index) { return "0123456789abcdef"[index]; }
+    };
 
-            /**
-             * \brief Eats as many characters as possible from the specified string by following this edge. The edge
-             *        may need to be split in order to follow it. This function will not eat any characters if
-             *        numCommonChars is 0.
-             *
-             * @param[in] numCommonChars Number of common characters between this node's value and the remainder parameter.
-             * @param[in] remainder      Attempts to eat the starting characters in remainder by following this edge.
-             * @param[in] isUnique       Returns true if the number has been determined to be unique.
-             *
-             * @return Returns the next node if this edge was followed. Otherwise, NULL is returned.
-             */
-            shared_ptr<Node> Eat(const size_t numCommonChars, string &remainder, bool &isUnique)
-            {
-                // Check arguments
-                if ((numCommonChars == 0) || (numCommonChars > min(m_Value.size(), remainder.size())))
-                    RaiseError("invalid numCommonChars");
-                if (remainder.empty())
-                    RaiseError("invalid remainder");
-            
-                shared_ptr<Node> next;
-                if (numCommonChars > 0)
-                {
-                    if (numCommonChars == m_Value.size())
-                    {
-                        // This edge matches the beginning of remainder. Traverse the edge. No splitting is neeeded.
-                        remainder = remainder.substr(numCommonChars);
-                        next = m_Next;
-                    }
-                    else
-                    {
-                        // This edge contains some common characters, but not all characters are common so it needs to
-                        // split.
-                        const string &commonValue(m_Value.substr(0, numCommonChars));
-                        const string &firstChildValue(m_Value.substr(numCommonChars));
-                        const string &secondChildValue(remainder.substr(numCommonChars));
+    /**
+     * \brief The decimal digits followed by the lower case letters.
+     */
+    struct Base36Alphabet
+    {
+        static const size_t Size = 36;    /**< Number of characters. */
+        static const bool Indexed = true; /**< True if nodes should index their edges directly. */
 
-                        // Create two new edges
-                        shared_ptr<Edge> firstEdge(new Edge(firstChildValue, m_Next));
-                        shared_ptr<Edge> secondEdge(new Edge(secondChildValue));
+        static size_t GetIndex(const char ch) { return Base36Table.GetIndex(ch); }
+        static char GetCharacter(const size_t index) { return "0123456789abcdefghijklmnopqrstuvwxyz"[index]; }
+    };
 
-                        // Fix this edge
-                        m_Value = commonValue;
-                        m_Next.reset(new Node(firstEdge, secondEdge));
+    /**
+     * \brief Any byte. 256 edge slots per node would dwarf the edges themselves, so nodes keep their edges in
+     *        a map instead.
+     */
+    struct ByteAlphabet
+    {
+        static const size_t Size = 256;    /**< Number of characters. */
+        static const bool Indexed = false; /**< True if nodes should index their edges directly. */
 
-                        remainder = "";
-                        isUnique = true;
-                    }
-                }
-                return next;
-            }
+        static size_t GetIndex(const char ch) { return static_cast<unsigned char>(ch); }
+        static char GetCharacter(const size_t index) { return static_cast<char>(index); }
+    };
 
-        private:
-            string m_Value;          /**< String required to transition to the next node using this edge. */
-            shared_ptr<Node> m_Next; /**< Next node in the tree when following this edge. */
-        };
+    /**
+     * \brief Selects Then if Condition is true and Else otherwise.
+     */
+    template <bool Condition, typename Then, typename Else>
+    struct Select
+    {
+        typedef Then Type;
+    };
 
-        /**
-         * \brief How edges are ordered in a node can dramatically affect its performance. This class orders
-         *        edges in an unordered linked list, yeilding O(n) performance.
-         */
-        class UnorderedEdges
-        {
-        public:
-            /**
-             * \brief STL container used to store edges.
-             */
-            typedef list<shared_ptr<Edge> > Container;
+    template <typename Then, typename Else>
+    struct Select<false, Then, Else>
+    {
+        typedef Else Type;
+    };
 
-            /**
-             * \brief Returns the STL container used to store edges.
-             */
-            const Container &GetContainer() const { return m_Container; }
+    /**
+     * \brief Counts the digits of the specified radix that always fit in a value no larger than Limit.
+     */
+    template <uint64_t Limit, size_t Radix, bool Fits = (Limit >= Radix)>
+    struct NumDigitsFitting
+    {
+        static const size_t Value = 1 + NumDigitsFitting<Limit / Radix, Radix>::Value;
+    };
 
-            /**
-             * \brief Returns the edge stored in the specified iterator. This method abstracts out the differences
-             *        between a map iterator (which contains a pair) and some other kind of iterator (which does not).
-             *
-             * @param[in] iter Get the edge from this iterator.
-             *
-             * @return Returns the edge stored in iter.
-             */
-            const Edge &GetEdge(Container::const_iterator iter) const { return **iter; }
+    template <uint64_t Limit, size_t Radix>
+    struct NumDigitsFitting<Limit, Radix, false>
+    {
+        static const size_t Value = 0;
+    };
 
-            /**
-             * \brief Adds an edge to the underlying container.
-             *
-             * @param[in] edge The edge to add.
-             */
-            void Add(shared_ptr<Edge> edge)
-            {
-                m_Container.push_back(edge);
-            }
+    /**
+     * \brief Returns the value of a number's leading digits.
+     *
+     * @param[in] number    A number that has already been checked.
+     * @param[in] numDigits Number of leading digits to convert.
+     * @param[in] alphabet  The alphabet the number is written in, whose size is the radix.
+     */
+    size_t GetLeadingValue(const string &number, const size_t numDigits, const AlphabetTable &alphabet)
+    {
+        size_t value(0);
+        for (size_t digit(0); digit < numDigits; ++digit)
+            value = value * alphabet.GetSize() + alphabet.GetIndex(number[digit]);
+        return value;
+    }
 
-            /**
-             * \brief Finds an edge that has common characters with remainder.
-             *
-             * @param[in] remainder Look for an edge that has common characters with this string.
-             *
-             * @return If an edge with common characters was found, then first will contain the number of common
-             *         characters and second will contain the edge. If an edge was not found, then second will be
-             *         NULL.
-             */
-            pair<size_t, shared_ptr<Edge> > Find(const string &remainder) const
-            { 
-                pair<size_t, shared_ptr<Edge> > ret;
-                for (Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
-                {
-                    shared_ptr<Edge> edge(*iter);
-                    ret.first = edge->GetNumCommonChars(remainder);
-                    if (ret.first > 0)
-                    {
-                        ret.second = edge;
-                        break;
-                    }
-                }
-                return ret;
-            }
+    /**
+     * \brief Appends the bytes of a word to a string, e.g. to build a hash key.
+     */
+    void AppendWord(const uint64_t word, string &bytes)
+    {
+        bytes.append(reinterpret_cast<const char *>(&word), sizeof(word));
+    }
 
-        private:
-            Container m_Container; /**< The STL container used to store edges. */
-        };
+    /**
+     * \brief Hands out memory in the order it's asked for from large chunks mapped from the operating system, so
+     *        that objects allocated one after another while walking a structure are laid out in walk order. Each
+     *        chunk counts the objects living in it, and once the arena has moved on to a newer chunk the old one
+     *        is unmapped when its last object is released. Objects may outlive the arena.
+     */
+    class NodeArena
+    {
+    public:
+        static const size_t ChunkSize = 1 << 20; /**< Bytes in each chunk, which is aligned to its size. */
 
         /**
-         * \brief How edges are ordered in a node can dramatically affect its performance. This class orders
-         *        edges in an STL map, yeilding O(log n) performance.
+         * \brief Creates an arena that maps its first chunk when it's first asked for memory.
          */
-        class OrderedEdges
+        NodeArena() :
+            m_Chunk(NULL),
+            m_Offset(0)
         {
-        public:
-            /**
-             * \brief STL container used to store edges.
-             */
-            typedef map<string, shared_ptr<Edge> > Container;
+        }
 
-            /**
-             * \brief Returns the STL container used to store edges.
-             */
-            const Container &GetContainer() const { return m_Container; }
+        /**
+         * \brief Retires the current chunk, which is unmapped once the objects in it are released.
+         */
+        ~NodeArena()
+        {
+            m_Retire();
+        }
 
-            /**
-             * \brief Returns the edge stored in the specified iterator. This method abstracts out the differences
-             *        between a map iterator (which contains a pair) and some other kind of iterator (which does not).
-             *
-             * @param[in] iter Get the edge from this iterator.
-             *
-             * @return Returns the edge stored in iter.
-             */
-            const Edge &GetEdge(Container::const_iterator iter) const { return *iter->second; }
+        /**
+         * \brief Returns memory for an object of the specified size, which follows the previous one.
+         */
+        void *Allocate(const size_t size)
+        {
+            const size_t alignedSize((size + Alignment - 1) & ~(Alignment - 1));
+            if (alignedSize > ChunkSize - HeaderSize)
+                RaiseError("object is too large for the arena");
+            if ((m_Chunk == NULL) || (m_Offset + alignedSize > ChunkSize))
+            {
+                m_Retire();
+                m_Chunk = m_MapChunk();
+                m_Offset = HeaderSize;
+            }
+            void *object(reinterpret_cast<char *>(m_Chunk) + m_Offset);
+            m_Offset += alignedSize;
+            m_Chunk->numLive++;
+            return object;
+        }
 
-            /**
-             * \brief Adds an edge to the underlying container.
-             *
-             * @param[in] edge The edge to add.
-             */
-            void Add(shared_ptr<Edge> edge)
+        /**
+         * \brief Releases memory returned by Allocate once the object in it has been destroyed.
+         */
+        static void Release(void *object)
+        {
+            Header *chunk(reinterpret_cast<Header *>(reinterpret_cast<uintptr_t>(object) & ~static_cast<uintptr_t>(ChunkSize - 1)));
+            if ((--chunk->numLive == 0) && chunk->isRetired)
+                munmap(chunk, ChunkSize);
+        }
+
+    private:
+        /**
+         * \brief Bookkeeping at the start of each chunk.
+         */
+        struct Header
+        {
+            size_t numLive;  /**< Objects allocated from the chunk that haven't been released. */
+            bool isRetired;  /**< True once the arena has stopped allocating from the chunk. */
+        };
+
+        static const size_t Alignment = 8;                                                   /**< Alignment of every object. */
+        static const size_t HeaderSize = (sizeof(Header) + Alignment - 1) & ~(Alignment - 1); /**< Bytes before the first object. */
+
+        NodeArena(const NodeArena &);
+        NodeArena &operator=(const NodeArena &);
+
+        /**
+         * \brief Maps a chunk aligned to its size, so that Release can find it from any object in it.
+         */
+        static Header *m_MapChunk()
+        {
+            char *mapping(static_cast<char *>(mmap(NULL, 2 * ChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)));
+            if (mapping == MAP_FAILED)
+                throw bad_alloc();
+            char *chunk(reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(mapping) + ChunkSize - 1) & ~static_cast<uintptr_t>(ChunkSize - 1)));
+            if (chunk != mapping)
+                munmap(mapping, chunk - mapping);
+            if (chunk + ChunkSize != mapping + 2 * ChunkSize)
+                munmap(chunk + ChunkSize, mapping + 2 * ChunkSize - (chunk + ChunkSize));
+            Header *header(reinterpret_cast<Header *>(chunk));
+            header->numLive = 0;
+            header->isRetired = false;
+            return header;
+        }
+
+        /**
+         * \brief Stops allocating from the current chunk, unmapping it if nothing in it is still alive.
+         */
+        void m_Retire()
+        {
+            if (m_Chunk == NULL)
+                return;
+            m_Chunk->isRetired = true;
+            if (m_Chunk->numLive == 0)
+                munmap(m_Chunk, ChunkSize);
+            m_Chunk = NULL;
+        }
+
+        Header *m_Chunk; /**< Chunk being allocated from, or NULL before the first allocation. */
+        size_t m_Offset; /**< Bytes of the current chunk already handed out, including its header. */
+    };
+
+    /**
+     * \brief Destroys an object placed in a NodeArena, for the shared pointers that own one.
+     */
+    template <typename T>
+    struct ArenaDeleter
+    {
+        void operator()(T *object) const
+        {
+            object->~T();
+            NodeArena::Release(object);
+        }
+    };
+
+    /**
+     * \brief Implements the unique number algorithm using a compact radix tree, which is slower but
+     *        uses memory more efficiently.
+     *
+     * @tparam Characters The characters numbers are written with, e.g. DecimalAlphabet.
+     */
+    template <typename Characters>
+    class CompactRadixTreeAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Initializes the directory of subtree roots.
+         *
+         * @param[in] numDirectoryDigits Number of leading digits resolved by a flat directory of subtree roots
+         *                               instead of by walking the tree. Zero yields a plain tree with one root.
+         */
+        explicit CompactRadixTreeAlgorithm(const size_t numDirectoryDigits = 0) :
+            m_NumDirectoryDigits(numDirectoryDigits),
+            m_Directory(Power(Characters::Size, numDirectoryDigits)),
+            m_Count(0),
+            m_IsFrozen(false),
+            m_CompactionSlot(0)
+        {
+        }
+
+        /**
+         * \brief Chooses how many leading digits the directory should resolve. The upper levels of the tree
+         *        are only worth flattening when they're nearly fully populated, so the directory is kept to
+         *        roughly one slot per MinKeysPerDirectorySlot keys, at most MaxDirectorySize slots, and always
+         *        leaves at least one digit to the tree.
+         *
+         * @param[in] numExpectedDigits  Number of digits each number will have, or 0 if unknown.
+         * @param[in] expectedPopulation Expected number of unique numbers, or 0 if unknown.
+         *
+         * @return Returns the number of directory digits, which is 0 if either hint is unknown.
+         */
+        static size_t ChooseNumDirectoryDigits(const size_t numExpectedDigits, const size_t expectedPopulation)
+        {
+            const size_t MinKeysPerDirectorySlot(4);
+            const size_t MaxDirectorySize(1000000);
+
+            size_t numDirectoryDigits(0);
+            while ((numDirectoryDigits + 1 < numExpectedDigits) &&
+                   (Power(Characters::Size, numDirectoryDigits + 1) <= MaxDirectorySize) &&
+                   (Power(Characters::Size, numDirectoryDigits + 1) * MinKeysPerDirectorySlot <= expectedPopulation))
+                ++numDirectoryDigits;
+            return numDirectoryDigits;
+        }
+
+        /**
+         * \brief Deletes all nodes in the tree.
+         */
+        virtual void Reset()
+        {
+            m_Directory.assign(m_Directory.size(), shared_ptr<Node>());
+            m_Count = 0;
+            m_PrefixCounts.clear();
+            m_IsFrozen = false;
+            m_CompactionSlot = 0;
+            m_Relocation.hasCursor = false;
+            m_Relocation.relocated.clear();
+            vector<shared_ptr<Node> >().swap(m_Relocation.retired);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &value)
+        {
+            // Subtrees of a frozen tree may be shared, so it can't take new numbers
+            if (m_IsFrozen)
             {
-                m_Container.insert(make_pair(edge->GetValue(), edge));
+                if (!Contains(value))
+                    RaiseError("The tree is frozen");
+                return false;
             }
 
-            /**
-             * \brief Finds an edge that has common characters with remainder.
-             *
-             * @param[in] remainder Look for an edge that has common characters with this string.
-             *
-             * @return If an edge with common characters was found, then first will contain the number of common
-             *         characters and second will contain the edge. If an edge was not found, then second will be
-             *         NULL.
-             */
-            pair<size_t, shared_ptr<Edge> > Find(const string &remainder) const
+            shared_ptr<Node> &root(m_Directory[m_GetDirectoryIndex(value)]);
+            if (root.get() == NULL)
+                root.reset(new Node);
+
+            // Walk the number in place rather than copying its remainder, so that only inserts allocate
+            bool isUnique(false);
+            size_t offset(m_NumDirectoryDigits);
+            Node *current(root.get());
+            while (!isUnique && (offset < value.size()))
+                current = current->Eat(value, offset, isUnique);
+
+            // A number that ends at an existing node is only unique if no other number ended there before
+            if (current != NULL)
+                isUnique = current->MarkTerminal();
+            if (isUnique)
             {
-                pair<size_t, shared_ptr<Edge> > ret;
-                if (!m_Container.empty())
+                // Every prefix longer than the ones already stored is new
+                m_Count++;
+                if (m_PrefixCounts.size() < value.size())
+                    m_PrefixCounts.resize(value.size());
+                for (; offset < value.size(); ++offset)
+                    m_PrefixCounts[offset]++;
+            }
+            return isUnique;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            // Nodes shared by a frozen tree are only counted once
+            NodeSet counted;
+            size_t memoryUsage(sizeof(*this) + m_Directory.capacity() * sizeof(shared_ptr<Node>));
+            for (typename vector<shared_ptr<Node> >::const_iterator root(m_Directory.begin()); root != m_Directory.end(); ++root)
+                if ((root->get() != NULL) && counted.insert(root->get()).second)
+                    memoryUsage += SharedPtrControlBlockSize + (*root)->GetMemoryUsage(counted);
+            return memoryUsage;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetPrefixCounts
+         */
+        virtual void GetPrefixCounts(vector<size_t> &counts) const
+        {
+            // Prefixes resolved by the directory are counted from its occupied slots, which ascend, so a prefix
+            // is new whenever it differs from the previous slot's
+            counts = m_PrefixCounts;
+            if (counts.size() < m_NumDirectoryDigits)
+                counts.resize(m_NumDirectoryDigits);
+            size_t previous(m_Directory.size());
+            for (size_t index(0); index < m_Directory.size(); ++index)
+            {
+                if (m_Directory[index].get() == NULL)
+                    continue;
+                for (size_t length(1); length <= m_NumDirectoryDigits; ++length)
                 {
-                    // upper_bound may return the edge that is needed or may return the edge after the edge
-                    // that is needed. For example, if remainder is 'hello' and there is an edge for 'hea' then
-                    // upper_bound will return whatever comes after 'hea'
-                    Container::const_iterator iter(m_Container.upper_bound(remainder));
-                    if (iter != m_Container.end())
-                    {
-                        shared_ptr<Edge> edge(iter->second);
-                        ret.first = edge->GetNumCommonChars(remainder);
-                        if (ret.first > 0)
-                            ret.second = edge;
-                    }
-                    if (ret.first == 0)
-                    {
-                        if (iter-- != m_Container.begin())
-                        {
-                            shared_ptr<Edge> edge(iter->second);
-                            ret.first = edge->GetNumCommonChars(remainder);
-                            if (ret.first > 0)
-                               ret.second = edge;
-                        }
-                    }
+                    const size_t divisor(Power(Characters::Size, m_NumDirectoryDigits - length));
+                    if ((previous == m_Directory.size()) || (index / divisor != previous / divisor))
+                        counts[length - 1]++;
                 }
-                return ret;
+                previous = index;
             }
+        }
 
-        private:
-            Container m_Container; /**< The STL container used to store edges. */
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            string number;
+            for (size_t index(0); index < m_Directory.size(); ++index)
+            {
+                if (m_Directory[index].get() == NULL)
+                    continue;
+
+                m_GetDirectoryPrefix(index, number);
+                if (!m_Directory[index]->Export(number, visitor))
+                    return;
+            }
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &value) const
+        {
+            const Node *root(m_Directory[m_GetDirectoryIndex(value)].get());
+            return (root != NULL) && root->Contains(value, m_NumDirectoryDigits);
+        }
+
+        /**
+         * \brief Minimizes the tree into a DAG by hash-consing identical subtrees bottom up, so that e.g. the
+         *        same set of trailing digits under many prefixes is stored once. Every edge still spells the same
+         *        numbers, so lookups and the count are unchanged.
+         */
+        virtual void Freeze()
+        {
+            if (m_IsFrozen)
+                return;
+            NodeTable table;
+            for (typename vector<shared_ptr<Node> >::iterator root(m_Directory.begin()); root != m_Directory.end(); ++root)
+                if (root->get() != NULL)
+                    *root = Node::Intern(*root, table);
+            m_IsFrozen = true;
+
+            // Nodes are shared from now on, so a compaction pass under way starts over to move each one once
+            m_CompactionSlot = 0;
+            m_Relocation.hasCursor = false;
+        }
+
+        /**
+         * \brief Copies nodes, and the edges they point to, into a NodeArena in the order a depth-first walk
+         *        visits them, moving each node's owner to the copy so that the original is freed. Each slice
+         *        resumes after the path of the last node it moved, and because a preorder walk visits paths in
+         *        order, nodes inserted between slices are simply moved if they fall after it. Nodes a frozen tree
+         *        shares are moved once, and every owner is pointed at the same copy.
+         *
+         *        The originals are only freed once every node has moved. Until then the heap can't hand their
+         *        memory back out, e.g. for the copies' reference counts, so the pages they occupied end up wholly
+         *        free and trimming the heap returns them to the operating system, at the cost of holding both
+         *        copies of a tree while a pass is under way.
+         */
+        virtual bool Compact(const size_t maxNodes)
+        {
+            if (maxNodes == 0)
+                RaiseError("maxNodes must be positive");
+            m_Relocation.budget = maxNodes;
+            m_Relocation.isShared = m_IsFrozen;
+            string path;
+            for (; m_CompactionSlot < m_Directory.size(); ++m_CompactionSlot)
+            {
+                shared_ptr<Node> &root(m_Directory[m_CompactionSlot]);
+                if ((root.get() != NULL) && !Node::Relocate(root, path, m_Relocation))
+                    return false;
+                m_Relocation.hasCursor = false;
+            }
+
+            // Every node has moved, so the originals are freed, also a slice at a time, and their pages returned
+            m_Relocation.relocated.clear();
+            for (; (m_Relocation.budget > 0) && !m_Relocation.retired.empty(); m_Relocation.budget--)
+                m_Relocation.retired.pop_back();
+            if (!m_Relocation.retired.empty())
+                return false;
+            vector<shared_ptr<Node> >().swap(m_Relocation.retired);
+#ifdef __GLIBC__
+            malloc_trim(0);
+#endif
+            m_CompactionSlot = 0;
+            return true;
+        }
+
+        /**
+         * \brief Prints the contents of the tree to standard out.
+         */
+        void Print() const
+        {
+            cout << "PRINTING" << endl;
+            for (size_t index(0); index < m_Directory.size(); ++index)
+            {
+                if (m_Directory[index].get() == NULL)
+                    continue;
+                if (m_NumDirectoryDigits > 0)
+                {
+                    string prefix;
+                    m_GetDirectoryPrefix(index, prefix);
+                    cout << "directory=" << prefix << endl;
+                }
+                m_Directory[index]->Print(m_NumDirectoryDigits > 0 ? 1 : 0);
+            }
+            cout << "DONE" << endl;
+        }
+
+    private:
+        class Node;
+
+        /**
+         * \brief Nodes that have already been counted by GetMemoryUsage.
+         */
+        typedef set<const Node *> NodeSet;
+
+        /**
+         * \brief Canonical nodes found while freezing, keyed by their signatures.
+         */
+        typedef map<string, shared_ptr<Node> > NodeTable;
+
+        /**
+         * \brief Copies of the shared nodes already moved by the current compaction pass, keyed by the originals.
+         */
+        typedef map<const Node *, shared_ptr<Node> > RelocationTable;
+
+        /**
+         * \brief Where a compaction pass has got to, carried from one slice to the next.
+         */
+        struct Relocation
+        {
+            Relocation() :
+                hasCursor(false),
+                budget(0),
+                isShared(false)
+            {
+            }
+
+            NodeArena arena;                   /**< Holds the moved nodes and edges. */
+            string cursor;                     /**< Path of the last node moved in the current directory slot, spelled
+                                                    in edge order, i.e. as the index of each character. */
+            bool hasCursor;                    /**< False until a node of the current directory slot has been moved. */
+            size_t budget;                     /**< Nodes the current slice may still move. */
+            bool isShared;                     /**< True if nodes may have several owners, i.e. the tree is frozen. */
+            RelocationTable relocated;         /**< Shared nodes already moved by the current pass. */
+            vector<shared_ptr<Node> > retired; /**< Nodes moved by the current pass, freed when it ends. */
         };
 
         /**
-         * \brief How edges are ordered in a node can dramatically affect its performance. This class orders
-         *        edges in a fixed size array so that they can be directly indexed, yeilding O(1) performance.
+         * \brief Spells the leading digits of the numbers in a directory slot, the inverse of m_GetDirectoryIndex.
          */
-        class IndexedEdges
+        void m_GetDirectoryPrefix(size_t index, string &prefix) const
         {
-        public:
-            /**
-             * \brief STL container used to store edges.
-             */
-            typedef vector<shared_ptr<Edge> > Container;
+            prefix.resize(m_NumDirectoryDigits);
+            for (size_t digit(m_NumDirectoryDigits); digit > 0; --digit, index /= Characters::Size)
+                prefix[digit - 1] = Characters::GetCharacter(index % Characters::Size);
+        }
+
+        /**
+         * \brief Returns the directory slot of a number's subtree. The directory replaces the top levels of the
+         *        tree with a single array access.
+         */
+        size_t m_GetDirectoryIndex(const string &value) const
+        {
+            if (value.size() <= m_NumDirectoryDigits)
+                RaiseError("number is too short for the directory");
+
+            size_t index(0);
+            for (size_t digit(0); digit < m_NumDirectoryDigits; ++digit)
+            {
+                const size_t character(Characters::GetIndex(value[digit]));
+                if (character >= Characters::Size)
+                    RaiseError("character is not in the tree's alphabet");
+                index = index * Characters::Size + character;
+            }
+            return index;
+        }
 
+        /**
+         * \brief Represents a single edge in the tree.
+         */
+        class Edge
+        {
+        public:
             /**
-             * \brief Initializes the STL container to hold up to 10 edges (corresponding to the digits 0-9).
+             * \brief Intializes an edge and attaches the specified node.
+             *
+             * @param[in] value The string required to transition to the next node using this edge.
+             * @param[in] next  Optional, The next node in the tree when following this edge. If NULL, this is a
+             *                  leaf edge: a number ends where it ends and nothing follows it. Most edges are
+             *                  leaves, so they don't carry an empty terminal node.
              */
-            IndexedEdges() :
-                m_Container(10)
+            Edge(const string &value, shared_ptr<Node> next = shared_ptr<Node>()) :
+                m_Value(value),
+                m_Next(next)
             {
             }
 
             /**
-             * \brief Returns the STL container used to store edges.
+             * \brief Returns the string required to transition to the next node using this edge.
              */
-            const Container &GetContainer() const { return m_Container; }
+            const string &GetValue() const { return m_Value; }
 
             /**
-             * \brief Returns the edge stored in the specified iterator. This method abstracts out the differences
-             *        between a map iterator (which contains a pair) and some other kind of iterator (which does not).
-             *
-             * @param[in] iter Get the edge from this iterator.
-             *
-             * @return Returns the edge stored in iter.
+             * \brief Returns the next node in the tree when following this edge, or NULL for a leaf edge.
              */
-            const Edge &GetEdge(Container::const_iterator iter) const { return **iter; }
+            const Node *GetNext() const { return m_Next.get(); }
 
             /**
-             * \brief Adds an edge to the underlying container.
+             * \brief Returns the memory used by this edge and everything beneath it.
              *
-             * @param[in] edge The edge to add.
+             * @param[in,out] counted Nodes already counted, which are skipped.
              */
-            void Add(shared_ptr<Edge> edge)
+            size_t GetMemoryUsage(NodeSet &counted) const
             {
-                m_Container[edge->GetValue()[0] - '0'] = edge;
+                size_t memoryUsage(sizeof(*this) + GetHeapUsage(m_Value));
+                if ((m_Next.get() != NULL) && counted.insert(m_Next.get()).second)
+                    memoryUsage += SharedPtrControlBlockSize + m_Next->GetMemoryUsage(counted);
+                return memoryUsage;
             }
 
             /**
-             * \brief Finds an edge that has common characters with remainder.
+             * \brief Returns true if the remainder of value is stored by following this edge.
              *
-             * @param[in] remainder Look for an edge that has common characters with this string.
-             *
-             * @return If an edge with common characters was found, then first will contain the number of common
-             *         characters and second will contain the edge. If an edge was not found, then second will be
-             *         NULL.
+             * @param[in] value  The number.
+             * @param[in] offset Position in value where the remainder starts.
              */
-            pair<size_t, shared_ptr<Edge> > Find(const string &remainder) const
+            bool Contains(const string &value, const size_t offset) const
             {
-                pair<size_t, shared_ptr<Edge> > ret;
-                ret.second = m_Container[remainder[0] - '0'];
-                if (ret.second.get() != NULL)
-                    ret.first = ret.second->GetNumCommonChars(remainder);
-                return ret;
+                if ((value.size() - offset < m_Value.size()) || (value.compare(offset, m_Value.size(), m_Value) != 0))
+                    return false;
+                if (m_Next.get() == NULL)
+                    return offset + m_Value.size() == value.size();
+                return m_Next->Contains(value, offset + m_Value.size());
             }
 
-        private:
-            Container m_Container; /**< The STL container used to store edges. */
-        };
-
-        /**
-         * \brief Represents a node in the tree. Each node can hold an arbitrary number of edges.
-         */
-        class Node
-        {
-        public:
             /**
-             * \brief Creates a node with no edges.
+             * \brief Replaces the node this edge leads to with its canonical copy.
              */
-            Node()
+            void Minimize(NodeTable &table)
             {
+                if (m_Next.get() != NULL)
+                    m_Next = Node::Intern(m_Next, table);
             }
 
             /**
-             * \brief Creates a node with two edges.
+             * \brief Moves the subtree this edge leads to into the compaction arena, see Node::Relocate.
              *
-             * @param[in] The first edge in the node.
-             * @param[in] The secondn edge in the node.
+             * @param[in,out] path       The path leading to this edge, which is restored before returning.
+             * @param[in,out] relocation Progress of the compaction pass.
+             */
+            bool Relocate(string &path, Relocation &relocation)
+            {
+                if (m_Next.get() == NULL)
+                    return true;
+                const size_t size(path.size());
+                for (string::const_iterator ch(m_Value.begin()); ch != m_Value.end(); ++ch)
+                    path += static_cast<char>(Characters::GetIndex(*ch));
+                const bool isFinished(Node::Relocate(m_Next, path, relocation));
+                path.resize(size);
+                return isFinished;
+            }
+
+            /**
+             * \brief Appends this edge's value and the identity of its canonical next node to signature.
              */
-            Node(shared_ptr<Edge> firstEdge, shared_ptr<Edge> secondEdge)
+            void AppendSignature(string &signature) const
             {
-                if ((firstEdge.get() == NULL) || (secondEdge.get() == NULL))
-                    RaiseError("invalid edge");
-                m_Edges.Add(firstEdge);
-                m_Edges.Add(secondEdge);
+                AppendWord(m_Value.size(), signature);
+                signature += m_Value;
+                AppendWord(reinterpret_cast<uintptr_t>(m_Next.get()), signature);
             }
 
             /**
-             * \brief Eats characters from the begining of remainder by transitioning to the next
-             *        level node. A new edge and node may be created if one does not already exist.
+             * \brief Returns the number of common characters between the value stored in this edge
+             *        and the remainder of the specified string.
              *
-             * @param[in,out] remainder Eats charaters at the beginning of this string.
-             * @param[in,out] isUnique  Returns true if this string is known to be unique.
+             * @param[in] value  The string to compare against this value.
+             * @param[in] offset Position in value of the first character that hasn't been eaten yet.
              *
-             * @return Returns the next node encountered after following an edge.
+             * @return Returns the number of common characters.
              */
-            shared_ptr<Node> Eat(string &remainder, bool &isUnique)
+            size_t GetNumCommonChars(const string &value, const size_t offset) const
             {
                 // Check arguments
-                if (remainder.empty())
+                if (offset >= value.size())
                     RaiseError("invalid remainder");
 
-                shared_ptr<Node> next;
-                const pair<size_t, shared_ptr<Edge> > &ret(m_Edges.Find(remainder));
-                if (ret.first > 0)
-                    next = ret.second->Eat(ret.first, remainder, isUnique);
-
-                if ((next.get() == NULL) && !remainder.empty())
-                {
-                    shared_ptr<Edge> newEdge(new Edge(remainder));
-                    m_Edges.Add(newEdge);
-                    remainder = "";
-                    isUnique = true;
-                }
-                return next;
+                // How many chacters are common between this edge and the new value
+                const size_t remainderSize(value.size() - offset);
+                size_t numCommonChars(0);
+                for (; (numCommonChars < m_Value.size()) && (numCommonChars < remainderSize); ++numCommonChars)
+                    if (m_Value[numCommonChars] != value[offset + numCommonChars])
+                        break;
+                return numCommonChars;
             }
 
             /**
-             * \brief Prints the contents of this node and all child nodes.
+             * \brief Eats as many characters as possible from the specified string by following this edge. The edge
+             *        may need to be split in order to follow it. This function will not eat any characters if
+             *        numCommonChars is 0.
              *
-             * @param[in] depth The depth of indentation to use when printing this node.
+             * @param[in]     numCommonChars Number of common characters between this node's value and the remainder of value.
+             * @param[in]     value          Attempts to eat the characters of value starting at offset by following this edge.
+             * @param[in,out] offset         Position of the first character that hasn't been eaten, which is advanced past
+             *                               the eaten characters. If the edge was split, it's left where the number
+             *                               leaves the tree, i.e. after its longest prefix that was already stored.
+             * @param[in]     isUnique       Returns true if the number has been determined to be unique.
+             *
+             * @return Returns the next node if this edge was followed to a node. Otherwise, e.g. after a split or when
+             *         the number ends at a leaf edge, NULL is returned.
              */
-            void Print(const size_t depth) const
+            Node *Eat(const size_t numCommonChars, const string &value, size_t &offset, bool &isUnique)
             {
-                const string indent(2 * depth, ' ');
-                const Edges::Container &container(m_Edges.GetContainer());
-                for (Edges::Container::const_iterator iter(container.begin()); iter != container.end(); ++iter)
+                // Check arguments
+                if (offset >= value.size())
+                    RaiseError("invalid remainder");
+                if ((numCommonChars == 0) || (numCommonChars > min(m_Value.size(), value.size() - offset)))
+                    RaiseError("invalid numCommonChars");
+
+                Node *next(NULL);
+                if (numCommonChars > 0)
+                {
+                    if (numCommonChars == m_Value.size())
+                    {
+                        // This edge matches the beginning of remainder. Traverse the edge. No splitting is neeeded.
+                        // A longer number continuing past a leaf edge gives the leaf the terminal node it was
+                        // spared; a number ending at a leaf edge is a duplicate.
+                        offset += numCommonChars;
+                        if ((m_Next.get() == NULL) && (offset < value.size()))
+                            m_Next.reset(new Node(true));
+                        next = m_Next.get();
+                    }
+                    else
+                    {
+                        // This edge contains some common characters, but not all characters are common so it needs to
+                        // split. The new node takes the rest of this edge, and a leaf for the rest of the number.
+                        const string firstChildValue(m_Value.substr(numCommonChars));
+                        const shared_ptr<Node> firstChildNext(m_Next);
+
+                        // Fix this edge
+                        m_Value.resize(numCommonChars);
+                        if (offset + numCommonChars == value.size())
+                        {
+                            // The number ends where the edge splits, so the new node is where it terminates
+                            m_Next.reset(new Node(firstChildValue, firstChildNext));
+                        }
+                        else
+                            m_Next.reset(new Node(firstChildValue, firstChildNext, value, offset + numCommonChars));
+
+                        offset += numCommonChars;
+                        isUnique = true;
+                    }
+                }
+                return next;
+            }
+
+        private:
+            string m_Value;          /**< String required to transition to the next node using this edge. */
+            shared_ptr<Node> m_Next; /**< Next node in the tree when following this edge. */
+        };
+
+        /**
+         * \brief Lists the edges of a node for printing, as each edge's value and the node it leads to.
+         */
+        typedef vector<pair<string, const Node *> > EdgeList;
+
+        /**
+         * \brief How edges are ordered in a node can dramatically affect its performance. This class orders
+         *        edges in an unordered linked list, yeilding O(n) performance.
+         */
+        class UnorderedEdges
+        {
+        public:
+            /**
+             * \brief STL container used to store edges.
+             */
+            typedef list<shared_ptr<Edge> > Container;
+
+            /**
+             * \brief Appends each edge's value and next node to edges.
+             */
+            void GetEdges(EdgeList &edges) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    edges.push_back(make_pair((*iter)->GetValue(), (*iter)->GetNext()));
+            }
+
+            /**
+             * \brief Adds an edge to the underlying container.
+             *
+             * @param[in] value The string required to follow the edge.
+             * @param[in] next  The node the edge leads to, or NULL for a leaf edge.
+             */
+            void Add(const string &value, shared_ptr<Node> next)
+            {
+                m_Container.push_back(shared_ptr<Edge>(new Edge(value, next)));
+            }
+
+            /**
+             * \brief Adds a leaf edge for the remainder of a number.
+             *
+             * @param[in] value  The number.
+             * @param[in] offset Position in value where the remainder starts.
+             */
+            void AddLeaf(const string &value, const size_t offset)
+            {
+                Add(value.substr(offset), shared_ptr<Node>());
+            }
+
+            /**
+             * \brief Returns the heap memory used by the container and the edges it holds.
+             */
+            size_t GetMemoryUsage(NodeSet &counted) const
+            {
+                size_t memoryUsage(0);
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    memoryUsage += 2 * sizeof(void *) + sizeof(*iter) + SharedPtrControlBlockSize + (*iter)->GetMemoryUsage(counted);
+                return memoryUsage;
+            }
+
+            /**
+             * \brief Returns true if the remainder of value is stored beneath these edges.
+             */
+            bool Contains(const string &value, const size_t offset) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    if ((*iter)->GetValue()[0] == value[offset])
+                        return (*iter)->Contains(value, offset);
+                return false;
+            }
+
+            /**
+             * \brief Replaces the nodes these edges lead to with their canonical copies.
+             */
+            void Minimize(NodeTable &table)
+            {
+                for (typename Container::iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    (*iter)->Minimize(table);
+            }
+
+            /**
+             * \brief Adds a copy of each edge, placed in arena, to target.
+             */
+            void CopyTo(UnorderedEdges &target, NodeArena &arena) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    target.m_Container.push_back(shared_ptr<Edge>(new (arena.Allocate(sizeof(Edge))) Edge(**iter), ArenaDeleter<Edge>()));
+            }
+
+            /**
+             * \brief Moves the subtrees these edges lead to into the compaction arena. A walk has to visit the
+             *        edges in order of their first characters, so they're sorted first.
+             */
+            bool Relocate(string &path, Relocation &relocation)
+            {
+                vector<pair<size_t, Edge *> > edges;
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    edges.push_back(make_pair(Characters::GetIndex((*iter)->GetValue()[0]), iter->get()));
+                sort(edges.begin(), edges.end());
+                for (typename vector<pair<size_t, Edge *> >::const_iterator edge(edges.begin()); edge != edges.end(); ++edge)
+                    if (!edge->second->Relocate(path, relocation))
+                        return false;
+                return true;
+            }
+
+            /**
+             * \brief Appends the signature of each edge to signature.
+             */
+            void AppendSignature(string &signature) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    (*iter)->AppendSignature(signature);
+            }
+
+            /**
+             * \brief Finds an edge that has common characters with the remainder of value.
+             *
+             * @param[in] value  Look for an edge that has common characters with the remainder of this string.
+             * @param[in] offset Position in value where the remainder starts.
+             *
+             * @return If an edge with common characters was found, then first will contain the number of common
+             *         characters and second will contain the edge. If an edge was not found, then second will be
+             *         NULL.
+             */
+            pair<size_t, Edge *> Find(const string &value, const size_t offset) const
+            { 
+                pair<size_t, Edge *> ret(0, NULL);
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                {
+                    Edge *edge(iter->get());
+                    ret.first = edge->GetNumCommonChars(value, offset);
+                    if (ret.first > 0)
+                    {
+                        ret.second = edge;
+                        break;
+                    }
+                }
+                return ret;
+            }
+
+        private:
+            Container m_Container; /**< The STL container used to store edges. */
+        };
+
+        /**
+         * \brief How edges are ordered in a node can dramatically affect its performance. This class orders
+         *        edges in an STL map, yeilding O(log n) performance.
+         */
+        class OrderedEdges
+        {
+        public:
+            /**
+             * \brief STL container used to store edges.
+             */
+            typedef map<string, shared_ptr<Edge> > Container;
+
+            /**
+             * \brief Appends each edge's value and next node to edges.
+             */
+            void GetEdges(EdgeList &edges) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    edges.push_back(make_pair(iter->first, iter->second->GetNext()));
+            }
+
+            /**
+             * \brief Adds an edge to the underlying container.
+             *
+             * @param[in] value The string required to follow the edge.
+             * @param[in] next  The node the edge leads to, or NULL for a leaf edge.
+             */
+            void Add(const string &value, shared_ptr<Node> next)
+            {
+                m_Container.insert(make_pair(value, shared_ptr<Edge>(new Edge(value, next))));
+            }
+
+            /**
+             * \brief Adds a leaf edge for the remainder of a number.
+             *
+             * @param[in] value  The number.
+             * @param[in] offset Position in value where the remainder starts.
+             */
+            void AddLeaf(const string &value, const size_t offset)
+            {
+                Add(value.substr(offset), shared_ptr<Node>());
+            }
+
+            /**
+             * \brief Returns the heap memory used by the container and the edges it holds.
+             */
+            size_t GetMemoryUsage(NodeSet &counted) const
+            {
+                size_t memoryUsage(0);
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    memoryUsage += 4 * sizeof(void *) + sizeof(*iter) + GetHeapUsage(iter->first) +
+                                   SharedPtrControlBlockSize + iter->second->GetMemoryUsage(counted);
+                return memoryUsage;
+            }
+
+            /**
+             * \brief Returns true if the remainder of value is stored beneath these edges. An edge keeps its key when
+             *        it's split and its value shortened, so like Find this checks the edges either side of the
+             *        remainder for the one that begins with its first character, which is the only one that can
+             *        hold it since edges begin with distinct characters.
+             */
+            bool Contains(const string &value, const size_t offset) const
+            {
+                typename Container::const_iterator iter(m_Container.upper_bound(value.substr(offset)));
+                if ((iter != m_Container.end()) && (iter->first[0] == value[offset]))
+                    return iter->second->Contains(value, offset);
+                return (iter != m_Container.begin()) && ((--iter)->first[0] == value[offset]) && iter->second->Contains(value, offset);
+            }
+
+            /**
+             * \brief Replaces the nodes these edges lead to with their canonical copies.
+             */
+            void Minimize(NodeTable &table)
+            {
+                for (typename Container::iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    iter->second->Minimize(table);
+            }
+
+            /**
+             * \brief Adds a copy of each edge, placed in arena, to target.
+             */
+            void CopyTo(OrderedEdges &target, NodeArena &arena) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    target.m_Container.insert(target.m_Container.end(),
+                                              make_pair(iter->first, shared_ptr<Edge>(new (arena.Allocate(sizeof(Edge))) Edge(*iter->second), ArenaDeleter<Edge>())));
+            }
+
+            /**
+             * \brief Moves the subtrees these edges lead to into the compaction arena, in order.
+             */
+            bool Relocate(string &path, Relocation &relocation)
+            {
+                for (typename Container::iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    if (!iter->second->Relocate(path, relocation))
+                        return false;
+                return true;
+            }
+
+            /**
+             * \brief Appends the signature of each edge to signature.
+             */
+            void AppendSignature(string &signature) const
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    iter->second->AppendSignature(signature);
+            }
+
+            /**
+             * \brief Finds an edge that has common characters with the remainder of value.
+             *
+             * @param[in] value  Look for an edge that has common characters with the remainder of this string.
+             * @param[in] offset Position in value where the remainder starts.
+             *
+             * @return If an edge with common characters was found, then first will contain the number of common
+             *         characters and second will contain the edge. If an edge was not found, then second will be
+             *         NULL.
+             */
+            pair<size_t, Edge *> Find(const string &value, const size_t offset) const
+            {
+                pair<size_t, Edge *> ret(0, NULL);
+                if (!m_Container.empty())
+                {
+                    const string remainder(value.substr(offset));
+
+                    // upper_bound may return the edge that is needed or may return the edge after the edge
+                    // that is needed. For example, if remainder is 'hello' and there is an edge for 'hea' then
+                    // upper_bound will return whatever comes after 'hea'
+                    typename Container::const_iterator iter(m_Container.upper_bound(remainder));
+                    if (iter != m_Container.end())
+                    {
+                        Edge *edge(iter->second.get());
+                        ret.first = edge->GetNumCommonChars(value, offset);
+                        if (ret.first > 0)
+                            ret.second = edge;
+                    }
+                    if (ret.first == 0)
+                    {
+                        if (iter-- != m_Container.begin())
+                        {
+                            Edge *edge(iter->second.get());
+                            ret.first = edge->GetNumCommonChars(value, offset);
+                            if (ret.first > 0)
+                               ret.second = edge;
+                        }
+                    }
+                }
+                return ret;
+            }
+
+        private:
+            Container m_Container; /**< The STL container used to store edges. */
+        };
+
+        /**
+         * \brief How edges are ordered in a node can dramatically affect its performance. This class orders
+         *        edges in a fixed size array so that they can be directly indexed, yeilding O(1) performance.
+         *
+         *        Each slot is a tagged word. Most slots in a sparse tree lead to a single number, so rather than
+         *        pointing to an edge, a slot with its low bit set holds the rest of that number packed inline:
+         *        the slot's index is its first character, and the characters after it are packed in the high
+         *        bits as a base Characters::Size value, with their count in the bits between. The edge is only
+         *        created when a second number arrives under it. A slot pointing to an edge that compaction placed
+         *        in a NodeArena has its second bit set, so that it's released there rather than deleted.
+         */
+        class IndexedEdges
+        {
+        public:
+            /**
+             * \brief A slot that's either NULL, an owned edge pointer, possibly tagged as placed in an arena, or a
+             *        leaf stored inline.
+             */
+            typedef uint64_t Slot;
+
+            /**
+             * \brief STL container used to store edges.
+             */
+            typedef array<Slot, Characters::Size> Container;
+
+            /**
+             * \brief Creates an empty set of edges.
+             */
+            IndexedEdges()
+            {
+                m_Container.assign(0);
+            }
+
+            /**
+             * \brief Deletes the edges the slots point to.
+             */
+            ~IndexedEdges()
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                {
+                    Edge *edge(m_GetEdge(*iter));
+                    if ((edge != NULL) && ((*iter & ArenaTag) != 0))
+                        ArenaDeleter<Edge>()(edge);
+                    else
+                        delete edge;
+                }
+            }
+
+            /**
+             * \brief Appends each edge's value and next node to edges.
+             */
+            void GetEdges(EdgeList &edges) const
+            {
+                for (size_t index(0); index < Characters::Size; ++index)
                 {
-                    const Edge &edge(m_Edges.GetEdge(iter));
-                    cout << indent << "edge=" << edge.GetValue() << endl;
-                    edge.GetNext().Print(depth + 1);
+                    const Slot slot(m_Container[index]);
+                    if ((slot & InlineTag) != 0)
+                        edges.push_back(make_pair(m_Unpack(index, slot), static_cast<const Node *>(NULL)));
+                    else if (slot != 0)
+                        edges.push_back(make_pair(m_GetEdge(slot)->GetValue(), m_GetEdge(slot)->GetNext()));
                 }
             }
 
-        private:
-            /**
-             * \brief Which edges colection to use.
-             */
-            typedef IndexedEdges Edges;
+            /**
+             * \brief Adds an edge to the underlying container.
+             *
+             * @param[in] value The string required to follow the edge.
+             * @param[in] next  The node the edge leads to, or NULL for a leaf edge.
+             */
+            void Add(const string &value, shared_ptr<Node> next)
+            {
+                Slot &slot(m_Container[m_GetIndex(value[0])]);
+                if ((next.get() != NULL) || !m_Pack(value, 0, slot))
+                    slot = reinterpret_cast<uintptr_t>(new Edge(value, next));
+            }
+
+            /**
+             * \brief Adds a leaf edge for the remainder of a number, inline if it fits.
+             *
+             * @param[in] value  The number.
+             * @param[in] offset Position in value where the remainder starts.
+             */
+            void AddLeaf(const string &value, const size_t offset)
+            {
+                Slot &slot(m_Container[m_GetIndex(value[offset])]);
+                if (!m_Pack(value, offset, slot))
+                    slot = reinterpret_cast<uintptr_t>(new Edge(value.substr(offset)));
+            }
+
+            /**
+             * \brief Returns the heap memory used by the edges in the container, which itself is stored inline.
+             */
+            size_t GetMemoryUsage(NodeSet &counted) const
+            {
+                size_t memoryUsage(0);
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    if (m_GetEdge(*iter) != NULL)
+                        memoryUsage += m_GetEdge(*iter)->GetMemoryUsage(counted);
+                return memoryUsage;
+            }
+
+            /**
+             * \brief Returns true if the remainder of value is stored beneath these edges.
+             */
+            bool Contains(const string &value, const size_t offset) const
+            {
+                const Slot slot(m_Container[m_GetIndex(value[offset])]);
+                if ((slot & InlineTag) != 0)
+                {
+                    Slot packed;
+                    return m_Pack(value, offset, packed) && (packed == slot);
+                }
+                return (slot != 0) && m_GetEdge(slot)->Contains(value, offset);
+            }
+
+            /**
+             * \brief Replaces the nodes these edges lead to with their canonical copies.
+             */
+            void Minimize(NodeTable &table)
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    if (m_GetEdge(*iter) != NULL)
+                        m_GetEdge(*iter)->Minimize(table);
+            }
+
+            /**
+             * \brief Copies the slots to target, placing a copy of each edge they point to in arena.
+             */
+            void CopyTo(IndexedEdges &target, NodeArena &arena) const
+            {
+                for (size_t index(0); index < Characters::Size; ++index)
+                {
+                    const Edge *edge(m_GetEdge(m_Container[index]));
+                    if (edge == NULL)
+                        target.m_Container[index] = m_Container[index];
+                    else
+                        target.m_Container[index] = reinterpret_cast<uintptr_t>(new (arena.Allocate(sizeof(Edge))) Edge(*edge)) | ArenaTag;
+                }
+            }
+
+            /**
+             * \brief Moves the subtrees these edges lead to into the compaction arena, in slot order.
+             */
+            bool Relocate(string &path, Relocation &relocation)
+            {
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                    if ((m_GetEdge(*iter) != NULL) && !m_GetEdge(*iter)->Relocate(path, relocation))
+                        return false;
+                return true;
+            }
+
+            /**
+             * \brief Appends the signature of each slot to signature. Leaves stored inline are their own signature,
+             *        and are odd, so they can't be mistaken for the marker before an edge's signature.
+             */
+            void AppendSignature(string &signature) const
+            {
+                const Slot EdgeMarker(2);
+                for (typename Container::const_iterator iter(m_Container.begin()); iter != m_Container.end(); ++iter)
+                {
+                    if (m_GetEdge(*iter) == NULL)
+                        AppendWord(*iter, signature);
+                    else
+                    {
+                        AppendWord(EdgeMarker, signature);
+                        m_GetEdge(*iter)->AppendSignature(signature);
+                    }
+                }
+            }
+
+            /**
+             * \brief Finds an edge that has common characters with the remainder of value. A leaf stored inline
+             *        that holds a different number is expanded into an edge first, so that it can be split.
+             *
+             * @param[in] value  Look for an edge that has common characters with the remainder of this string.
+             * @param[in] offset Position in value where the remainder starts.
+             *
+             * @return If an edge with common characters was found, then first will contain the number of common
+             *         characters and second will contain the edge. If an edge was not found, then second will be
+             *         NULL. If the whole remainder matched a leaf stored inline, then first is the size of the
+             *         remainder and second is NULL.
+             */
+            pair<size_t, Edge *> Find(const string &value, const size_t offset)
+            {
+                Slot &slot(m_Container[m_GetIndex(value[offset])]);
+                if ((slot & InlineTag) != 0)
+                {
+                    Slot packed;
+                    if (m_Pack(value, offset, packed) && (packed == slot))
+                        return pair<size_t, Edge *>(value.size() - offset, NULL);
+                    slot = reinterpret_cast<uintptr_t>(new Edge(m_Unpack(Characters::GetIndex(value[offset]), slot)));
+                }
+                pair<size_t, Edge *> ret(0, m_GetEdge(slot));
+                if (ret.second != NULL)
+                    ret.first = ret.second->GetNumCommonChars(value, offset);
+                return ret;
+            }
+
+        private:
+            static const Slot InlineTag = 1;                                 /**< Set in slots holding a leaf inline. */
+            static const Slot ArenaTag = 2;                                  /**< Set in slots pointing to an edge in an arena. */
+            static const size_t LengthBits = 5;                              /**< Bits holding the number of packed characters. */
+            static const size_t ValueShift = 1 + LengthBits;                 /**< Position of the packed characters. */
+            static const size_t MaxPackedChars =
+                NumDigitsFitting<(static_cast<uint64_t>(1) << (64 - ValueShift)), Characters::Size>::Value; /**< Most characters packed inline. */
+
+            IndexedEdges(const IndexedEdges &);
+            IndexedEdges &operator=(const IndexedEdges &);
+
+            /**
+             * \brief Returns the slot index of a character.
+             */
+            static size_t m_GetIndex(const char ch)
+            {
+                const size_t index(Characters::GetIndex(ch));
+                if (index >= Characters::Size)
+                    RaiseError("character is not in the tree's alphabet");
+                return index;
+            }
+
+            /**
+             * \brief Returns the edge a slot points to, or NULL if it's empty or holds a leaf inline.
+             */
+            static Edge *m_GetEdge(const Slot slot)
+            {
+                return ((slot & InlineTag) != 0) ? NULL : reinterpret_cast<Edge *>(static_cast<uintptr_t>(slot & ~ArenaTag));
+            }
+
+            /**
+             * \brief Packs the characters after the first of a number's remainder into a slot.
+             *
+             * @param[in]  value  The number.
+             * @param[in]  offset Position in value where the remainder starts.
+             * @param[out] slot   Receives the packed leaf.
+             *
+             * @return Returns false, leaving slot unchanged, if the remainder is too long to pack.
+             */
+            static bool m_Pack(const string &value, const size_t offset, Slot &slot)
+            {
+                const size_t numChars(value.size() - offset - 1);
+                if (numChars > MaxPackedChars)
+                    return false;
+                Slot packed(0);
+                for (size_t position(offset + 1); position < value.size(); ++position)
+                    packed = packed * Characters::Size + m_GetIndex(value[position]);
+                slot = (packed << ValueShift) | (static_cast<Slot>(numChars) << 1) | InlineTag;
+                return true;
+            }
+
+            /**
+             * \brief Returns the value of the leaf edge packed in a slot.
+             *
+             * @param[in] index The slot's index, which gives the first character.
+             * @param[in] slot  The packed leaf.
+             */
+            static string m_Unpack(const size_t index, const Slot slot)
+            {
+                const size_t numChars(static_cast<size_t>(slot >> 1) & ((1 << LengthBits) - 1));
+                string value(1 + numChars, Characters::GetCharacter(index));
+                Slot packed(slot >> ValueShift);
+                for (size_t position(numChars); position > 0; --position)
+                {
+                    value[position] = Characters::GetCharacter(static_cast<size_t>(packed % Characters::Size));
+                    packed /= Characters::Size;
+                }
+                return value;
+            }
+
+            Container m_Container; /**< Slots indexed by the first character of their edge. */
+        };
+
+        /**
+         * \brief Represents a node in the tree. Each node can hold an arbitrary number of edges.
+         */
+        class Node
+        {
+        public:
+            /**
+             * \brief Creates a node with no edges.
+             *
+             * @param[in] isTerminal True if a number ends at this node.
+             */
+            explicit Node(const bool isTerminal = false) :
+                m_IsTerminal(isTerminal)
+            {
+            }
+
+            /**
+             * \brief Creates a terminal node with one edge, for a number that ends part way along an edge.
+             *
+             * @param[in] edgeValue The string required to follow the edge.
+             * @param[in] edgeNext  The node the edge leads to, or NULL for a leaf edge.
+             */
+            Node(const string &edgeValue, shared_ptr<Node> edgeNext) :
+                m_IsTerminal(true)
+            {
+                m_Edges.Add(edgeValue, edgeNext);
+            }
+
+            /**
+             * \brief Creates a node with two edges, the second of which is a leaf for the remainder of a number.
+             *
+             * @param[in] firstValue The string required to follow the first edge.
+             * @param[in] firstNext  The node the first edge leads to, or NULL for a leaf edge.
+             * @param[in] value      The number.
+             * @param[in] offset     Position in value where the remainder starts.
+             */
+            Node(const string &firstValue, shared_ptr<Node> firstNext, const string &value, const size_t offset) :
+                m_IsTerminal(false)
+            {
+                m_Edges.Add(firstValue, firstNext);
+                m_Edges.AddLeaf(value, offset);
+            }
+
+            /**
+             * \brief Records that a number ends at this node.
+             *
+             * @return Returns true if no number ended at this node before.
+             */
+            bool MarkTerminal()
+            {
+                const bool wasTerminal(m_IsTerminal);
+                m_IsTerminal = true;
+                return !wasTerminal;
+            }
+
+            /**
+             * \brief Eats characters from the begining of remainder by transitioning to the next
+             *        level node. A new edge and node may be created if one does not already exist.
+             *
+             * @param[in]     value    Eats charaters of this string starting at offset.
+             * @param[in,out] offset   Position of the first character that hasn't been eaten, which is advanced
+             *                         past the eaten characters. If the number was inserted, it's left where the
+             *                         number leaves the tree, i.e. after its longest prefix that was already stored.
+             * @param[in,out] isUnique Returns true if this string is known to be unique.
+             *
+             * @return Returns the next node encountered after following an edge.
+             */
+            Node *Eat(const string &value, size_t &offset, bool &isUnique)
+            {
+                // Check arguments
+                if (offset >= value.size())
+                    RaiseError("invalid remainder");
+
+                Node *next(NULL);
+                const pair<size_t, Edge *> ret(m_Edges.Find(value, offset));
+                if (ret.first > 0)
+                {
+                    if (ret.second == NULL)
+                    {
+                        // The remainder matched a leaf stored inline, so the number is a duplicate
+                        offset = value.size();
+                        return NULL;
+                    }
+                    next = ret.second->Eat(ret.first, value, offset, isUnique);
+                }
+
+                if ((next == NULL) && !isUnique && (offset < value.size()))
+                {
+                    m_Edges.AddLeaf(value, offset);
+                    isUnique = true;
+                }
+                return next;
+            }
+
+            /**
+             * \brief Returns the memory used by this node and everything beneath it.
+             *
+             * @param[in,out] counted Nodes already counted, which are skipped.
+             */
+            size_t GetMemoryUsage(NodeSet &counted) const
+            {
+                return sizeof(*this) + m_Edges.GetMemoryUsage(counted);
+            }
+
+            /**
+             * \brief Returns true if the remainder of value is stored beneath this node.
+             *
+             * @param[in] value  The number.
+             * @param[in] offset Position in value where the remainder starts.
+             */
+            bool Contains(const string &value, const size_t offset) const
+            {
+                if (offset == value.size())
+                    return m_IsTerminal;
+                return m_Edges.Contains(value, offset);
+            }
+
+            /**
+             * \brief Passes every number stored beneath this node to visitor.
+             *
+             * @param[in,out] prefix  The characters leading to this node, which are restored before returning.
+             * @param[in]     visitor Receives the numbers.
+             *
+             * @return Returns false if visitor stopped the visit.
+             */
+            bool Export(string &prefix, Visitor &visitor) const
+            {
+                if (m_IsTerminal && !visitor.Visit(prefix))
+                    return false;
+                EdgeList edges;
+                m_Edges.GetEdges(edges);
+                for (typename EdgeList::const_iterator edge(edges.begin()); edge != edges.end(); ++edge)
+                {
+                    const size_t size(prefix.size());
+                    prefix += edge->first;
+                    const bool keepGoing(edge->second == NULL ? visitor.Visit(prefix) : edge->second->Export(prefix, visitor));
+                    prefix.resize(size);
+                    if (!keepGoing)
+                        return false;
+                }
+                return true;
+            }
+
+            /**
+             * \brief Returns the canonical copy of a subtree, after interning everything beneath it. Two nodes are
+             *        identical if they agree on being terminal and their edges spell the same values to the same
+             *        canonical nodes, so interning bottom up lets a node's signature name its children by address.
+             *
+             * @param[in]     node  The root of the subtree.
+             * @param[in,out] table The canonical nodes found so far.
+             */
+            static shared_ptr<Node> Intern(const shared_ptr<Node> &node, NodeTable &table)
+            {
+                node->m_Edges.Minimize(table);
+                string signature(1, node->m_IsTerminal ? '1' : '0');
+                node->m_Edges.AppendSignature(signature);
+                return table.insert(make_pair(signature, node)).first->second;
+            }
+
+            /**
+             * \brief Moves the nodes of a subtree that follow the compaction cursor into the arena in preorder,
+             *        each followed by its edges, and points their owners at the copies.
+             *
+             * @param[in,out] owner      Owns the root of the subtree, and is pointed at its copy.
+             * @param[in,out] path       The root's path, which is restored before returning.
+             * @param[in,out] relocation Progress of the compaction pass, which is advanced past each node moved.
+             *
+             * @return Returns false if the slice ran out of budget before the subtree was finished.
+             */
+            static bool Relocate(shared_ptr<Node> &owner, string &path, Relocation &relocation)
+            {
+                // A subtree whose path precedes the cursor without leading to it was finished by an earlier slice
+                if (relocation.hasCursor && (path < relocation.cursor) && (relocation.cursor.compare(0, path.size(), path) != 0))
+                    return true;
+                if (relocation.budget == 0)
+                    return false;
+
+                if (!relocation.hasCursor || (path > relocation.cursor))
+                {
+                    if (relocation.isShared)
+                    {
+                        const typename RelocationTable::const_iterator moved(relocation.relocated.find(owner.get()));
+                        if (moved != relocation.relocated.end())
+                        {
+                            owner = moved->second;
+                            return true;
+                        }
+                    }
+                    const shared_ptr<Node> copy(new (relocation.arena.Allocate(sizeof(Node))) Node(owner->m_IsTerminal), ArenaDeleter<Node>());
+                    owner->m_Edges.CopyTo(copy->m_Edges, relocation.arena);
+                    if (relocation.isShared)
+                        relocation.relocated.insert(make_pair(owner.get(), copy));
+                    relocation.retired.push_back(owner);
+                    owner = copy;
+                    relocation.cursor = path;
+                    relocation.hasCursor = true;
+                    relocation.budget--;
+                }
+                return owner->m_Edges.Relocate(path, relocation);
+            }
+
+            /**
+             * \brief Prints the contents of this node and all child nodes.
+             *
+             * @param[in] depth The depth of indentation to use when printing this node.
+             */
+            void Print(const size_t depth) const
+            {
+                const string indent(2 * depth, ' ');
+                EdgeList edges;
+                m_Edges.GetEdges(edges);
+                for (typename EdgeList::const_iterator edge(edges.begin()); edge != edges.end(); ++edge)
+                {
+                    cout << indent << "edge=" << edge->first << endl;
+                    if (edge->second != NULL)
+                        edge->second->Print(depth + 1);
+                }
+            }
+
+        private:
+            /**
+             * \brief Which edges colection to use. Small alphabets index their edges directly, larger ones keep
+             *        them ordered in a map.
+             */
+            typedef typename Select<Characters::Indexed, IndexedEdges, OrderedEdges>::Type Edges;
+
+            Edges m_Edges;     /**< Stores the edges for this node. */
+            bool m_IsTerminal; /**< True if a number ends at this node, which may also have edges when numbers
+                                    vary in length. */
+        };
+
+        const size_t m_NumDirectoryDigits;     /**< Number of leading digits resolved by the directory. */
+        vector<shared_ptr<Node> > m_Directory; /**< Subtree roots indexed by the value of the leading digits. */
+        size_t m_Count;                        /**< Number of unique numbers stored in the tree. */
+        vector<size_t> m_PrefixCounts;         /**< Distinct prefixes of each length below the directory. */
+        bool m_IsFrozen;                       /**< True once Freeze has shared identical subtrees. */
+        size_t m_CompactionSlot;               /**< Directory slot the current compaction pass is moving. */
+        Relocation m_Relocation;               /**< Progress of the current compaction pass. */
+    };
+
+    /**
+     * \brief Implements the unique number algorithm using an STL set, which is faster but
+     *        uses more memory.
+     */
+    class SetAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Numbers.clear();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            const pair<Numbers::iterator, bool> &ret(m_Numbers.insert(number));
+            return ret.second;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            return m_Numbers.count(number) != 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Numbers.size();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            // Each element lives in a red-black tree node holding a color and three links
+            size_t memoryUsage(sizeof(*this));
+            for (Numbers::const_iterator number(m_Numbers.begin()); number != m_Numbers.end(); ++number)
+                memoryUsage += 4 * sizeof(void *) + sizeof(*number) + GetHeapUsage(*number);
+            return memoryUsage;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            for (Numbers::const_iterator number(m_Numbers.begin()); number != m_Numbers.end(); ++number)
+                if (!visitor.Visit(*number))
+                    return;
+        }
+
+    private:
+        /**
+         * \brief Represent the unique numbers as an STL set of strings.
+         */
+        typedef set<string> Numbers;
+
+        Numbers m_Numbers; /**< Set of unique numbers found in the stream */
+    };
+
+    /**
+     * \brief A number of up to 38 digits packed into two 64 bit halves, with the leading digits in high and the
+     *        last 19 digits in low.
+     */
+    struct WideKey
+    {
+        uint64_t high; /**< Length-aware value of the digits before the last 19, or 0 for shorter numbers. */
+        uint64_t low;  /**< Value of the last 19 digits, or the length-aware value of shorter numbers. */
+
+        bool operator<(const WideKey &other) const
+        {
+            return (high < other.high) || ((high == other.high) && (low < other.low));
+        }
+
+        bool operator==(const WideKey &other) const
+        {
+            return (high == other.high) && (low == other.low);
+        }
+
+        bool operator!=(const WideKey &other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    /**
+     * \brief LengthOffsets[n] is the number of digit strings shorter than n digits (1 + 10 + ... + 10^(n - 1)
+     *        counting the empty string as 0). Adding it to the value of an n digit number gives every number
+     *        of up to 19 digits a distinct 64 bit key, so "0123" and "123" don't collide, while numbers of the
+     *        same length keep their order and adjacency.
+     */
+    const uint64_t LengthOffsets[20] =
+    {
+        0ULL, 1ULL, 11ULL, 111ULL, 1111ULL, 11111ULL, 111111ULL, 1111111ULL, 11111111ULL, 111111111ULL,
+        1111111111ULL, 11111111111ULL, 111111111111ULL, 1111111111111ULL, 11111111111111ULL,
+        111111111111111ULL, 1111111111111111ULL, 11111111111111111ULL, 111111111111111111ULL,
+        1111111111111111111ULL
+    };
+
+    /**
+     * \brief Mixes the bits of a 64 bit value so that every input bit affects every output bit (the MurmurHash3
+     *        finalizer).
+     */
+    uint64_t MixBits(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xFF51AFD7ED558CCDULL;
+        value ^= value >> 33;
+        value *= 0xC4CEB9FE1A85EC53ULL;
+        value ^= value >> 33;
+        return value;
+    }
+
+    /**
+     * \brief Hashes a number of any length and alphabet to 64 bits, eight characters at a time. The hash is
+     *        part of ThetaSketch's serialized form, so it must never change.
+     */
+    uint64_t HashNumber(const string &number)
+    {
+        uint64_t hash(0x9E3779B97F4A7C15ULL ^ number.size());
+        size_t offset(0);
+        for (; offset + sizeof(uint64_t) <= number.size(); offset += sizeof(uint64_t))
+        {
+            uint64_t chunk(0);
+            for (size_t byte(0); byte < sizeof(uint64_t); ++byte)
+                chunk |= static_cast<uint64_t>(static_cast<unsigned char>(number[offset + byte])) << (8 * byte);
+            hash = MixBits(hash ^ chunk) + 0x9E3779B97F4A7C15ULL;
+        }
+        uint64_t chunk(0);
+        for (size_t byte(0); offset + byte < number.size(); ++byte)
+            chunk |= static_cast<uint64_t>(static_cast<unsigned char>(number[offset + byte])) << (8 * byte);
+        return MixBits(hash ^ chunk);
+    }
+
+    /**
+     * \brief Describes how numbers are packed into a key type. Packing is length-aware, so numbers of any
+     *        length up to MaxDigits get distinct keys and can be unpacked again.
+     */
+    template <typename Key>
+    struct KeyTraits;
+
+    /**
+     * \brief Numbers of up to 19 digits packed into a single 64 bit integer.
+     */
+    template <>
+    struct KeyTraits<uint64_t>
+    {
+        static const size_t MaxDigits = 19;
+
+        static uint64_t Pack(const string &number)
+        {
+            if (number.size() > MaxDigits)
+                RaiseError("number is too long for a 64 bit key");
+            return LengthOffsets[number.size()] + ParseDigits(number.data(), number.data() + number.size());
+        }
+
+        static string Unpack(const uint64_t key)
+        {
+            size_t numDigits(MaxDigits);
+            while (LengthOffsets[numDigits] > key)
+                --numDigits;
+            return FormatNumber(key - LengthOffsets[numDigits], numDigits);
+        }
+
+        static uint64_t Hash(const uint64_t key)
+        {
+            return MixBits(key);
+        }
+
+        /**
+         * \brief A key that no number packs to, the largest key being about 1.1 * 10^19.
+         */
+        static uint64_t Empty()
+        {
+            return ~static_cast<uint64_t>(0);
+        }
+    };
+
+    /**
+     * \brief Numbers of up to 38 digits packed into a WideKey.
+     */
+    template <>
+    struct KeyTraits<WideKey>
+    {
+        static const size_t MaxDigits = 38;
+
+        static WideKey Pack(const string &number)
+        {
+            if (number.size() > MaxDigits)
+                RaiseError("number is too long for a 128 bit key");
+            WideKey key;
+            if (number.size() <= 19)
+            {
+                key.high = 0;
+                key.low = KeyTraits<uint64_t>::Pack(number);
+                return key;
+            }
+
+            // The leading digits are length-aware, so they're never 0 and never collide with shorter numbers
+            const char *split(number.data() + number.size() - 19);
+            key.high = LengthOffsets[number.size() - 19] + ParseDigits(number.data(), split);
+            key.low = ParseDigits(split, number.data() + number.size());
+            return key;
+        }
+
+        static string Unpack(const WideKey &key)
+        {
+            if (key.high == 0)
+                return KeyTraits<uint64_t>::Unpack(key.low);
+            return KeyTraits<uint64_t>::Unpack(key.high) + FormatNumber(key.low, 19);
+        }
+
+        static uint64_t Hash(const WideKey &key)
+        {
+            return MixBits(key.high * 0x9E3779B97F4A7C15ULL ^ key.low);
+        }
+
+        static WideKey Empty()
+        {
+            WideKey key;
+            key.high = ~static_cast<uint64_t>(0);
+            key.low = ~static_cast<uint64_t>(0);
+            return key;
+        }
+    };
+
+    /**
+     * \brief Implements the unique number algorithm using an STL set of packed integer keys, which avoids the
+     *        string allocation and character by character comparisons of SetAlgorithm.
+     */
+    template <typename Key>
+    class PackedSetAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Numbers.clear();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            return m_Numbers.insert(KeyTraits<Key>::Pack(number)).second;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            return m_Numbers.count(KeyTraits<Key>::Pack(number)) != 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Numbers.size();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            // Each element lives in a red-black tree node holding a color and three links
+            return sizeof(*this) + m_Numbers.size() * (4 * sizeof(void *) + sizeof(Key));
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            for (typename set<Key>::const_iterator key(m_Numbers.begin()); key != m_Numbers.end(); ++key)
+                if (!visitor.Visit(KeyTraits<Key>::Unpack(*key)))
+                    return;
+        }
+
+    private:
+        set<Key> m_Numbers; /**< Set of unique numbers found in the stream. */
+    };
+
+    /**
+     * \brief Implements the unique number algorithm using an open addressing hash table of packed integer keys
+     *        with linear probing. The table is kept at most half full so that probe sequences stay short.
+     */
+    template <typename Key>
+    class HashAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty table.
+         *
+         * @param[in] expectedPopulation Number of numbers to size the table for, or 0 if unknown.
+         */
+        explicit HashAlgorithm(const size_t expectedPopulation) :
+            m_InitialCapacity(MinCapacity),
+            m_Count(0)
+        {
+            while (m_InitialCapacity < 2 * expectedPopulation)
+                m_InitialCapacity *= 2;
+            m_Slots.assign(m_InitialCapacity, KeyTraits<Key>::Empty());
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            vector<Key>(m_InitialCapacity, KeyTraits<Key>::Empty()).swap(m_Slots);
+            m_Count = 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            const Key key(KeyTraits<Key>::Pack(number));
+            if (2 * (m_Count + 1) > m_Slots.size())
+                m_Grow();
+            if (!m_Insert(key))
+                return false;
+            ++m_Count;
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            size_t slot(0);
+            return m_Find(KeyTraits<Key>::Pack(number), slot);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            return sizeof(*this) + m_Slots.capacity() * sizeof(Key);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            for (typename vector<Key>::const_iterator key(m_Slots.begin()); key != m_Slots.end(); ++key)
+                if ((*key != KeyTraits<Key>::Empty()) && !visitor.Visit(KeyTraits<Key>::Unpack(*key)))
+                    return;
+        }
+
+    private:
+        static const size_t MinCapacity = 16; /**< Smallest table size, which must be a power of two. */
+
+        /**
+         * \brief Probes for a key in the table, which must have a free slot.
+         *
+         * @param[in]  key  Key to search for.
+         * @param[out] slot Receives the key's slot, or the empty slot that ended the probe if it's missing.
+         *
+         * @return Returns true if the key is in the table.
+         */
+        bool m_Find(const Key &key, size_t &slot) const
+        {
+            const size_t mask(m_Slots.size() - 1);
+            for (slot = static_cast<size_t>(KeyTraits<Key>::Hash(key)) & mask; ; slot = (slot + 1) & mask)
+            {
+                if (m_Slots[slot] == key)
+                    return true;
+                if (m_Slots[slot] == KeyTraits<Key>::Empty())
+                    return false;
+            }
+        }
+
+        /**
+         * \brief Inserts a key into the table, which must have a free slot.
+         *
+         * @return Returns false if the key was already in the table.
+         */
+        bool m_Insert(const Key &key)
+        {
+            size_t slot(0);
+            if (m_Find(key, slot))
+                return false;
+            m_Slots[slot] = key;
+            return true;
+        }
+
+        /**
+         * \brief Doubles the size of the table and reinserts every key.
+         */
+        void m_Grow()
+        {
+            vector<Key> slots(2 * m_Slots.size(), KeyTraits<Key>::Empty());
+            slots.swap(m_Slots);
+            for (typename vector<Key>::const_iterator key(slots.begin()); key != slots.end(); ++key)
+                if (*key != KeyTraits<Key>::Empty())
+                    m_Insert(*key);
+        }
+
+        size_t m_InitialCapacity; /**< Table size after a reset. */
+        vector<Key> m_Slots;      /**< The table, with empty slots holding KeyTraits<Key>::Empty(). */
+        size_t m_Count;           /**< Number of keys in the table. */
+    };
+
+    /**
+     * \brief Implements the unique number algorithm using a Swiss table of packed integer keys. Slots are
+     *        grouped in 16s, and each slot has a control byte that is either empty or holds 7 bits of the key's
+     *        hash. A probe compares all 16 control bytes of a group at once with SSE2, so only keys whose hash
+     *        bits match are ever compared, and probe sequences stay short at load factors up to 7/8.
+     */
+    template <typename Key>
+    class SwissHashAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty table.
+         *
+         * @param[in] expectedPopulation Number of numbers to size the table for, or 0 if unknown.
+         */
+        explicit SwissHashAlgorithm(const size_t expectedPopulation) :
+            m_InitialCapacity(GroupSize),
+            m_Count(0)
+        {
+            while (m_InitialCapacity * MaxLoadNumerator < expectedPopulation * MaxLoadDenominator)
+                m_InitialCapacity *= 2;
+            m_Control.assign(m_InitialCapacity, Empty);
+            m_Keys.resize(m_InitialCapacity);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            vector<unsigned char>(m_InitialCapacity, Empty).swap(m_Control);
+            vector<Key>(m_InitialCapacity).swap(m_Keys);
+            m_Count = 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            const Key key(KeyTraits<Key>::Pack(number));
+            m_Reserve(m_Count + 1);
+            if (!m_Insert(key, KeyTraits<Key>::Hash(key)))
+                return false;
+            ++m_Count;
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            const Key key(KeyTraits<Key>::Pack(number));
+            size_t slot(0);
+            return m_Find(key, KeyTraits<Key>::Hash(key), slot);
+        }
+
+        /**
+         * \brief Inserts the numbers BatchSize at a time, hashing a whole batch and prefetching the groups its
+         *        keys probe first, so that the cache misses of a batch overlap instead of being taken one after
+         *        another.
+         */
+        virtual size_t InsertBatch(const vector<string> &numbers)
+        {
+            const size_t BatchSize(16);
+            Key keys[BatchSize];
+            uint64_t hashes[BatchSize];
+            size_t numUnique(0);
+            for (size_t first(0); first < numbers.size(); first += BatchSize)
+            {
+                const size_t size(min(BatchSize, numbers.size() - first));
+                m_Reserve(m_Count + size);
+                const size_t groupMask(m_Control.size() / GroupSize - 1);
+                for (size_t index(0); index < size; ++index)
+                {
+                    keys[index] = KeyTraits<Key>::Pack(numbers[first + index]);
+                    hashes[index] = KeyTraits<Key>::Hash(keys[index]);
+                    const size_t group(static_cast<size_t>(hashes[index] >> HashBits) & groupMask);
+                    __builtin_prefetch(&m_Control[group * GroupSize]);
+                    __builtin_prefetch(&m_Keys[group * GroupSize]);
+                }
+                for (size_t index(0); index < size; ++index)
+                {
+                    if (m_Insert(keys[index], hashes[index]))
+                    {
+                        ++m_Count;
+                        ++numUnique;
+                    }
+                }
+            }
+            return numUnique;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            return sizeof(*this) + m_Control.capacity() + m_Keys.capacity() * sizeof(Key);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            for (size_t slot(0); slot < m_Control.size(); ++slot)
+                if ((m_Control[slot] != Empty) && !visitor.Visit(KeyTraits<Key>::Unpack(m_Keys[slot])))
+                    return;
+        }
+
+    private:
+        static const size_t GroupSize = 16;         /**< Slots whose control bytes are compared at once. */
+        static const size_t HashBits = 7;           /**< Bits of the hash kept in a control byte. */
+        static const unsigned char Empty = 0x80;    /**< Control byte of an empty slot. */
+        static const size_t MaxLoadNumerator = 7;   /**< The table grows beyond 7/8 full. */
+        static const size_t MaxLoadDenominator = 8; /**< The table grows beyond 7/8 full. */
+
+        /**
+         * \brief Returns a mask with bit i set if control byte i of the group equals value.
+         */
+        static unsigned int Match(const unsigned char *group, const unsigned char value)
+        {
+#ifdef __SSE2__
+            const __m128i control(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group)));
+            return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(static_cast<char>(value)))));
+#else
+            unsigned int mask(0);
+            for (size_t slot(0); slot < GroupSize; ++slot)
+                if (group[slot] == value)
+                    mask |= 1U << slot;
+            return mask;
+#endif
+        }
+
+        /**
+         * \brief Grows the table until it can hold the specified number of keys within its maximum load.
+         */
+        void m_Reserve(const size_t count)
+        {
+            while (count * MaxLoadDenominator > m_Control.size() * MaxLoadNumerator)
+                m_Grow();
+        }
+
+        /**
+         * \brief Returns the 7 bits of a key's hash kept in its control byte.
+         */
+        static unsigned char GetTag(const uint64_t hash)
+        {
+            return static_cast<unsigned char>(hash & ((1 << HashBits) - 1));
+        }
+
+        /**
+         * \brief Probes for a key in the table, which must have a free slot.
+         *
+         * @param[in]  key  Key to search for.
+         * @param[in]  hash The key's hash.
+         * @param[out] slot Receives the key's slot, or the empty slot that ended the probe if it's missing.
+         *
+         * @return Returns true if the key is in the table.
+         */
+        bool m_Find(const Key &key, const uint64_t hash, size_t &slot) const
+        {
+            // Triangular probing over a power of two number of groups visits every group
+            const size_t groupMask(m_Control.size() / GroupSize - 1);
+            const unsigned char tag(GetTag(hash));
+            size_t group(static_cast<size_t>(hash >> HashBits) & groupMask);
+            for (size_t probe(1); ; group = (group + probe++) & groupMask)
+            {
+                const unsigned char *control(&m_Control[group * GroupSize]);
+                for (unsigned int match(Match(control, tag)); match != 0; match &= match - 1)
+                {
+                    slot = group * GroupSize + __builtin_ctz(match);
+                    if (m_Keys[slot] == key)
+                        return true;
+                }
+
+                // Keys are never removed, so the first empty slot ends the probe sequence
+                const unsigned int empty(Match(control, Empty));
+                if (empty != 0)
+                {
+                    slot = group * GroupSize + __builtin_ctz(empty);
+                    return false;
+                }
+            }
+        }
+
+        /**
+         * \brief Inserts a key into the table, which must have a free slot.
+         *
+         * @return Returns false if the key was already in the table.
+         */
+        bool m_Insert(const Key &key, const uint64_t hash)
+        {
+            size_t slot(0);
+            if (m_Find(key, hash, slot))
+                return false;
+            m_Control[slot] = GetTag(hash);
+            m_Keys[slot] = key;
+            return true;
+        }
+
+        /**
+         * \brief Doubles the size of the table and reinserts every key.
+         */
+        void m_Grow()
+        {
+            vector<unsigned char> control(2 * m_Control.size(), Empty);
+            vector<Key> keys(2 * m_Keys.size());
+            control.swap(m_Control);
+            keys.swap(m_Keys);
+            for (size_t slot(0); slot < control.size(); ++slot)
+                if (control[slot] != Empty)
+                    m_Insert(keys[slot], KeyTraits<Key>::Hash(keys[slot]));
+        }
+
+        size_t m_InitialCapacity;        /**< Table size after a reset, a multiple of GroupSize. */
+        vector<unsigned char> m_Control; /**< Control byte of each slot. */
+        vector<Key> m_Keys;              /**< Key of each slot, meaningful only for full slots. */
+        size_t m_Count;                  /**< Number of keys in the table. */
+    };
+
+    template <typename Key>
+    const unsigned char SwissHashAlgorithm<Key>::Empty;
+
+    /**
+     * \brief Implements the unique number algorithm by storing disjoint [low, high] intervals of numbers in a
+     *        B+tree keyed by each interval's low end. Inserting a number extends or merges adjacent intervals,
+     *        so memory scales with the number of runs of consecutive numbers rather than with the number of
+     *        numbers, which suits feeds of batch-issued IDs.
+     */
+    class IntervalSetAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty tree.
+         */
+        IntervalSetAlgorithm() :
+            m_Root(new Leaf),
+            m_Height(0),
+            m_NumIntervals(0),
+            m_Count(0)
+        {
+        }
+
+        /**
+         * \brief Deletes all nodes in the tree.
+         */
+        virtual ~IntervalSetAlgorithm()
+        {
+            m_Delete(m_Root, m_Height);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Delete(m_Root, m_Height);
+            m_Root = new Leaf;
+            m_Height = 0;
+            m_NumIntervals = 0;
+            m_Count = 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+            Path path;
+            Leaf *leaf(m_Find(value, path));
+
+            // The predecessor is the last interval starting at or before value. It's only outside of this leaf
+            // when value sorts before the leaf's first interval.
+            const size_t position(upper_bound(leaf->lows, leaf->lows + leaf->size, value) - leaf->lows);
+            Leaf *predecessorLeaf(leaf);
+            size_t predecessor(position);
+            if ((position == 0) && (leaf->prev != NULL))
+            {
+                predecessorLeaf = leaf->prev;
+                predecessor = predecessorLeaf->size;
+            }
+            const bool hasPredecessor(predecessor > 0);
+            if (hasPredecessor && (predecessorLeaf->highs[predecessor - 1] >= value))
+                return false;
+
+            // The successor is the first interval starting after value
+            Leaf *successorLeaf(leaf);
+            size_t successor(position);
+            if ((position == leaf->size) && (leaf->next != NULL))
+            {
+                successorLeaf = leaf->next;
+                successor = 0;
+            }
+            const bool hasSuccessor(successor < successorLeaf->size);
+
+            const bool joinsPredecessor(hasPredecessor && (predecessorLeaf->highs[predecessor - 1] + 1 == value));
+            const bool joinsSuccessor(hasSuccessor && (successorLeaf->lows[successor] == value + 1));
+            if (joinsPredecessor && joinsSuccessor)
+            {
+                // value fills the gap between two intervals
+                predecessorLeaf->highs[predecessor - 1] = successorLeaf->highs[successor];
+                m_Erase(successorLeaf->lows[successor]);
+            }
+            else if (joinsPredecessor)
+                predecessorLeaf->highs[predecessor - 1] = value;
+            else if (joinsSuccessor && (successorLeaf == leaf))
+                leaf->lows[successor] = value;
+            else if (joinsSuccessor)
+            {
+                // Lowering the first interval of the next leaf would put it below that leaf's separator, so
+                // move the interval into this leaf instead
+                const uint64_t high(successorLeaf->highs[successor]);
+                m_Erase(successorLeaf->lows[successor]);
+                m_Insert(value, high);
+            }
+            else
+                m_Insert(value, value);
+            m_Count++;
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+            Path path;
+            const Leaf *leaf(m_Find(value, path));
+            size_t position(upper_bound(leaf->lows, leaf->lows + leaf->size, value) - leaf->lows);
+            if ((position == 0) && (leaf->prev != NULL))
+            {
+                leaf = leaf->prev;
+                position = leaf->size;
+            }
+            return (position > 0) && (leaf->highs[position - 1] >= value);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            return sizeof(*this) + m_GetMemoryUsage(m_Root, m_Height);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            // Leaves are chained in key order from the leftmost one, which is where the smallest key would go
+            Path path;
+            for (const Leaf *leaf(m_Find(0, path)); leaf != NULL; leaf = leaf->next)
+            {
+                for (size_t interval(0); interval < leaf->size; ++interval)
+                {
+                    for (uint64_t value(leaf->lows[interval]); ; ++value)
+                    {
+                        if (!visitor.Visit(KeyTraits<uint64_t>::Unpack(value)))
+                            return;
+                        if (value == leaf->highs[interval])
+                            break;
+                    }
+                }
+            }
+        }
+
+    private:
+        /**
+         * \brief Maximum number of intervals in a leaf. Leaves keep lows and highs in separate arrays so that
+         *        searching a leaf only touches the lows.
+         */
+        static const size_t LeafCapacity = 32;
+
+        /**
+         * \brief Maximum number of separator keys in a branch.
+         */
+        static const size_t BranchCapacity = 32;
+
+        /**
+         * \brief A leaf node holding sorted, disjoint and non-adjacent intervals.
+         */
+        struct Leaf
+        {
+            Leaf() : size(0), prev(NULL), next(NULL) {}
+
+            size_t size;                  /**< Number of intervals in this leaf. */
+            uint64_t lows[LeafCapacity];  /**< Low end of each interval, in ascending order. */
+            uint64_t highs[LeafCapacity]; /**< High end of each interval. */
+            Leaf *prev;                   /**< Previous leaf in key order, or NULL. */
+            Leaf *next;                   /**< Next leaf in key order, or NULL. */
+        };
+
+        /**
+         * \brief An internal node. Child i holds the intervals whose low end is in [keys[i - 1], keys[i]).
+         */
+        struct Branch
+        {
+            Branch() : numKeys(0) {}
+
+            size_t numKeys;                     /**< Number of separator keys, one less than the number of children. */
+            uint64_t keys[BranchCapacity];      /**< Separator keys in ascending order. */
+            void *children[BranchCapacity + 1]; /**< Branches, or leaves at the bottom level. */
+        };
+
+        /**
+         * \brief The branches visited while descending to a leaf and the child taken at each one.
+         */
+        typedef vector<pair<Branch *, size_t> > Path;
+
+        /**
+         * \brief Descends to the leaf whose range contains value.
+         *
+         * @param[in]  value Value to search for.
+         * @param[out] path  Receives the branches visited on the way down.
+         *
+         * @return Returns the leaf.
+         */
+        Leaf *m_Find(const uint64_t value, Path &path) const
+        {
+            path.clear();
+            void *node(m_Root);
+            for (size_t level(m_Height); level > 0; --level)
+            {
+                Branch *branch(static_cast<Branch *>(node));
+                const size_t child(upper_bound(branch->keys, branch->keys + branch->numKeys, value) - branch->keys);
+                path.push_back(make_pair(branch, child));
+                node = branch->children[child];
+            }
+            return static_cast<Leaf *>(node);
+        }
+
+        /**
+         * \brief Inserts an interval that neither overlaps nor touches any stored interval, splitting nodes on
+         *        the way back up as needed.
+         */
+        void m_Insert(const uint64_t low, const uint64_t high)
+        {
+            Path path;
+            Leaf *leaf(m_Find(low, path));
+            ++m_NumIntervals;
+
+            Leaf *target(leaf);
+            if (leaf->size == LeafCapacity)
+            {
+                // Split the leaf in half and link the new right half after it
+                Leaf *right(new Leaf);
+                const size_t half(LeafCapacity / 2);
+                right->size = LeafCapacity - half;
+                copy(leaf->lows + half, leaf->lows + LeafCapacity, right->lows);
+                copy(leaf->highs + half, leaf->highs + LeafCapacity, right->highs);
+                leaf->size = half;
+                right->prev = leaf;
+                right->next = leaf->next;
+                if (right->next != NULL)
+                    right->next->prev = right;
+                leaf->next = right;
+                if (low >= right->lows[0])
+                    target = right;
+                m_InsertSeparator(path, right->lows[0], right);
+            }
+
+            const size_t position(upper_bound(target->lows, target->lows + target->size, low) - target->lows);
+            copy_backward(target->lows + position, target->lows + target->size, target->lows + target->size + 1);
+            copy_backward(target->highs + position, target->highs + target->size, target->highs + target->size + 1);
+            target->lows[position] = low;
+            target->highs[position] = high;
+            ++target->size;
+        }
+
+        /**
+         * \brief Adds a new right sibling to the node at the bottom of path, splitting branches as needed.
+         *
+         * @param[in,out] path  Branches leading to the node that was split.
+         * @param[in]     key   Smallest key in the new sibling.
+         * @param[in]     right The new sibling.
+         */
+        void m_InsertSeparator(Path &path, uint64_t key, void *right)
+        {
+            while (!path.empty())
+            {
+                Branch *branch(path.back().first);
+                const size_t child(path.back().second);
+                path.pop_back();
+
+                // Build the combined key and child lists, which are one entry too long if the branch is full
+                uint64_t keys[BranchCapacity + 1];
+                void *children[BranchCapacity + 2];
+                copy(branch->keys, branch->keys + child, keys);
+                keys[child] = key;
+                copy(branch->keys + child, branch->keys + branch->numKeys, keys + child + 1);
+                copy(branch->children, branch->children + child + 1, children);
+                children[child + 1] = right;
+                copy(branch->children + child + 1, branch->children + branch->numKeys + 1, children + child + 2);
+                const size_t numKeys(branch->numKeys + 1);
+
+                if (numKeys <= BranchCapacity)
+                {
+                    copy(keys, keys + numKeys, branch->keys);
+                    copy(children, children + numKeys + 1, branch->children);
+                    branch->numKeys = numKeys;
+                    return;
+                }
+
+                // Split the branch, moving the middle key up to the parent
+                const size_t middle(numKeys / 2);
+                Branch *sibling(new Branch);
+                branch->numKeys = middle;
+                copy(keys, keys + middle, branch->keys);
+                copy(children, children + middle + 1, branch->children);
+                sibling->numKeys = numKeys - middle - 1;
+                copy(keys + middle + 1, keys + numKeys, sibling->keys);
+                copy(children + middle + 1, children + numKeys + 1, sibling->children);
+                key = keys[middle];
+                right = sibling;
+            }
+
+            // The root was split, so the tree grows by a level
+            Branch *root(new Branch);
+            root->numKeys = 1;
+            root->keys[0] = key;
+            root->children[0] = m_Root;
+            root->children[1] = right;
+            m_Root = root;
+            ++m_Height;
+        }
+
+        /**
+         * \brief Removes the interval starting at low. Underfull nodes are tolerated; only nodes that become
+         *        empty are removed, which keeps removal cheap since it only happens when intervals merge.
+         */
+        void m_Erase(const uint64_t low)
+        {
+            Path path;
+            Leaf *leaf(m_Find(low, path));
+            const size_t position(lower_bound(leaf->lows, leaf->lows + leaf->size, low) - leaf->lows);
+            if ((position == leaf->size) || (leaf->lows[position] != low))
+                RaiseError("interval not found");
+            copy(leaf->lows + position + 1, leaf->lows + leaf->size, leaf->lows + position);
+            copy(leaf->highs + position + 1, leaf->highs + leaf->size, leaf->highs + position);
+            --leaf->size;
+            --m_NumIntervals;
+            if ((leaf->size > 0) || path.empty())
+                return;
+
+            // Unlink and delete the empty leaf, then remove it (and any branches left empty) from its parents
+            if (leaf->prev != NULL)
+                leaf->prev->next = leaf->next;
+            if (leaf->next != NULL)
+                leaf->next->prev = leaf->prev;
+            delete leaf;
+            while (!path.empty())
+            {
+                Branch *branch(path.back().first);
+                const size_t child(path.back().second);
+                path.pop_back();
+                if (branch->numKeys > 0)
+                {
+                    // Drop the separator to the left of the child, or to its right for the first child
+                    const size_t key(child > 0 ? child - 1 : 0);
+                    copy(branch->keys + key + 1, branch->keys + branch->numKeys, branch->keys + key);
+                    copy(branch->children + child + 1, branch->children + branch->numKeys + 1, branch->children + child);
+                    --branch->numKeys;
+                    break;
+                }
+                if (path.empty())
+                {
+                    // The last leaf under the root was removed
+                    delete branch;
+                    m_Root = new Leaf;
+                    m_Height = 0;
+                    return;
+                }
+                delete branch;
+            }
+
+            // Collapse roots that are left with a single child
+            while ((m_Height > 0) && (static_cast<Branch *>(m_Root)->numKeys == 0))
+            {
+                Branch *root(static_cast<Branch *>(m_Root));
+                m_Root = root->children[0];
+                delete root;
+                --m_Height;
+            }
+        }
+
+        /**
+         * \brief Returns the memory used by a node and everything beneath it.
+         *
+         * @param[in] node   The node to measure.
+         * @param[in] height Number of branch levels beneath and including node.
+         */
+        static size_t m_GetMemoryUsage(const void *node, const size_t height)
+        {
+            if (height == 0)
+                return sizeof(Leaf);
+            const Branch *branch(static_cast<const Branch *>(node));
+            size_t memoryUsage(sizeof(Branch));
+            for (size_t child(0); child <= branch->numKeys; ++child)
+                memoryUsage += m_GetMemoryUsage(branch->children[child], height - 1);
+            return memoryUsage;
+        }
+
+        /**
+         * \brief Deletes a node and everything beneath it.
+         *
+         * @param[in] node   The node to delete.
+         * @param[in] height Number of branch levels beneath and including node.
+         */
+        static void m_Delete(void *node, const size_t height)
+        {
+            if (height == 0)
+            {
+                delete static_cast<Leaf *>(node);
+                return;
+            }
+            Branch *branch(static_cast<Branch *>(node));
+            for (size_t child(0); child <= branch->numKeys; ++child)
+                m_Delete(branch->children[child], height - 1);
+            delete branch;
+        }
+
+        void *m_Root;          /**< Root node, a leaf when m_Height is 0 and a branch otherwise. */
+        size_t m_Height;       /**< Number of branch levels above the leaves. */
+        size_t m_NumIntervals; /**< Number of intervals stored in the tree. */
+        size_t m_Count;        /**< Number of numbers covered by the intervals. */
+    };
+
+    /**
+     * \brief Implements the unique number algorithm using a bitmap with one bit per possible number, indexed by
+     *        its length-aware key. The bitmap is split into 64 KB blocks reached through a two-level table, and
+     *        a block is only allocated once a number falls in it, so wide universes (up to 12 digits, i.e. about
+     *        10^12 bits) only consume memory for the regions that are actually touched.
+     */
+    class SparseBitmapAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty bitmap.
+         */
+        SparseBitmapAlgorithm() :
+            m_NumDirectories(0),
+            m_NumBlocks(0),
+            m_Count(0)
+        {
+        }
+
+        /**
+         * \brief Frees all blocks.
+         */
+        virtual ~SparseBitmapAlgorithm()
+        {
+            m_Free();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Free();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            if (number.size() > MaxDigits)
+                RaiseError("number is too long for the sparse bitmap");
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+
+            const size_t directoryIndex(static_cast<size_t>(value >> (BlockBits + DirectoryBits)));
+            if (directoryIndex >= m_Directories.size())
+                m_Directories.resize(directoryIndex + 1, NULL);
+            Directory *&directory(m_Directories[directoryIndex]);
+            if (directory == NULL)
+            {
+                directory = new Directory;
+                ++m_NumDirectories;
+            }
+
+            const size_t blockIndex(static_cast<size_t>(value >> BlockBits) & (DirectorySize - 1));
+            uint64_t *&block(directory->blocks[blockIndex]);
+            if (block == NULL)
+            {
+                block = static_cast<uint64_t *>(calloc(BlockWords, sizeof(uint64_t)));
+                if (block == NULL)
+                    throw bad_alloc();
+                ++m_NumBlocks;
+            }
+
+            const size_t bit(static_cast<size_t>(value) & (BlockSize - 1));
+            const uint64_t mask(static_cast<uint64_t>(1) << (bit % 64));
+            uint64_t &word(block[bit / 64]);
+            if ((word & mask) != 0)
+                return false;
+            word |= mask;
+            ++directory->counts[blockIndex];
+            ++m_Count;
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            // IsUnique rejects numbers this long, so they're never stored
+            if (number.size() > MaxDigits)
+                return false;
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+
+            const size_t directoryIndex(static_cast<size_t>(value >> (BlockBits + DirectoryBits)));
+            if ((directoryIndex >= m_Directories.size()) || (m_Directories[directoryIndex] == NULL))
+                return false;
+            const uint64_t *block(m_Directories[directoryIndex]->blocks[static_cast<size_t>(value >> BlockBits) & (DirectorySize - 1)]);
+            if (block == NULL)
+                return false;
+            const size_t bit(static_cast<size_t>(value) & (BlockSize - 1));
+            return (block[bit / 64] & (static_cast<uint64_t>(1) << (bit % 64))) != 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            return sizeof(*this) + m_Directories.capacity() * sizeof(Directory *) +
+                   m_NumDirectories * sizeof(Directory) + m_NumBlocks * BlockWords * sizeof(uint64_t);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            for (size_t directoryIndex(0); directoryIndex < m_Directories.size(); ++directoryIndex)
+            {
+                const Directory *directory(m_Directories[directoryIndex]);
+                if (directory == NULL)
+                    continue;
+                for (size_t blockIndex(0); blockIndex < DirectorySize; ++blockIndex)
+                {
+                    const uint64_t *block(directory->blocks[blockIndex]);
+                    if (block == NULL)
+                        continue;
+                    const uint64_t first(((static_cast<uint64_t>(directoryIndex) << DirectoryBits) + blockIndex) << BlockBits);
+                    for (size_t word(0); word < BlockWords; ++word)
+                        for (uint64_t bits(block[word]); bits != 0; bits &= bits - 1)
+                            if (!visitor.Visit(KeyTraits<uint64_t>::Unpack(first + 64 * word + __builtin_ctzll(bits))))
+                                return;
+                }
+            }
+        }
+
+    private:
+        static const size_t MaxDigits = 12;                     /**< Longest number the bitmap accepts. */
+        static const size_t BlockBits = 19;                     /**< log2 of the number of bits in a 64 KB block. */
+        static const size_t BlockSize = 1 << BlockBits;         /**< Number of bits in a block. */
+        static const size_t BlockWords = BlockSize / 64;        /**< Number of 64 bit words in a block. */
+        static const size_t DirectoryBits = 10;                 /**< log2 of the number of blocks in a directory. */
+        static const size_t DirectorySize = 1 << DirectoryBits; /**< Number of blocks in a directory. */
+
+        /**
+         * \brief The second level of the table, covering DirectorySize consecutive blocks.
+         */
+        struct Directory
+        {
+            Directory()
+            {
+                fill(blocks, blocks + DirectorySize, static_cast<uint64_t *>(NULL));
+                fill(counts, counts + DirectorySize, 0);
+            }
+
+            uint64_t *blocks[DirectorySize]; /**< Blocks of bits, or NULL if nothing has been stored in them. */
+            uint32_t counts[DirectorySize];  /**< Number of bits set in each block. */
+        };
+
+        /**
+         * \brief Frees all directories and blocks.
+         */
+        void m_Free()
+        {
+            for (vector<Directory *>::iterator directory(m_Directories.begin()); directory != m_Directories.end(); ++directory)
+            {
+                if (*directory == NULL)
+                    continue;
+                for (size_t block(0); block < DirectorySize; ++block)
+                    free((*directory)->blocks[block]);
+                delete *directory;
+            }
+            vector<Directory *>().swap(m_Directories);
+            m_NumDirectories = 0;
+            m_NumBlocks = 0;
+            m_Count = 0;
+        }
+
+        vector<Directory *> m_Directories; /**< First level of the table, grown on demand. */
+        size_t m_NumDirectories;           /**< Number of directories allocated. */
+        size_t m_NumBlocks;                /**< Number of blocks allocated. */
+        size_t m_Count;                    /**< Number of bits set. */
+    };
+
+    /**
+     * \brief Implements the unique number algorithm by keeping the packed numbers in sorted blocks of up to
+     *        MaxBlockSize keys. Each block stores the deltas between its consecutive keys bit packed at the
+     *        width of its largest delta, and a flat array of block minimums locates the block for a key.
+     *        Inserting decodes and re-encodes a single block. For medium density feeds, where neighbouring
+     *        keys are tens to thousands apart, this takes one or two bytes per key.
+     */
+    class SortedBlockAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty set.
+         */
+        SortedBlockAlgorithm() :
+            m_Count(0)
+        {
+        }
+
+        /**
+         * \brief Deletes all blocks.
+         */
+        virtual ~SortedBlockAlgorithm()
+        {
+            m_Free();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Free();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+            const size_t MaxBlockRange(0xFFFFFFFFULL);
+
+            // The block that would hold value is the last one starting at or before it, or the first block for
+            // values below every minimum
+            size_t index(upper_bound(m_Minimums.begin(), m_Minimums.end(), value) - m_Minimums.begin());
+            if (index > 0)
+                --index;
+
+            // Keys are decoded as 32 bit offsets from the block's minimum, so a value that would stretch its block
+            // across more than 2^32 starts a block of its own
+            if (m_Blocks.empty() ||
+                ((value >= m_Minimums[index]) && (value - m_Minimums[index] > MaxBlockRange)) ||
+                ((value < m_Minimums[index]) && (m_GetMaximum(index) - value > MaxBlockRange)))
+            {
+                if (!m_Blocks.empty() && (value > m_Minimums[index]))
+                    ++index;
+                m_Minimums.insert(m_Minimums.begin() + index, value);
+                m_Blocks.insert(m_Blocks.begin() + index, new Block);
+                const uint32_t offset(0);
+                m_Encode(index, &offset, 1);
+                m_Count++;
+                return true;
+            }
+
+            // A value below the minimum becomes the block's new minimum
+            const size_t size(m_Decode(index));
+            const uint64_t minimum(m_Minimums[index]);
+            if (value < minimum)
+            {
+                const uint32_t shift(static_cast<uint32_t>(minimum - value));
+                for (size_t key(0); key < size; ++key)
+                    m_Offsets[key] += shift;
+                m_Offsets.insert(m_Offsets.begin(), 0);
+                m_Minimums[index] = value;
+            }
+            else
+            {
+                const uint32_t offset(static_cast<uint32_t>(value - minimum));
+                const size_t position(Rank(&m_Offsets[0], size, offset));
+                if ((position < size) && (m_Offsets[position] == offset))
+                    return false;
+                m_Offsets.insert(m_Offsets.begin() + position, offset);
+            }
+            m_Count++;
+
+            if (size + 1 <= MaxBlockSize)
+            {
+                m_Encode(index, &m_Offsets[0], size + 1);
+                return true;
+            }
+
+            // Split a full block in half
+            const size_t half((size + 1) / 2);
+            const uint64_t splitMinimum(m_Minimums[index] + m_Offsets[half]);
+            const uint32_t splitOffset(m_Offsets[half]);
+            for (size_t key(half); key < size + 1; ++key)
+                m_Offsets[key] -= splitOffset;
+            m_Minimums.insert(m_Minimums.begin() + index + 1, splitMinimum);
+            m_Blocks.insert(m_Blocks.begin() + index + 1, new Block);
+            m_Encode(index, &m_Offsets[0], half);
+            m_Encode(index + 1, &m_Offsets[half], size + 1 - half);
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+            const size_t index(upper_bound(m_Minimums.begin(), m_Minimums.end(), value) - m_Minimums.begin());
+            if (index == 0)
+                return false;
+
+            // Sum the deltas of the block that would hold value until reaching or passing it
+            const Block &block(*m_Blocks[index - 1]);
+            uint64_t key(m_Minimums[index - 1]);
+            for (size_t position(1); (key < value) && (position < block.size); ++position)
+                key += m_GetDelta(block, position);
+            return key == value;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            size_t memoryUsage(sizeof(*this) + m_Minimums.capacity() * sizeof(uint64_t) +
+                               m_Blocks.capacity() * sizeof(Block *) + m_Offsets.capacity() * sizeof(uint32_t));
+            for (vector<Block *>::const_iterator block(m_Blocks.begin()); block != m_Blocks.end(); ++block)
+                memoryUsage += sizeof(Block) + (*block)->words.capacity() * sizeof(uint64_t);
+            return memoryUsage;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Export
+         */
+        virtual void Export(Visitor &visitor) const
+        {
+            for (size_t index(0); index < m_Blocks.size(); ++index)
+            {
+                uint64_t value(m_Minimums[index]);
+                for (size_t key(0); key < m_Blocks[index]->size; ++key)
+                {
+                    if (key > 0)
+                        value += m_GetDelta(*m_Blocks[index], key);
+                    if (!visitor.Visit(KeyTraits<uint64_t>::Unpack(value)))
+                        return;
+                }
+            }
+        }
+
+    private:
+        static const size_t MaxBlockSize = 256; /**< Most keys in a block before it's split. */
+
+        /**
+         * \brief A block of keys, stored as bit packed deltas between consecutive keys. The first key is the
+         *        block's minimum, which is kept in m_Minimums.
+         */
+        struct Block
+        {
+            Block() :
+                size(0),
+                width(0)
+            {
+            }
+
+            unsigned short size;    /**< Number of keys. */
+            unsigned char width;    /**< Bits per delta. */
+            vector<uint64_t> words; /**< The size - 1 deltas, width bits each. */
+        };
+
+        /**
+         * \brief Returns the number of the sorted offsets that are less than target. Blocks are small enough
+         *        that comparing every offset, four at a time, beats a binary search's mispredicted branches.
+         *
+         * @param[in] offsets The offsets, padded with 0xFFFFFFFF to a multiple of four.
+         * @param[in] size    Number of offsets, excluding the padding.
+         * @param[in] target  The offset to rank.
+         */
+        static size_t Rank(const uint32_t *offsets, const size_t size, const uint32_t target)
+        {
+#ifdef __SSE2__
+            // SSE2 only compares signed integers, so both sides are biased by 2^31
+            const __m128i bias(_mm_set1_epi32(static_cast<int>(0x80000000U)));
+            const __m128i biasedTarget(_mm_set1_epi32(static_cast<int>(target ^ 0x80000000U)));
+            __m128i counts(_mm_setzero_si128());
+            for (size_t offset(0); offset < size; offset += 4)
+            {
+                const __m128i values(_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(offsets + offset)), bias));
+                counts = _mm_sub_epi32(counts, _mm_cmplt_epi32(values, biasedTarget));
+            }
+            counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(1, 0, 3, 2)));
+            counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(2, 3, 0, 1)));
+            return static_cast<size_t>(_mm_cvtsi128_si32(counts));
+#else
+            return lower_bound(offsets, offsets + size, target) - offsets;
+#endif
+        }
+
+        /**
+         * \brief Returns the difference between a key in a block and the one before it.
+         *
+         * @param[in] block The block.
+         * @param[in] key   Position of the key in the block, which must be at least 1.
+         */
+        static uint32_t m_GetDelta(const Block &block, const size_t key)
+        {
+            const size_t bit((key - 1) * block.width);
+            uint64_t delta(block.words[bit / 64] >> (bit % 64));
+            if (bit % 64 + block.width > 64)
+                delta |= block.words[bit / 64 + 1] << (64 - bit % 64);
+            return static_cast<uint32_t>(delta & ((1ULL << block.width) - 1));
+        }
+
+        /**
+         * \brief Returns the largest key in a block.
+         */
+        uint64_t m_GetMaximum(const size_t index)
+        {
+            return m_Minimums[index] + m_Offsets[m_Decode(index) - 1];
+        }
+
+        /**
+         * \brief Decodes a block into m_Offsets, as offsets from its minimum followed by padding for Rank.
+         *
+         * @return Returns the number of keys in the block.
+         */
+        size_t m_Decode(const size_t index)
+        {
+            const Block &block(*m_Blocks[index]);
+            m_Offsets.resize((block.size + 3) & ~static_cast<size_t>(3));
+            m_Offsets[0] = 0;
+            for (size_t key(1); key < block.size; ++key)
+                m_Offsets[key] = m_Offsets[key - 1] + m_GetDelta(block, key);
+            fill(m_Offsets.begin() + block.size, m_Offsets.end(), 0xFFFFFFFFU);
+            return block.size;
+        }
+
+        /**
+         * \brief Encodes sorted offsets from a block's minimum into the block.
+         *
+         * @param[in] index   The block to replace.
+         * @param[in] offsets The offsets, the first of which is 0.
+         * @param[in] size    Number of offsets.
+         */
+        void m_Encode(const size_t index, const uint32_t *offsets, const size_t size)
+        {
+            Block &block(*m_Blocks[index]);
+            uint32_t largest(0);
+            for (size_t key(1); key < size; ++key)
+                largest = max(largest, offsets[key] - offsets[key - 1]);
+            size_t width(0);
+            while ((width < 32) && ((largest >> width) != 0))
+                ++width;
+
+            vector<uint64_t> words(((size - 1) * width + 63) / 64, 0);
+            for (size_t key(1); key < size; ++key)
+            {
+                const uint64_t delta(offsets[key] - offsets[key - 1]);
+                const size_t bit((key - 1) * width);
+                words[bit / 64] |= delta << (bit % 64);
+                if (bit % 64 + width > 64)
+                    words[bit / 64 + 1] |= delta >> (64 - bit % 64);
+            }
+            block.size = static_cast<unsigned short>(size);
+            block.width = static_cast<unsigned char>(width);
+            block.words.swap(words);
+        }
+
+        /**
+         * \brief Deletes all blocks.
+         */
+        void m_Free()
+        {
+            for (vector<Block *>::iterator block(m_Blocks.begin()); block != m_Blocks.end(); ++block)
+                delete *block;
+            vector<Block *>().swap(m_Blocks);
+            m_Minimums.clear();
+            m_Count = 0;
+        }
+
+        vector<uint64_t> m_Minimums; /**< Smallest key of each block, in order. */
+        vector<Block *> m_Blocks;    /**< The blocks, in order, held by pointer so that inserting one in the
+                                          middle moves pointers rather than copying every later block. */
+        vector<uint32_t> m_Offsets;  /**< Scratch space for a decoded block. */
+        size_t m_Count;              /**< Number of keys in the set. */
+    };
+
+    /**
+     * \brief Implements the unique number algorithm as a 64-way hierarchy of bitmaps over numbers of up to 19
+     *        digits packed into integer keys. Level 0 has a bit per key, and each bit of level l + 1 records
+     *        whether the corresponding word of level l is non-zero. Finding the next or previous key climbs
+     *        until a word has a set bit on the right side of the key, then descends taking the nearest set bit,
+     *        so it costs a couple of word operations per level and a level covers 6 bits of the key (e.g. 6
+     *        levels for 9 digit numbers), in the spirit of a van Emde Boas tree. Every level is stored in pages
+     *        that are only allocated once a bit in them is set.
+     */
+    class BitmapTreeAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty set.
+         */
+        BitmapTreeAlgorithm() :
+            m_Levels(1),
+            m_NumPages(0),
+            m_Count(0)
+        {
+        }
+
+        /**
+         * \brief Frees all pages.
+         */
+        virtual ~BitmapTreeAlgorithm()
+        {
+            m_Free();
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Free();
+            m_Levels.assign(1, Pages());
+            m_Count = 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            const uint64_t key(KeyTraits<uint64_t>::Pack(number));
+            if (m_Contains(key))
+                return false;
+
+            // Grow the hierarchy until its single top word covers the key
+            while ((m_Levels.size() * WordBits < 64) && ((key >> (m_Levels.size() * WordBits)) != 0))
+            {
+                const bool isEmpty(m_GetWord(m_Levels.size() - 1, 0) == 0);
+                m_Levels.push_back(Pages());
+                if (!isEmpty)
+                    m_GetWordForWrite(m_Levels.size() - 1, 0) |= 1;
+            }
+
+            // Set the key's bit at each level until reaching a word that already had a bit set
+            uint64_t bit(key);
+            for (size_t level(0); level < m_Levels.size(); ++level, bit >>= WordBits)
+            {
+                uint64_t &word(m_GetWordForWrite(level, bit >> WordBits));
+                const bool wasEmpty(word == 0);
+                word |= static_cast<uint64_t>(1) << (bit & WordMask);
+                if (!wasEmpty)
+                    break;
+            }
+            ++m_Count;
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            return m_Contains(KeyTraits<uint64_t>::Pack(number));
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            size_t memoryUsage(sizeof(*this) + m_Levels.capacity() * sizeof(Pages) +
+                               m_NumPages * PageWords * sizeof(uint64_t));
+            for (vector<Pages>::const_iterator level(m_Levels.begin()); level != m_Levels.end(); ++level)
+                memoryUsage += level->capacity() * sizeof(uint64_t *);
+            return memoryUsage;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetSuccessor
+         */
+        virtual bool GetSuccessor(const string &number, string &successor) const
+        {
+            uint64_t key;
+            if (!m_GetSuccessor(KeyTraits<uint64_t>::Pack(number), key))
+                return false;
+            successor = KeyTraits<uint64_t>::Unpack(key);
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetPredecessor
+         */
+        virtual bool GetPredecessor(const string &number, string &predecessor) const
+        {
+            uint64_t key;
+            if (!m_GetPredecessor(KeyTraits<uint64_t>::Pack(number), key))
+                return false;
+            predecessor = KeyTraits<uint64_t>::Unpack(key);
+            return true;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Visit
+         */
+        virtual void Visit(Visitor &visitor) const
+        {
+            m_Visit(0, KeyTraits<uint64_t>::Empty() - 1, visitor);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::VisitRange
+         */
+        virtual void VisitRange(const string &low, const string &high, Visitor &visitor) const
+        {
+            m_Visit(KeyTraits<uint64_t>::Pack(low), KeyTraits<uint64_t>::Pack(high), visitor);
+        }
+
+    private:
+        static const size_t WordBits = 6;    /**< Bits of the key resolved by each level. */
+        static const uint64_t WordMask = 63; /**< Position of a key's bit within its word. */
+        static const size_t PageWords = 64;  /**< Words allocated at a time, one 512 byte page. */
+
+        /**
+         * \brief A level of the hierarchy, as pointers to pages that are NULL until a bit in them is set.
+         */
+        typedef vector<uint64_t *> Pages;
+
+        /**
+         * \brief Returns a word of a level, which is 0 if its page hasn't been allocated.
+         */
+        uint64_t m_GetWord(const size_t level, const uint64_t index) const
+        {
+            const Pages &pages(m_Levels[level]);
+            const uint64_t page(index / PageWords);
+            if ((page >= pages.size()) || (pages[page] == NULL))
+                return 0;
+            return pages[page][index % PageWords];
+        }
+
+        /**
+         * \brief Returns a word of a level, allocating its page if needed.
+         */
+        uint64_t &m_GetWordForWrite(const size_t level, const uint64_t index)
+        {
+            Pages &pages(m_Levels[level]);
+            const size_t page(static_cast<size_t>(index / PageWords));
+            if (page >= pages.size())
+                pages.resize(page + 1, NULL);
+            if (pages[page] == NULL)
+            {
+                pages[page] = static_cast<uint64_t *>(calloc(PageWords, sizeof(uint64_t)));
+                if (pages[page] == NULL)
+                    throw bad_alloc();
+                ++m_NumPages;
+            }
+            return pages[page][index % PageWords];
+        }
+
+        /**
+         * \brief Returns true if the key's bit is set.
+         */
+        bool m_Contains(const uint64_t key) const
+        {
+            return ((m_GetWord(0, key >> WordBits) >> (key & WordMask)) & 1) != 0;
+        }
+
+        /**
+         * \brief Finds the smallest key greater than key.
+         *
+         * @return Returns false if there isn't one.
+         */
+        bool m_GetSuccessor(const uint64_t key, uint64_t &successor) const
+        {
+            // Climb until a word has a set bit above the current position
+            uint64_t bit(key);
+            size_t level(0);
+            uint64_t word(0);
+            for (; level < m_Levels.size(); ++level, bit >>= WordBits)
+            {
+                const uint64_t position(bit & WordMask);
+                word = position == WordMask ? 0 : m_GetWord(level, bit >> WordBits) & (~static_cast<uint64_t>(0) << (position + 1));
+                if (word != 0)
+                    break;
+            }
+            if (level == m_Levels.size())
+                return false;
+
+            // Descend, taking the lowest set bit of each word
+            bit = (bit & ~WordMask) | __builtin_ctzll(word);
+            while (level-- > 0)
+                bit = (bit << WordBits) | __builtin_ctzll(m_GetWord(level, bit));
+            successor = bit;
+            return true;
+        }
+
+        /**
+         * \brief Finds the largest key less than key.
+         *
+         * @return Returns false if there isn't one.
+         */
+        bool m_GetPredecessor(const uint64_t key, uint64_t &predecessor) const
+        {
+            // Keys beyond the top of the hierarchy have the largest stored key as their predecessor
+            uint64_t bit(key);
+            size_t level(0);
+            uint64_t word(0);
+            if ((m_Levels.size() * WordBits < 64) && ((key >> (m_Levels.size() * WordBits)) != 0))
+            {
+                level = m_Levels.size() - 1;
+                bit = 0;
+                word = m_GetWord(level, 0);
+            }
+            else
+            {
+                // Climb until a word has a set bit below the current position
+                for (; level < m_Levels.size(); ++level, bit >>= WordBits)
+                {
+                    word = m_GetWord(level, bit >> WordBits) & ((static_cast<uint64_t>(1) << (bit & WordMask)) - 1);
+                    if (word != 0)
+                        break;
+                }
+            }
+            if ((level == m_Levels.size()) || (word == 0))
+                return false;
+
+            // Descend, taking the highest set bit of each word
+            bit = (bit & ~WordMask) | (63 - __builtin_clzll(word));
+            while (level-- > 0)
+                bit = (bit << WordBits) | (63 - __builtin_clzll(m_GetWord(level, bit)));
+            predecessor = bit;
+            return true;
+        }
+
+        /**
+         * \brief Passes the keys from low to high inclusive to visitor, stopping early if it returns false.
+         */
+        void m_Visit(const uint64_t low, const uint64_t high, Visitor &visitor) const
+        {
+            uint64_t key(low);
+            if (!m_Contains(key) && !m_GetSuccessor(low, key))
+                return;
+            while ((key <= high) && visitor.Visit(KeyTraits<uint64_t>::Unpack(key)) && m_GetSuccessor(key, key))
+                ;
+        }
+
+        /**
+         * \brief Frees all pages.
+         */
+        void m_Free()
+        {
+            for (vector<Pages>::iterator level(m_Levels.begin()); level != m_Levels.end(); ++level)
+                for (Pages::iterator page(level->begin()); page != level->end(); ++page)
+                    free(*page);
+            m_NumPages = 0;
+        }
+
+        vector<Pages> m_Levels; /**< The levels, from a bit per key upwards. The top level is a single word. */
+        size_t m_NumPages;      /**< Number of pages allocated across all levels. */
+        size_t m_Count;         /**< Number of keys in the set. */
+    };
+
+    /**
+     * \brief Returns how many of the first N keys are less than value, comparing every key rather than
+     *        branching on each comparison. N must be even.
+     */
+    template <size_t N>
+    size_t CountLess(const uint64_t *keys, const uint64_t value)
+    {
+#ifdef __SSE4_2__
+        // SSE4.2 only compares signed integers, so both sides are biased by 2^63
+        const __m128i bias(_mm_set1_epi64x(static_cast<long long>(0x8000000000000000ULL)));
+        const __m128i biasedValue(_mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(value)), bias));
+        __m128i counts(_mm_setzero_si128());
+        for (size_t key(0); key < N; key += 2)
+        {
+            const __m128i biasedKeys(_mm_xor_si128(_mm_load_si128(reinterpret_cast<const __m128i *>(keys + key)), bias));
+            counts = _mm_sub_epi64(counts, _mm_cmpgt_epi64(biasedValue, biasedKeys));
+        }
+        return static_cast<size_t>(_mm_cvtsi128_si64(counts) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(counts, counts)));
+#else
+        size_t count(0);
+        for (size_t key(0); key < N; ++key)
+            count += keys[key] < value;
+        return count;
+#endif
+    }
+
+    /**
+     * \brief Implements the unique number algorithm using a B+tree of numbers of up to 19 digits packed into
+     *        64 bit keys. Nodes are aligned to cache lines and unused key slots hold KeyTraits<uint64_t>::Empty(),
+     *        which is larger than every key, so a node is searched by counting the keys below the value with
+     *        SIMD comparisons instead of a binary search. Leaves are linked, so numbers can be visited in
+     *        order and ranges cost one descent plus a walk along the leaves.
+     */
+    class PackedBTreeAlgorithm : public IUniqueNumberAlgorithm
+    {
+    public:
+        /**
+         * \brief Creates an empty tree.
+         */
+        PackedBTreeAlgorithm() :
+            m_Root(m_NewLeaf()),
+            m_Height(0),
+            m_Count(0)
+        {
+        }
+
+        /**
+         * \brief Deletes all nodes in the tree.
+         */
+        virtual ~PackedBTreeAlgorithm()
+        {
+            m_Delete(m_Root, m_Height);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Reset
+         */
+        virtual void Reset()
+        {
+            m_Delete(m_Root, m_Height);
+            m_Root = m_NewLeaf();
+            m_Height = 0;
+            m_Count = 0;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::IsUnique
+         */
+        virtual bool IsUnique(const string &number)
+        {
+            return m_Insert(KeyTraits<uint64_t>::Pack(number));
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Contains
+         */
+        virtual bool Contains(const string &number) const
+        {
+            const uint64_t value(KeyTraits<uint64_t>::Pack(number));
+            const Leaf *leaf(m_Find(value, NULL));
+            const size_t position(CountLess<LeafCapacity>(leaf->keys, value));
+            return (position < leaf->size) && (leaf->keys[position] == value);
+        }
+
+        /**
+         * \brief Bulk loads the numbers when the tree is empty, building full nodes bottom up instead of
+         *        splitting them. Otherwise the numbers are sorted first so that consecutive inserts descend the
+         *        same path.
+         */
+        virtual size_t InsertBatch(const vector<string> &numbers)
+        {
+            vector<uint64_t> keys;
+            keys.reserve(numbers.size());
+            for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
+                keys.push_back(KeyTraits<uint64_t>::Pack(*number));
+            sort(keys.begin(), keys.end());
+            keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+            if (m_Count > 0)
+            {
+                size_t numUnique(0);
+                for (vector<uint64_t>::const_iterator key(keys.begin()); key != keys.end(); ++key)
+                    if (m_Insert(*key))
+                        numUnique++;
+                return numUnique;
+            }
+            if (keys.empty())
+                return 0;
+
+            // Leave a little room in each leaf so that later inserts don't split every leaf they touch
+            const size_t LeafFill(LeafCapacity - 2);
+            m_Delete(m_Root, m_Height);
+            vector<void *> nodes;
+            vector<uint64_t> minimums;
+            Leaf *previous(NULL);
+            for (size_t first(0); first < keys.size(); first += LeafFill)
+            {
+                Leaf *leaf(m_NewLeaf());
+                leaf->size = static_cast<uint32_t>(min(LeafFill, keys.size() - first));
+                copy(keys.begin() + first, keys.begin() + first + leaf->size, leaf->keys);
+                if (previous != NULL)
+                    previous->next = leaf;
+                previous = leaf;
+                nodes.push_back(leaf);
+                minimums.push_back(leaf->keys[0]);
+            }
+
+            m_Height = 0;
+            while (nodes.size() > 1)
+            {
+                vector<void *> parents;
+                vector<uint64_t> parentMinimums;
+                for (size_t first(0); first < nodes.size(); first += BranchCapacity + 1)
+                {
+                    Branch *branch(m_NewBranch());
+                    const size_t numChildren(min(BranchCapacity + 1, nodes.size() - first));
+                    branch->numKeys = static_cast<uint32_t>(numChildren - 1);
+                    copy(nodes.begin() + first, nodes.begin() + first + numChildren, branch->children);
+                    copy(minimums.begin() + first + 1, minimums.begin() + first + numChildren, branch->keys);
+                    parents.push_back(branch);
+                    parentMinimums.push_back(minimums[first]);
+                }
+                nodes.swap(parents);
+                minimums.swap(parentMinimums);
+                ++m_Height;
+            }
+            m_Root = nodes[0];
+            m_Count = keys.size();
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetCount
+         */
+        virtual size_t GetCount() const
+        {
+            return m_Count;
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+         */
+        virtual size_t GetMemoryUsage() const
+        {
+            return sizeof(*this) + m_Path.capacity() * sizeof(Path::value_type) + m_GetMemoryUsage(m_Root, m_Height);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Visit
+         */
+        virtual void Visit(Visitor &visitor) const
+        {
+            m_Visit(0, KeyTraits<uint64_t>::Empty(), visitor);
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::VisitRange
+         */
+        virtual void VisitRange(const string &low, const string &high, Visitor &visitor) const
+        {
+            m_Visit(KeyTraits<uint64_t>::Pack(low), KeyTraits<uint64_t>::Pack(high), visitor);
+        }
+
+    private:
+        /**
+         * \brief Maximum number of keys in a leaf, which with the leaf's size and link fills four cache lines.
+         */
+        static const size_t LeafCapacity = 30;
+
+        /**
+         * \brief Maximum number of separator keys in a branch, which with its children fills four cache lines.
+         */
+        static const size_t BranchCapacity = 14;
+
+        /**
+         * \brief A leaf node holding sorted keys.
+         */
+        struct Leaf
+        {
+            Leaf() : next(NULL), size(0) { fill(keys, keys + LeafCapacity, KeyTraits<uint64_t>::Empty()); }
+
+            uint64_t keys[LeafCapacity]; /**< Keys in ascending order, followed by empty keys. */
+            Leaf *next;                  /**< Next leaf in key order, or NULL. */
+            uint32_t size;               /**< Number of keys in this leaf. */
+        };
+
+        /**
+         * \brief An internal node. Child i holds the keys in [keys[i - 1], keys[i]).
+         */
+        struct Branch
+        {
+            Branch() : numKeys(0) { fill(keys, keys + BranchCapacity, KeyTraits<uint64_t>::Empty()); }
+
+            uint64_t keys[BranchCapacity];      /**< Separator keys in ascending order, followed by empty keys. */
+            void *children[BranchCapacity + 1]; /**< Branches, or leaves at the bottom level. */
+            uint32_t numKeys;                   /**< Number of separator keys, one less than the number of children. */
+        };
+
+        /**
+         * \brief The branches visited while descending to a leaf and the child taken at each one.
+         */
+        typedef vector<pair<Branch *, size_t> > Path;
+
+        /**
+         * \brief Allocates a leaf aligned to a cache line.
+         */
+        static Leaf *m_NewLeaf()
+        {
+            void *memory(NULL);
+            if (posix_memalign(&memory, 64, sizeof(Leaf)) != 0)
+                throw bad_alloc();
+            return new (memory) Leaf;
+        }
+
+        /**
+         * \brief Allocates a branch aligned to a cache line.
+         */
+        static Branch *m_NewBranch()
+        {
+            void *memory(NULL);
+            if (posix_memalign(&memory, 64, sizeof(Branch)) != 0)
+                throw bad_alloc();
+            return new (memory) Branch;
+        }
+
+        /**
+         * \brief Descends to the leaf whose range contains value.
+         *
+         * @param[in]  value Value to search for.
+         * @param[out] path  Receives the branches visited on the way down, or NULL if they aren't needed.
+         *
+         * @return Returns the leaf.
+         */
+        Leaf *m_Find(const uint64_t value, Path *path) const
+        {
+            if (path != NULL)
+                path->clear();
+            void *node(m_Root);
+            for (size_t level(m_Height); level > 0; --level)
+            {
+                // Counting the separators below value + 1 counts those at or below value, so equal keys go right
+                Branch *branch(static_cast<Branch *>(node));
+                const size_t child(CountLess<BranchCapacity>(branch->keys, value + 1));
+                if (path != NULL)
+                    path->push_back(make_pair(branch, child));
+                node = branch->children[child];
+            }
+            return static_cast<Leaf *>(node);
+        }
+
+        /**
+         * \brief Inserts a key, splitting nodes on the way back up as needed.
+         *
+         * @return Returns true if the key wasn't already in the tree.
+         */
+        bool m_Insert(const uint64_t value)
+        {
+            Leaf *leaf(m_Find(value, &m_Path));
+            size_t position(CountLess<LeafCapacity>(leaf->keys, value));
+            if ((position < leaf->size) && (leaf->keys[position] == value))
+                return false;
+
+            if (leaf->size == LeafCapacity)
+            {
+                // Split the leaf in half and link the new right half after it
+                Leaf *right(m_NewLeaf());
+                const size_t half(LeafCapacity / 2);
+                right->size = LeafCapacity - half;
+                copy(leaf->keys + half, leaf->keys + LeafCapacity, right->keys);
+                fill(leaf->keys + half, leaf->keys + LeafCapacity, KeyTraits<uint64_t>::Empty());
+                leaf->size = half;
+                right->next = leaf->next;
+                leaf->next = right;
+                m_InsertSeparator(m_Path, right->keys[0], right);
+
+                // A key just below the separator belongs at the end of the left half
+                if (position > half)
+                {
+                    leaf = right;
+                    position -= half;
+                }
+            }
+
+            copy_backward(leaf->keys + position, leaf->keys + leaf->size, leaf->keys + leaf->size + 1);
+            leaf->keys[position] = value;
+            ++leaf->size;
+            m_Count++;
+            return true;
+        }
+
+        /**
+         * \brief Adds a new right sibling to the node at the bottom of path, splitting branches as needed.
+         *
+         * @param[in,out] path  Branches leading to the node that was split.
+         * @param[in]     key   Smallest key in the new sibling.
+         * @param[in]     right The new sibling.
+         */
+        void m_InsertSeparator(Path &path, uint64_t key, void *right)
+        {
+            while (!path.empty())
+            {
+                Branch *branch(path.back().first);
+                const size_t child(path.back().second);
+                path.pop_back();
+
+                // Build the combined key and child lists, which are one entry too long if the branch is full
+                uint64_t keys[BranchCapacity + 1];
+                void *children[BranchCapacity + 2];
+                copy(branch->keys, branch->keys + child, keys);
+                keys[child] = key;
+                copy(branch->keys + child, branch->keys + branch->numKeys, keys + child + 1);
+                copy(branch->children, branch->children + child + 1, children);
+                children[child + 1] = right;
+                copy(branch->children + child + 1, branch->children + branch->numKeys + 1, children + child + 2);
+                const size_t numKeys(branch->numKeys + 1);
+
+                if (numKeys <= BranchCapacity)
+                {
+                    copy(keys, keys + numKeys, branch->keys);
+                    copy(children, children + numKeys + 1, branch->children);
+                    branch->numKeys = static_cast<uint32_t>(numKeys);
+                    return;
+                }
+
+                // Split the branch, moving the middle key up to the parent
+                const size_t middle(numKeys / 2);
+                Branch *sibling(m_NewBranch());
+                branch->numKeys = static_cast<uint32_t>(middle);
+                copy(keys, keys + middle, branch->keys);
+                fill(branch->keys + middle, branch->keys + BranchCapacity, KeyTraits<uint64_t>::Empty());
+                copy(children, children + middle + 1, branch->children);
+                sibling->numKeys = static_cast<uint32_t>(numKeys - middle - 1);
+                copy(keys + middle + 1, keys + numKeys, sibling->keys);
+                copy(children + middle + 1, children + numKeys + 1, sibling->children);
+                key = keys[middle];
+                right = sibling;
+            }
+
+            // The root was split, so the tree grows by a level
+            Branch *root(m_NewBranch());
+            root->numKeys = 1;
+            root->keys[0] = key;
+            root->children[0] = m_Root;
+            root->children[1] = right;
+            m_Root = root;
+            ++m_Height;
+        }
+
+        /**
+         * \brief Passes the keys from low to high inclusive to visitor, stopping early if it returns false.
+         */
+        void m_Visit(const uint64_t low, const uint64_t high, Visitor &visitor) const
+        {
+            const Leaf *leaf(m_Find(low, NULL));
+            for (size_t position(CountLess<LeafCapacity>(leaf->keys, low)); leaf != NULL; leaf = leaf->next, position = 0)
+            {
+                for (; position < leaf->size; ++position)
+                {
+                    if (leaf->keys[position] > high)
+                        return;
+                    if (!visitor.Visit(KeyTraits<uint64_t>::Unpack(leaf->keys[position])))
+                        return;
+                }
+            }
+        }
+
+        /**
+         * \brief Returns the memory used by a node and everything beneath it.
+         *
+         * @param[in] node   The node to measure.
+         * @param[in] height Number of branch levels beneath and including node.
+         */
+        static size_t m_GetMemoryUsage(const void *node, const size_t height)
+        {
+            if (height == 0)
+                return sizeof(Leaf);
+            const Branch *branch(static_cast<const Branch *>(node));
+            size_t memoryUsage(sizeof(Branch));
+            for (size_t child(0); child <= branch->numKeys; ++child)
+                memoryUsage += m_GetMemoryUsage(branch->children[child], height - 1);
+            return memoryUsage;
+        }
+
+        /**
+         * \brief Deletes a node and everything beneath it.
+         *
+         * @param[in] node   The node to delete.
+         * @param[in] height Number of branch levels beneath and including node.
+         */
+        static void m_Delete(void *node, const size_t height)
+        {
+            if (height > 0)
+            {
+                Branch *branch(static_cast<Branch *>(node));
+                for (size_t child(0); child <= branch->numKeys; ++child)
+                    m_Delete(branch->children[child], height - 1);
+            }
+            free(node);
+        }
+
+        void *m_Root;    /**< Root node, a leaf when m_Height is 0 and a branch otherwise. */
+        size_t m_Height; /**< Number of branch levels above the leaves. */
+        size_t m_Count;  /**< Number of keys in the tree. */
+        Path m_Path;     /**< Scratch space for the path of the current insert. */
+    };
+
+    /**
+     * \brief Creates a compact radix tree over the specified alphabet, with a directory sized by the hints.
+     */
+    template <typename Characters>
+    shared_ptr<IUniqueNumberAlgorithm> CreateCompactRadixTree(const IUniqueNumberAlgorithm::Options &options)
+    {
+        // The directory can only resolve digits that every number has
+        return shared_ptr<IUniqueNumberAlgorithm>(new CompactRadixTreeAlgorithm<Characters>(
+            CompactRadixTreeAlgorithm<Characters>::ChooseNumDirectoryDigits(options.minExpectedDigits > 0 ? options.minExpectedDigits
+                                                                                                        : options.numExpectedDigits,
+                                                                          options.expectedPopulation)));
+    }
+
+    /**
+     * \brief Identifies a snapshot file and its format. The magic is followed by the snapshot's type, the lineage
+     *        and sequence number of the checkpoint it records, and then each number as its length and characters.
+     *        A length of 0 ends the numbers and is followed by their count, so that truncated files are detected.
+     */
+    const char SnapshotMagic[] = {'U', 'N', 'C', '1'};
+
+    /**
+     * \brief Longest number a snapshot is trusted to hold when the reader doesn't know the counter's limit, so
+     *        that a corrupt length can't demand an enormous allocation.
+     */
+    const size_t MaxSnapshotNumberSize = 1 << 16;
+
+    /**
+     * \brief Reads a value written by AppendVarint from a file.
+     *
+     * @return Returns false if the file ended first.
+     */
+    bool ReadVarint(FILE *file, uint64_t &value)
+    {
+        value = 0;
+        for (size_t shift(0); shift < 64; shift += 7)
+        {
+            const int byte(getc(file));
+            if (byte == EOF)
+                return false;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * \brief Writes the numbers it visits to a new snapshot file. The file is written alongside its final path
+     *        and only renamed into place by Commit, so a snapshot that fails part way never replaces a good one.
+     */
+    class SnapshotWriter : public IUniqueNumberAlgorithm::Visitor
+    {
+    public:
+        /**
+         * \brief Creates the file and writes the snapshot header.
+         *
+         * @param[in] path     The snapshot file.
+         * @param[in] type     Whether the snapshot holds every number or those since the previous checkpoint.
+         * @param[in] lineage  Identifies the chain of checkpoints the snapshot belongs to.
+         * @param[in] sequence The checkpoint's position in the chain.
+         */
+        SnapshotWriter(const string &path, const UniqueNumberCounter::SnapshotType type, const uint64_t lineage,
+                       const uint64_t sequence) :
+            m_Path(path),
+            m_TemporaryPath(path + ".tmp"),
+            m_File(fopen(m_TemporaryPath.c_str(), "wb")),
+            m_Count(0)
+        {
+            if (m_File == NULL)
+                RaiseError("Couldn't create the snapshot");
+            m_Buffer.insert(m_Buffer.end(), SnapshotMagic, SnapshotMagic + sizeof(SnapshotMagic));
+            m_Buffer.push_back(static_cast<unsigned char>(type));
+            AppendVarint(lineage, m_Buffer);
+            AppendVarint(sequence, m_Buffer);
+        }
+
+        /**
+         * \brief Deletes the file if it was never committed.
+         */
+        ~SnapshotWriter()
+        {
+            if (m_File != NULL)
+            {
+                fclose(m_File);
+                remove(m_TemporaryPath.c_str());
+            }
+        }
+
+        /**
+         * \copydoc IUniqueNumberAlgorithm::Visitor::Visit
+         */
+        virtual bool Visit(const string &number)
+        {
+            const size_t BufferSize(65536);
+            AppendVarint(number.size(), m_Buffer);
+            m_Buffer.insert(m_Buffer.end(), number.begin(), number.end());
+            ++m_Count;
+            if (m_Buffer.size() >= BufferSize)
+                m_Flush();
+            return true;
+        }
+
+        /**
+         * \brief Writes the end of the numbers and their count, makes the file durable and renames it into place.
+         */
+        void Commit()
+        {
+            AppendVarint(0, m_Buffer);
+            AppendVarint(m_Count, m_Buffer);
+            m_Flush();
+            if ((fflush(m_File) != 0) || (fsync(fileno(m_File)) != 0))
+                RaiseError("Couldn't write the snapshot");
+            FILE *file(m_File);
+            m_File = NULL;
+            if (fclose(file) != 0)
+            {
+                remove(m_TemporaryPath.c_str());
+                RaiseError("Couldn't write the snapshot");
+            }
+            if (rename(m_TemporaryPath.c_str(), m_Path.c_str()) != 0)
+            {
+                remove(m_TemporaryPath.c_str());
+                RaiseError("Couldn't rename the snapshot into place");
+            }
+        }
+
+    private:
+        SnapshotWriter(const SnapshotWriter &);
+        SnapshotWriter &operator=(const SnapshotWriter &);
+
+        /**
+         * \brief Writes the buffered bytes to the file.
+         */
+        void m_Flush()
+        {
+            if (fwrite(&m_Buffer[0], 1, m_Buffer.size(), m_File) != m_Buffer.size())
+                RaiseError("Couldn't write the snapshot");
+            m_Buffer.clear();
+        }
+
+        const string m_Path;            /**< Where the snapshot ends up. */
+        const string m_TemporaryPath;   /**< Where the snapshot is written. */
+        FILE *m_File;                   /**< The temporary file, or NULL once committed. */
+        uint64_t m_Count;               /**< Number of numbers written. */
+        vector<unsigned char> m_Buffer; /**< Bytes not yet written to m_File. */
+    };
+
+    /**
+     * \brief Reads the numbers in a snapshot file.
+     */
+    class SnapshotReader
+    {
+    public:
+        /**
+         * \brief Opens the file and reads the snapshot header.
+         *
+         * @param[in] path    The snapshot file.
+         * @param[in] maxSize Longest number to accept, beyond which the snapshot is treated as corrupt.
+         */
+        SnapshotReader(const string &path, const size_t maxSize) :
+            m_File(fopen(path.c_str(), "rb")),
+            m_MaxSize(maxSize),
+            m_Count(0)
+        {
+            if (m_File == NULL)
+                RaiseError("Couldn't open the snapshot");
+            char magic[sizeof(SnapshotMagic)];
+            if ((fread(magic, 1, sizeof(magic), m_File) != sizeof(magic)) || !equal(magic, magic + sizeof(magic), SnapshotMagic))
+            {
+                fclose(m_File);
+                RaiseError("Not a snapshot");
+            }
+            const int type(getc(m_File));
+            if (((type != UniqueNumberCounter::FullSnapshot) && (type != UniqueNumberCounter::DeltaSnapshot)) ||
+                !ReadVarint(m_File, m_Lineage) || !ReadVarint(m_File, m_Sequence))
+            {
+                fclose(m_File);
+                RaiseError("Not a snapshot");
+            }
+            m_Type = static_cast<UniqueNumberCounter::SnapshotType>(type);
+        }
+
+        /**
+         * \brief Closes the file.
+         */
+        ~SnapshotReader()
+        {
+            fclose(m_File);
+        }
+
+        UniqueNumberCounter::SnapshotType GetType() const { return m_Type; }
+        uint64_t GetLineage() const { return m_Lineage; }
+        uint64_t GetSequence() const { return m_Sequence; }
+
+        /**
+         * \brief Reads the next number.
+         *
+         * @param[out] number Receives the number.
+         *
+         * @return Returns false once every number has been read.
+         */
+        bool Read(string &number)
+        {
+            uint64_t size;
+            if (!ReadVarint(m_File, size))
+                RaiseError("The snapshot is truncated");
+            if (size == 0)
+            {
+                uint64_t count;
+                if (!ReadVarint(m_File, count) || (count != m_Count))
+                    RaiseError("The snapshot is truncated");
+                return false;
+            }
+            if (size > m_MaxSize)
+                RaiseError("The snapshot is corrupt");
+            number.resize(static_cast<size_t>(size));
+            if (fread(&number[0], 1, number.size(), m_File) != number.size())
+                RaiseError("The snapshot is truncated");
+            ++m_Count;
+            return true;
+        }
+
+    private:
+        SnapshotReader(const SnapshotReader &);
+        SnapshotReader &operator=(const SnapshotReader &);
+
+        FILE *m_File;                             /**< The snapshot file. */
+        const size_t m_MaxSize;                   /**< Longest number accepted. */
+        UniqueNumberCounter::SnapshotType m_Type; /**< Whether the snapshot is a full one or a delta. */
+        uint64_t m_Lineage;                       /**< Chain of checkpoints the snapshot belongs to. */
+        uint64_t m_Sequence;                      /**< The checkpoint's position in the chain. */
+        uint64_t m_Count;                         /**< Number of numbers read. */
+    };
+
+    /**
+     * \brief Bytes in the little-endian length that starts each replication frame.
+     */
+    const size_t FrameHeaderSize(4);
+
+    /**
+     * \brief Largest replication frame a receiver accepts, so that a corrupt length can't exhaust memory.
+     */
+    const size_t MaxFrameSize(1 << 30);
+
+    /**
+     * \brief Returns the wall clock time in microseconds since the epoch.
+     */
+    uint64_t GetMicroseconds()
+    {
+        timeval now;
+        gettimeofday(&now, NULL);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_usec;
+    }
+
+    /**
+     * \brief Returns true if the descriptor is a socket.
+     */
+    bool IsSocket(const int fd)
+    {
+        struct stat status;
+        return (fstat(fd, &status) == 0) && S_ISSOCK(status.st_mode);
+    }
+
+    /**
+     * \brief Escapes a Prometheus label value.
+     */
+    string EscapeLabel(const string &value)
+    {
+        string escaped;
+        for (string::const_iterator ch(value.begin()); ch != value.end(); ++ch)
+        {
+            if (*ch == '\n')
+                escaped += "\\n";
+            else
+            {
+                if ((*ch == '\\') || (*ch == '"'))
+                    escaped += '\\';
+                escaped += *ch;
+            }
+        }
+        return escaped;
+    }
+
+    /**
+     * \brief Writes the HELP and TYPE lines that start a Prometheus metric family.
+     */
+    void WriteMetricHeader(ostream &out, const char *name, const char *type, const char *help)
+    {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " " << type << "\n";
+    }
+}
+
+shared_ptr<IUniqueNumberAlgorithm> IUniqueNumberAlgorithm::CreateInstance(const AlgorithmType algorithmType)
+{
+    return CreateInstance(algorithmType, Options());
+}
+
+shared_ptr<IUniqueNumberAlgorithm> IUniqueNumberAlgorithm::CreateInstance(const AlgorithmType algorithmType,
+                                                                          const Options &options)
+{
+    // Packed keys and bitmaps are built on decimal values
+    if ((options.alphabet != Decimal) && (algorithmType != CompactRadixTree) && (algorithmType != Set) &&
+        (algorithmType != Theta) && (algorithmType != Cuckoo))
+        RaiseError("algorithmType only supports decimal numbers");
+
+    shared_ptr<IUniqueNumberAlgorithm> algorithm;
+    switch (algorithmType)
+    {
+        case CompactRadixTree:
+            switch (options.alphabet)
+            {
+                case Decimal:
+                    algorithm = CreateCompactRadixTree<DecimalAlphabet>(options);
+                    break;
+                case Hexadecimal:
+                    algorithm = CreateCompactRadixTree<HexadecimalAlphabet>(options);
+                    break;
+                case Base36:
+                    algorithm = CreateCompactRadixTree<Base36Alphabet>(options);
+                    break;
+                case Byte:
+                    algorithm = CreateCompactRadixTree<ByteAlphabet>(options);
+                    break;
+                default:
+                    RaiseError("Invalid alphabet");
+            }
+            return algorithm;
+        case Set:
+            // Numbers of a known length are packed into integers, which are much cheaper than strings
+            if ((options.alphabet != Decimal) || (options.numExpectedDigits == 0) ||
+                (options.numExpectedDigits > KeyTraits<WideKey>::MaxDigits))
+                algorithm.reset(new SetAlgorithm);
+            else if (options.numExpectedDigits <= KeyTraits<uint64_t>::MaxDigits)
+                algorithm.reset(new PackedSetAlgorithm<uint64_t>);
+            else
+                algorithm.reset(new PackedSetAlgorithm<WideKey>);
+            break;
+        case Hash:
+            if ((options.numExpectedDigits > 0) && (options.numExpectedDigits <= KeyTraits<uint64_t>::MaxDigits))
+                algorithm.reset(new HashAlgorithm<uint64_t>(options.expectedPopulation));
+            else
+                algorithm.reset(new HashAlgorithm<WideKey>(options.expectedPopulation));
+            break;
+        case SwissHash:
+            if ((options.numExpectedDigits > 0) && (options.numExpectedDigits <= KeyTraits<uint64_t>::MaxDigits))
+                algorithm.reset(new SwissHashAlgorithm<uint64_t>(options.expectedPopulation));
+            else
+                algorithm.reset(new SwissHashAlgorithm<WideKey>(options.expectedPopulation));
+            break;
+        case IntervalSet:
+            algorithm.reset(new IntervalSetAlgorithm);
+            break;
+        case SparseBitmap:
+            algorithm.reset(new SparseBitmapAlgorithm);
+            break;
+        case SortedBlocks:
+            algorithm.reset(new SortedBlockAlgorithm);
+            break;
+        case BTree:
+            algorithm.reset(new PackedBTreeAlgorithm);
+            break;
+        case BitmapTree:
+            algorithm.reset(new BitmapTreeAlgorithm);
+            break;
+        case Theta:
+            algorithm.reset(new ThetaSketch(options.sketchSize > 0 ? options.sketchSize : size_t(ThetaSketch::DefaultSize)));
+            break;
+        case Cuckoo:
+            algorithm.reset(new CuckooFilter(options.expectedPopulation > 0 ? options.expectedPopulation : size_t(CuckooFilter::DefaultCapacity),
+                                             options.fingerprintBits > 0 ? options.fingerprintBits : size_t(CuckooFilter::DefaultFingerprintBits),
+                                             options.bucketSize > 0 ? options.bucketSize : size_t(CuckooFilter::DefaultBucketSize)));
+            break;
+        default:
+            RaiseError("Invalid algorithmType");
+    }
+    return algorithm;
+}
+
+size_t IUniqueNumberAlgorithm::InsertBatch(const vector<string> &numbers)
+{
+    size_t numUnique(0);
+    for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
+        if (IsUnique(*number))
+            numUnique++;
+    return numUnique;
+}
+
+bool IUniqueNumberAlgorithm::Remove(const string &)
+{
+    RaiseError("The algorithm doesn't support removing numbers");
+    return false;
+}
+
+void IUniqueNumberAlgorithm::Visit(Visitor &) const
+{
+    RaiseError("The algorithm doesn't support visiting numbers in order");
+}
+
+void IUniqueNumberAlgorithm::VisitRange(const string &, const string &, Visitor &) const
+{
+    RaiseError("The algorithm doesn't support visiting numbers in order");
+}
+
+void IUniqueNumberAlgorithm::Export(Visitor &visitor) const
+{
+    Visit(visitor);
+}
+
+bool IUniqueNumberAlgorithm::GetSuccessor(const string &, string &) const
+{
+    RaiseError("The algorithm doesn't support successor queries");
+    return false;
+}
+
+bool IUniqueNumberAlgorithm::GetPredecessor(const string &, string &) const
+{
+    RaiseError("The algorithm doesn't support predecessor queries");
+    return false;
+}
+
+bool IUniqueNumberAlgorithm::Contains(const string &) const
+{
+    RaiseError("The algorithm doesn't support membership queries");
+    return false;
+}
+
+void IUniqueNumberAlgorithm::GetPrefixCounts(vector<size_t> &) const
+{
+    RaiseError("The algorithm doesn't support prefix counts");
+}
+
+void IUniqueNumberAlgorithm::Freeze()
+{
+    RaiseError("The algorithm doesn't support freezing");
+}
+
+bool IUniqueNumberAlgorithm::Compact(const size_t)
+{
+    RaiseError("The algorithm doesn't support compaction");
+    return false;
+}
+
+const size_t ThetaSketch::DefaultSize;
+
+ThetaSketch::ThetaSketch(const size_t size) :
+    m_Size(size),
+    m_Theta(~0ULL)
+{
+    if (m_Size < 2)
+        RaiseError("A sketch must retain at least 2 hashes");
+}
+
+shared_ptr<ThetaSketch> ThetaSketch::Deserialize(const vector<unsigned char> &buffer)
+{
+    const unsigned char Version(1);
+    if (buffer.empty() || (buffer[0] != Version))
+        RaiseError("Unsupported sketch version");
+
+    size_t offset(1);
+    const uint64_t size(ReadVarint(buffer, offset));
+    const uint64_t theta(ReadVarint(buffer, offset));
+    const uint64_t numHashes(ReadVarint(buffer, offset));
+    if (numHashes > size)
+        RaiseError("Malformed sketch");
+
+    shared_ptr<ThetaSketch> sketch(new ThetaSketch(size));
+    sketch->m_Theta = theta;
+    uint64_t hash(0);
+    for (uint64_t count(0); count < numHashes; ++count)
+    {
+        if (offset >= buffer.size())
+            RaiseError("Malformed sketch");
+        hash += ReadVarint(buffer, offset);
+        if (hash >= theta)
+            RaiseError("Malformed sketch");
+        sketch->m_Hashes.insert(sketch->m_Hashes.end(), hash);
+    }
+    return sketch;
+}
+
+void ThetaSketch::Reset()
+{
+    m_Theta = ~0ULL;
+    m_Hashes.clear();
+}
+
+bool ThetaSketch::IsUnique(const string &number)
+{
+    // Most numbers of a saturated sketch fall outside the sample and are rejected without touching the set
+    const uint64_t hash(HashNumber(number));
+    if (hash >= m_Theta)
+        return false;
+    if (!m_Hashes.insert(hash).second)
+        return false;
+    m_Trim();
+    return hash < m_Theta;
+}
+
+size_t ThetaSketch::GetCount() const
+{
+    return static_cast<size_t>(GetEstimate() + 0.5);
+}
+
+size_t ThetaSketch::GetMemoryUsage() const
+{
+    // Each hash lives in a red-black tree node holding a color and three links
+    return sizeof(*this) + m_Hashes.size() * (4 * sizeof(void *) + sizeof(uint64_t));
+}
+
+double ThetaSketch::GetEstimate() const
+{
+    return m_Hashes.size() / GetTheta();
+}
+
+double ThetaSketch::GetTheta() const
+{
+    // Until the first hash is discarded the sample is the whole set
+    return m_Theta == ~0ULL ? 1.0 : m_Theta / 18446744073709551616.0;
+}
+
+void ThetaSketch::Merge(const ThetaSketch &other)
+{
+    m_LowerTheta(min(m_Theta, other.m_Theta));
+    for (set<uint64_t>::const_iterator hash(other.m_Hashes.begin());
+         (hash != other.m_Hashes.end()) && (*hash < m_Theta); ++hash)
+        m_Hashes.insert(*hash);
+    m_Trim();
+}
+
+void ThetaSketch::Intersect(const ThetaSketch &other)
+{
+    m_LowerTheta(min(m_Theta, other.m_Theta));
+    for (set<uint64_t>::iterator hash(m_Hashes.begin()); hash != m_Hashes.end();)
+    {
+        if (other.m_Hashes.count(*hash) == 0)
+            m_Hashes.erase(hash++);
+        else
+            ++hash;
+    }
+}
+
+void ThetaSketch::Subtract(const ThetaSketch &other)
+{
+    m_LowerTheta(min(m_Theta, other.m_Theta));
+    for (set<uint64_t>::iterator hash(m_Hashes.begin()); hash != m_Hashes.end();)
+    {
+        if (other.m_Hashes.count(*hash) != 0)
+            m_Hashes.erase(hash++);
+        else
+            ++hash;
+    }
+}
+
+void ThetaSketch::Serialize(vector<unsigned char> &buffer) const
+{
+    // Hashes below theta are spread evenly, so their deltas take a few bits fewer than the hashes themselves
+    buffer.clear();
+    buffer.push_back(1);
+    AppendVarint(m_Size, buffer);
+    AppendVarint(m_Theta, buffer);
+    AppendVarint(m_Hashes.size(), buffer);
+    uint64_t previous(0);
+    for (set<uint64_t>::const_iterator hash(m_Hashes.begin()); hash != m_Hashes.end(); ++hash)
+    {
+        AppendVarint(*hash - previous, buffer);
+        previous = *hash;
+    }
+}
+
+void ThetaSketch::m_LowerTheta(const uint64_t theta)
+{
+    m_Theta = theta;
+    m_Hashes.erase(m_Hashes.lower_bound(m_Theta), m_Hashes.end());
+}
+
+void ThetaSketch::m_Trim()
+{
+    while (m_Hashes.size() > m_Size)
+    {
+        set<uint64_t>::iterator largest(m_Hashes.end());
+        m_Theta = *--largest;
+        m_Hashes.erase(largest);
+    }
+}
+
+const size_t CuckooFilter::DefaultCapacity;
+const size_t CuckooFilter::DefaultFingerprintBits;
+const size_t CuckooFilter::DefaultBucketSize;
+
+CuckooFilter::CuckooFilter(const size_t capacity, const size_t fingerprintBits, const size_t bucketSize) :
+    m_FingerprintBits(fingerprintBits),
+    m_BucketSize(bucketSize),
+    m_NumBuckets(1),
+    m_Count(0),
+    m_Victim(0),
+    m_VictimBucket(0),
+    m_Random(0x9E3779B97F4A7C15ULL)
+{
+    if ((m_FingerprintBits < 4) || (m_FingerprintBits > 32))
+        RaiseError("fingerprintBits must be from 4 to 32");
+    if ((m_BucketSize < 1) || (m_BucketSize > 8))
+        RaiseError("bucketSize must be from 1 to 8");
+
+    // Larger buckets give each fingerprint more places to go, so they can be filled further before
+    // inserts start failing. Aim for 90% of the achievable load.
+    const double MaxLoadFactors[] = { 0.5, 0.84, 0.9, 0.95, 0.95, 0.96, 0.97, 0.98 };
+    const double numSlots(capacity / (0.9 * MaxLoadFactors[m_BucketSize - 1]));
+    while (m_NumBuckets * m_BucketSize < numSlots)
+        m_NumBuckets *= 2;
+    m_Slots.assign((m_NumBuckets * m_BucketSize * m_FingerprintBits + 63) / 64, 0);
+}
+
+void CuckooFilter::Reset()
+{
+    fill(m_Slots.begin(), m_Slots.end(), 0);
+    m_Count = 0;
+    m_Victim = 0;
+}
+
+bool CuckooFilter::IsUnique(const string &number)
+{
+    uint32_t fingerprint;
+    size_t bucket;
+    m_Hash(number, fingerprint, bucket);
+    const size_t alternate(m_GetAlternateBucket(bucket, fingerprint));
+    if ((m_Find(bucket, fingerprint) < m_BucketSize) || (m_Find(alternate, fingerprint) < m_BucketSize) ||
+        ((m_Victim == fingerprint) && ((m_VictimBucket == bucket) || (m_VictimBucket == alternate))))
+        return false;
+    if (m_Victim != 0)
+        RaiseError("Cuckoo filter is full");
+
+    // Kick fingerprints to their alternate buckets until one lands in an empty slot
+    const size_t MaxKicks(500);
+    for (size_t kick(0); kick < MaxKicks; ++kick)
+    {
+        size_t slot(m_Find(bucket, 0));
+        if ((slot == m_BucketSize) && (kick == 0))
+        {
+            bucket = alternate;
+            slot = m_Find(bucket, 0);
+        }
+        if (slot < m_BucketSize)
+        {
+            m_SetSlot(bucket * m_BucketSize + slot, fingerprint);
+            m_Count++;
+            return true;
+        }
+
+        m_Random ^= m_Random << 13;
+        m_Random ^= m_Random >> 7;
+        m_Random ^= m_Random << 17;
+        slot = bucket * m_BucketSize + m_Random % m_BucketSize;
+        const uint32_t evicted(m_GetSlot(slot));
+        m_SetSlot(slot, fingerprint);
+        fingerprint = evicted;
+        bucket = m_GetAlternateBucket(bucket, fingerprint);
+    }
+
+    // Keep the last fingerprint aside rather than lose it. The filter accepts no more numbers until a
+    // removal makes room.
+    m_Victim = fingerprint;
+    m_VictimBucket = bucket;
+    m_Count++;
+    return true;
+}
+
+bool CuckooFilter::Remove(const string &number)
+{
+    uint32_t fingerprint;
+    size_t bucket;
+    m_Hash(number, fingerprint, bucket);
+    const size_t alternate(m_GetAlternateBucket(bucket, fingerprint));
+    if ((m_Victim == fingerprint) && ((m_VictimBucket == bucket) || (m_VictimBucket == alternate)))
+        m_Victim = 0;
+    else
+    {
+        size_t slot(m_Find(bucket, fingerprint));
+        if (slot == m_BucketSize)
+        {
+            bucket = alternate;
+            slot = m_Find(bucket, fingerprint);
+        }
+        if (slot == m_BucketSize)
+            return false;
+        m_SetSlot(bucket * m_BucketSize + slot, 0);
+    }
+    m_Count--;
+
+    // Try to put the victim back now that there may be room for it
+    if (m_Victim != 0)
+    {
+        const size_t buckets[] = { m_VictimBucket, m_GetAlternateBucket(m_VictimBucket, m_Victim) };
+        for (size_t index(0); (index < 2) && (m_Victim != 0); ++index)
+        {
+            const size_t slot(m_Find(buckets[index], 0));
+            if (slot < m_BucketSize)
+            {
+                m_SetSlot(buckets[index] * m_BucketSize + slot, m_Victim);
+                m_Victim = 0;
+            }
+        }
+    }
+    return true;
+}
+
+size_t CuckooFilter::GetMemoryUsage() const
+{
+    return sizeof(*this) + m_Slots.capacity() * sizeof(uint64_t);
+}
+
+double CuckooFilter::GetFalsePositiveRate() const
+{
+    return 2.0 * m_BucketSize / (static_cast<double>(1ULL << m_FingerprintBits));
+}
+
+double CuckooFilter::GetLoadFactor() const
+{
+    return static_cast<double>(m_Count) / (m_NumBuckets * m_BucketSize);
+}
+
+uint32_t CuckooFilter::m_GetSlot(const size_t slot) const
+{
+    const size_t bit(slot * m_FingerprintBits);
+    uint64_t value(m_Slots[bit / 64] >> (bit % 64));
+    if (bit % 64 + m_FingerprintBits > 64)
+        value |= m_Slots[bit / 64 + 1] << (64 - bit % 64);
+    return static_cast<uint32_t>(value & ((1ULL << m_FingerprintBits) - 1));
+}
+
+void CuckooFilter::m_SetSlot(const size_t slot, const uint32_t fingerprint)
+{
+    const size_t bit(slot * m_FingerprintBits);
+    const uint64_t mask((1ULL << m_FingerprintBits) - 1);
+    m_Slots[bit / 64] = (m_Slots[bit / 64] & ~(mask << (bit % 64))) | (static_cast<uint64_t>(fingerprint) << (bit % 64));
+    if (bit % 64 + m_FingerprintBits > 64)
+    {
+        const size_t shift(64 - bit % 64);
+        m_Slots[bit / 64 + 1] = (m_Slots[bit / 64 + 1] & ~(mask >> shift)) | (static_cast<uint64_t>(fingerprint) >> shift);
+    }
+}
+
+size_t CuckooFilter::m_Find(const size_t bucket, const uint32_t fingerprint) const
+{
+    for (size_t slot(0); slot < m_BucketSize; ++slot)
+        if (m_GetSlot(bucket * m_BucketSize + slot) == fingerprint)
+            return slot;
+    return m_BucketSize;
+}
+
+size_t CuckooFilter::m_GetAlternateBucket(const size_t bucket, const uint32_t fingerprint) const
+{
+    // XOR with a hash of the fingerprint alone, so either bucket can be found from the other
+    return (bucket ^ MixBits(fingerprint)) & (m_NumBuckets - 1);
+}
+
+void CuckooFilter::m_Hash(const string &number, uint32_t &fingerprint, size_t &bucket) const
+{
+    // 0 marks an empty slot, so it's never used as a fingerprint
+    const uint64_t hash(HashNumber(number));
+    fingerprint = static_cast<uint32_t>((hash >> 32) & ((1ULL << m_FingerprintBits) - 1));
+    if (fingerprint == 0)
+        fingerprint = 1;
+    bucket = hash & (m_NumBuckets - 1);
+}
+
+CountMinSketch::CountMinSketch(const size_t width, const size_t depth, const size_t numTopItems) :
+    m_Width(1),
+    m_Depth(depth),
+    m_NumTopItems(numTopItems),
+    m_Total(0)
+{
+    if ((width == 0) || (depth == 0))
+        RaiseError("width and depth cannot be zero");
+    while (m_Width < width)
+        m_Width *= 2;
+    m_Counters.assign(m_Width * m_Depth, 0);
+    m_TopItems.reserve(m_NumTopItems);
+}
+
+void CountMinSketch::Reset()
+{
+    fill(m_Counters.begin(), m_Counters.end(), 0);
+    m_TopItems.clear();
+    m_Total = 0;
+}
+
+uint32_t CountMinSketch::Add(const string &number)
+{
+    const uint64_t hash(HashNumber(number));
+    uint32_t estimate(~0U);
+    for (size_t row(0); row < m_Depth; ++row)
+        estimate = min(estimate, m_Counters[m_GetIndex(hash, row)]);
+
+    // Conservative update: counters above the new estimate already account for this occurrence
+    if (estimate < ~0U)
+        ++estimate;
+    for (size_t row(0); row < m_Depth; ++row)
+    {
+        uint32_t &counter(m_Counters[m_GetIndex(hash, row)]);
+        counter = max(counter, estimate);
+    }
+    m_Total++;
+
+    m_UpdateTopItems(number, estimate);
+    return estimate;
+}
+
+uint32_t CountMinSketch::GetEstimate(const string &number) const
+{
+    const uint64_t hash(HashNumber(number));
+    uint32_t estimate(~0U);
+    for (size_t row(0); row < m_Depth; ++row)
+        estimate = min(estimate, m_Counters[m_GetIndex(hash, row)]);
+    return estimate;
+}
+
+void CountMinSketch::GetTopItems(vector<pair<string, uint32_t> > &items) const
+{
+    vector<TopItem> sorted(m_TopItems);
+    sort(sorted.begin(), sorted.end());
+    items.clear();
+    for (vector<TopItem>::const_iterator item(sorted.begin()); item != sorted.end(); ++item)
+        items.push_back(make_pair(item->number, item->count));
+}
+
+size_t CountMinSketch::GetMemoryUsage() const
+{
+    size_t memoryUsage(sizeof(*this) + m_Counters.capacity() * sizeof(uint32_t) + m_TopItems.capacity() * sizeof(TopItem));
+    for (vector<TopItem>::const_iterator item(m_TopItems.begin()); item != m_TopItems.end(); ++item)
+        memoryUsage += GetHeapUsage(item->number);
+    return memoryUsage;
+}
+
+size_t CountMinSketch::m_GetIndex(const uint64_t hash, const size_t row) const
+{
+    // Double hashing derives each row's hash from the two halves of one 64 bit hash
+    const uint64_t low(hash & 0xFFFFFFFFULL);
+    const uint64_t high((hash >> 32) | 1);
+    return row * m_Width + ((low + row * high) & (m_Width - 1));
+}
+
+void CountMinSketch::m_UpdateTopItems(const string &number, const uint32_t count)
+{
+    // Estimates only grow, so a number already in a full heap always beats its least frequent entry
+    if ((m_NumTopItems == 0) || ((m_TopItems.size() == m_NumTopItems) && (count <= m_TopItems.front().count)))
+        return;
+
+    // The heap is small, so a linear search is cheaper than maintaining an index into it
+    for (vector<TopItem>::iterator item(m_TopItems.begin()); item != m_TopItems.end(); ++item)
+    {
+        if (item->number == number)
+        {
+            item->count = count;
+            make_heap(m_TopItems.begin(), m_TopItems.end());
+            return;
+        }
+    }
+
+    if (m_TopItems.size() == m_NumTopItems)
+    {
+        pop_heap(m_TopItems.begin(), m_TopItems.end());
+        m_TopItems.pop_back();
+    }
+    TopItem item;
+    item.number = number;
+    item.count = count;
+    m_TopItems.push_back(item);
+    push_heap(m_TopItems.begin(), m_TopItems.end());
+}
+
+UniqueNumberCounter::UniqueNumberCounter(shared_ptr<IUniqueNumberAlgorithm> algorithm, const size_t numExpectedDigits) :
+    m_Algorithm(algorithm),
+    m_MinDigits(numExpectedDigits),
+    m_MaxDigits(numExpectedDigits),
+    m_Count(0),
+    m_NumPartitionDigits(min(numExpectedDigits, DefaultNumPartitionDigits)),
+    m_Ordering(Unsorted),
+    m_Alphabet(IUniqueNumberAlgorithm::Decimal),
+    m_SnapshotPid(0),
+    m_TracksDeltas(false),
+    m_IsJournalComplete(true),
+    m_IsPendingJournalComplete(true),
+    m_Lineage(0),
+    m_Sequence(0)
+{
+    m_Initialize();
+}
+
+UniqueNumberCounter::UniqueNumberCounter(shared_ptr<IUniqueNumberAlgorithm> algorithm, const size_t minDigits,
+                                         const size_t maxDigits) :
+    m_Algorithm(algorithm),
+    m_MinDigits(minDigits),
+    m_MaxDigits(maxDigits),
+    m_Count(0),
+    m_NumPartitionDigits(min(minDigits, DefaultNumPartitionDigits)),
+    m_Ordering(Unsorted),
+    m_Alphabet(IUniqueNumberAlgorithm::Decimal),
+    m_SnapshotPid(0),
+    m_TracksDeltas(false),
+    m_IsJournalComplete(true),
+    m_IsPendingJournalComplete(true),
+    m_Lineage(0),
+    m_Sequence(0)
+{
+    m_Initialize();
+}
+
+UniqueNumberCounter::~UniqueNumberCounter()
+{
+    PollSnapshot(true);
+}
+
+void UniqueNumberCounter::m_Initialize()
+{
+    // Check arguments
+    if (m_Algorithm.get() == NULL)
+       RaiseError("NULL ptr");
+    if (m_MinDigits <= 0)
+       RaiseError("numExpectedDigits cannot be zero");
+    if (m_MinDigits > m_MaxDigits)
+       RaiseError("minDigits cannot exceed maxDigits");
+
+    // Reset the algorithm back to its intial state in case it's being reused
+    m_Algorithm->Reset();
+
+    // Tell this counter's checkpoints apart from those of any other
+    m_Lineage = MixBits(static_cast<uint64_t>(time(NULL)) ^ (static_cast<uint64_t>(getpid()) << 32) ^
+                        reinterpret_cast<uintptr_t>(this));
+}
+
+void UniqueNumberCounter::ProcessNumber(const string &number)
+{
+    // Check arguments
+    m_CheckNumber(number);
+    m_CheckOrder(number, m_Previous);
+
+    m_ProcessCheckedNumber(number);
+    if (m_FrequencySketch.get() != NULL)
+        m_FrequencySketch->Add(number);
+    if ((m_Metrics.get() != NULL) && m_Metrics->AddProcessed(1))
+        m_Metrics->Publish(GetCount());
+}
+
+void UniqueNumberCounter::m_ProcessCheckedNumber(const string &number)
+{
+    if (m_Ordering != Unsorted)
+    {
+        // Numbers have the same number of digits, so comparing strings compares values
+        if (m_Previous.empty() || (number > m_Previous))
+        {
+            if (m_Ordering == DetectSorted)
+                AppendVarint(ParseNumber(number) - (m_Previous.empty() ? 0 : ParseNumber(m_Previous)), m_SortedRun);
+
+            // The prefixes longer than the one shared with the previous number are new
+            size_t numCommonDigits(0);
+            while ((numCommonDigits < m_Previous.size()) && (m_Previous[numCommonDigits] == number[numCommonDigits]))
+                ++numCommonDigits;
+            m_SortedPrefixCounts.resize(number.size());
+            for (size_t length(numCommonDigits); length < number.size(); ++length)
+                m_SortedPrefixCounts[length]++;
+            m_Previous = number;
+            m_Count++;
+            m_TrackUnique(number);
+            return;
+        }
+        if (number == m_Previous)
+            return;
+        if (m_Ordering == Sorted)
+            RaiseError("Number is out of order");
+        m_FlushSortedRun();
+    }
+
+    // If the number is unique, then increment the count
+    if (m_Algorithm->IsUnique(number))
+    {
+        m_Count++;
+        m_TrackUnique(number);
+    }
+}
+
+void UniqueNumberCounter::m_FlushSortedRun()
+{
+    // Decode the run a chunk at a time so that it never exists as strings all at once
+    const size_t ChunkSize(65536);
+    vector<string> chunk;
+    uint64_t value(0);
+    size_t offset(0);
+    while (offset < m_SortedRun.size())
+    {
+        chunk.clear();
+        while ((offset < m_SortedRun.size()) && (chunk.size() < ChunkSize))
+        {
+            value += ReadVarint(m_SortedRun, offset);
+            chunk.push_back(FormatNumber(value, m_MaxDigits));
+        }
+        m_Algorithm->InsertBatch(chunk);
+    }
+
+    vector<unsigned char>().swap(m_SortedRun);
+    vector<size_t>().swap(m_SortedPrefixCounts);
+    m_Previous.clear();
+    m_Ordering = Unsorted;
+}
+
+void UniqueNumberCounter::SetOrdering(const Ordering ordering)
+{
+    if (m_Count > 0)
+        RaiseError("Ordering must be set before processing numbers");
+    if ((ordering != Unsorted) && (m_MinDigits != m_MaxDigits))
+        RaiseError("Sorted orderings require numbers with a fixed number of digits");
+    if ((ordering == DetectSorted) && (m_MaxDigits > 19))
+        RaiseError("DetectSorted supports at most 19 digits");
+    if ((ordering == DetectSorted) && (m_Alphabet != IUniqueNumberAlgorithm::Decimal))
+        RaiseError("DetectSorted requires decimal numbers");
+    if ((ordering != Unsorted) && !m_Algorithm->IsExact())
+        RaiseError("Sorted orderings require an exact algorithm");
+    m_Ordering = ordering;
+}
+
+void UniqueNumberCounter::RemoveNumber(const string &number)
+{
+    m_CheckNumber(number);
+    if (m_Ordering != Unsorted)
+        RaiseError("Numbers can only be removed when the ordering is Unsorted");
+    if (m_TracksDeltas)
+        RaiseError("Numbers can't be removed while deltas are tracked");
+    if (m_ReplicationSender.get() != NULL)
+        RaiseError("Numbers can't be removed while they're replicated");
+    if (m_Algorithm->Remove(number))
+    {
+        m_Count--;
+        m_IsJournalComplete = false;
+    }
+}
+
+size_t UniqueNumberCounter::GetCount() const
+{
+    return m_Algorithm->IsExact() ? m_Count : m_Algorithm->GetCount();
+}
+
+void UniqueNumberCounter::m_TrackUnique(const string &number)
+{
+    if (m_TracksDeltas)
+    {
+        AppendVarint(number.size(), m_Journal);
+        m_Journal.insert(m_Journal.end(), number.begin(), number.end());
+    }
+    else
+        m_IsJournalComplete = false;
+    if (m_ReplicationSender.get() != NULL)
+        m_ReplicationSender->Add(number);
+}
+
+void UniqueNumberCounter::SetDeltaTracking(const bool enabled)
+{
+    // Forgetting tracked numbers leaves the journal incomplete until the next full snapshot
+    if (!enabled)
+    {
+        m_IsJournalComplete = m_IsJournalComplete && m_Journal.empty();
+        vector<unsigned char>().swap(m_Journal);
+    }
+    m_TracksDeltas = enabled;
+}
+
+void UniqueNumberCounter::m_CheckSnapshotType(const SnapshotType type) const
+{
+    if (type == DeltaSnapshot)
+    {
+        if (!m_TracksDeltas)
+            RaiseError("Delta snapshots require delta tracking");
+        if (m_Sequence == 0)
+            RaiseError("A delta snapshot needs an earlier checkpoint to follow");
+        if (!m_IsJournalComplete)
+            RaiseError("Numbers were counted while deltas weren't tracked, so a full snapshot is needed");
+    }
+    else if (m_Ordering == Sorted)
+        RaiseError("Sorted counters don't keep their numbers");
+}
+
+void UniqueNumberCounter::m_WriteSnapshot(const string &path, const SnapshotType type) const
+{
+    m_CheckSnapshotType(type);
+    SnapshotWriter writer(path, type, m_Lineage, m_Sequence + 1);
+    if (type == DeltaSnapshot)
+    {
+        for (size_t offset(0); offset < m_Journal.size(); )
+        {
+            const size_t size(static_cast<size_t>(ReadVarint(m_Journal, offset)));
+            writer.Visit(string(m_Journal.begin() + offset, m_Journal.begin() + offset + size));
+            offset += size;
+        }
+    }
+    else
+    {
+        m_Algorithm->Export(writer);
+
+        // A DetectSorted run hasn't been given to the algorithm yet
+        uint64_t value(0);
+        for (size_t offset(0); offset < m_SortedRun.size(); )
+        {
+            value += ReadVarint(m_SortedRun, offset);
+            writer.Visit(FormatNumber(value, m_MaxDigits));
+        }
+    }
+    writer.Commit();
+}
+
+void UniqueNumberCounter::WriteSnapshot(const string &path, const SnapshotType type)
+{
+    if (m_SnapshotPid != 0)
+        RaiseError("A snapshot is already being written");
+    m_WriteSnapshot(path, type);
+    m_Journal.clear();
+    m_IsJournalComplete = true;
+    ++m_Sequence;
+}
+
+void UniqueNumberCounter::StartSnapshot(const string &path, shared_ptr<SnapshotListener> listener, const SnapshotType type)
+{
+    if (m_SnapshotPid != 0)
+        RaiseError("A snapshot is already being written");
+    m_CheckSnapshotType(type);
 
-            Edges m_Edges; /**< Stores the edges for this node. */
-        };
+    // Flush stdio first so that the child doesn't write out the parent's buffered output again
+    fflush(NULL);
+    const pid_t pid(fork());
+    if (pid < 0)
+        RaiseError("Couldn't fork the snapshot process");
+    if (pid == 0)
+    {
+        // The child writes the counter as it was at the fork and exits without running destructors, which
+        // belong to the parent
+        bool succeeded(false);
+        try
+        {
+            m_WriteSnapshot(path, type);
+            succeeded = true;
+        }
+        catch (...)
+        {
+        }
+        _exit(succeeded ? 0 : 1);
+    }
 
-        shared_ptr<Node> m_Root; /**< Stores the root node for the tree. */
-    };
+    // The new checkpoint starts now, but the numbers before it are kept until the snapshot has succeeded
+    m_SnapshotPid = pid;
+    m_SnapshotPath = path;
+    m_SnapshotListener = listener;
+    m_PendingJournal.swap(m_Journal);
+    m_Journal.clear();
+    m_IsPendingJournalComplete = m_IsJournalComplete;
+    m_IsJournalComplete = true;
+    ++m_Sequence;
+}
 
-    /**
-     * \brief Implements the unique number algorithm using an STL set, which is faster but
-     *        uses more memory.
-     */
-    class SetAlgorithm : public IUniqueNumberAlgorithm
+bool UniqueNumberCounter::PollSnapshot(const bool wait)
+{
+    if (m_SnapshotPid == 0)
+        return false;
+    int status(0);
+    pid_t pid;
+    do
+        pid = waitpid(m_SnapshotPid, &status, wait ? 0 : WNOHANG);
+    while ((pid < 0) && (errno == EINTR));
+    if (pid == 0)
+        return true;
+
+    // The snapshot is over, so clear it before the listener can start another
+    const bool succeeded((pid == m_SnapshotPid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    const string path(m_SnapshotPath);
+    const shared_ptr<SnapshotListener> listener(m_SnapshotListener);
+    m_SnapshotPid = 0;
+    m_SnapshotPath.clear();
+    m_SnapshotListener.reset();
+    if (!succeeded)
     {
-    public:
-        /**
-         * \copydoc IUniqueNumberAlgorithm::Reset
-         */
-        virtual void Reset()
+        // Roll back to the previous checkpoint, whose next delta must also hold the numbers since. If tracking
+        // was turned off meanwhile, those numbers are forgotten along with the rest.
+        if (m_TracksDeltas)
         {
-            m_Numbers.clear();
+            m_PendingJournal.insert(m_PendingJournal.end(), m_Journal.begin(), m_Journal.end());
+            m_Journal.swap(m_PendingJournal);
         }
+        m_IsJournalComplete = m_IsJournalComplete && m_IsPendingJournalComplete && (m_TracksDeltas || m_PendingJournal.empty());
+        --m_Sequence;
+    }
+    vector<unsigned char>().swap(m_PendingJournal);
+    if (listener.get() != NULL)
+        listener->OnSnapshotComplete(path, succeeded);
+    return false;
+}
 
-        /**
-         * \copydoc IUniqueNumberAlgorithm::IsUnique
-         */
-        virtual bool IsUnique(const string &number)
+void UniqueNumberCounter::LoadSnapshot(const string &path)
+{
+    if (m_SnapshotPid != 0)
+        RaiseError("A snapshot is being written");
+    SnapshotReader reader(path, m_MaxDigits);
+    if ((reader.GetType() == DeltaSnapshot) &&
+        ((reader.GetLineage() != m_Lineage) || (reader.GetSequence() != m_Sequence + 1)))
+        RaiseError("The delta doesn't follow the latest checkpoint");
+
+    // Numbers counted before loading that weren't tracked stay missing from the next delta
+    const bool isJournalComplete(m_IsJournalComplete && m_Journal.empty());
+
+    // The numbers were seen when they were first counted, so the sketch and metrics are detached while they're
+    // loaded
+    shared_ptr<CountMinSketch> sketch;
+    shared_ptr<CounterMetrics> metrics;
+    sketch.swap(m_FrequencySketch);
+    metrics.swap(m_Metrics);
+    try
+    {
+        // Process the numbers a chunk at a time so that they never exist as strings all at once
+        const size_t ChunkSize(65536);
+        vector<string> chunk;
+        string number;
+        bool more(true);
+        while (more)
         {
-            const pair<Numbers::iterator, bool> &ret(m_Numbers.insert(number));
-            return ret.second;
+            chunk.clear();
+            while ((chunk.size() < ChunkSize) && (more = reader.Read(number)))
+                chunk.push_back(number);
+            ProcessNumbers(chunk);
         }
+    }
+    catch (...)
+    {
+        m_FrequencySketch.swap(sketch);
+        m_Metrics.swap(metrics);
+        throw;
+    }
+    m_FrequencySketch.swap(sketch);
+    m_Metrics.swap(metrics);
+    if (m_Metrics.get() != NULL)
+        m_Metrics->Publish(GetCount());
 
-    private:
-        /**
-         * \brief Represent the unique numbers as an STL set of strings.
-         */
-        typedef set<string> Numbers;
+    // The numbers loaded belong to the adopted checkpoint, so they aren't part of the next delta
+    m_Lineage = reader.GetLineage();
+    m_Sequence = reader.GetSequence();
+    m_Journal.clear();
+    m_IsJournalComplete = isJournalComplete;
+}
 
-        Numbers m_Numbers; /**< Set of unique numbers found in the stream */
-    };
+void UniqueNumberCounter::CompactSnapshots(const vector<string> &paths, const string &path)
+{
+    if (paths.empty())
+        RaiseError("There are no snapshots to compact");
+
+    // Numbers only enter a delta when they become unique, so a valid chain never repeats one. Every reader is
+    // opened first, so that the chain is checked before anything is written.
+    vector<shared_ptr<SnapshotReader> > readers;
+    for (vector<string>::const_iterator snapshot(paths.begin()); snapshot != paths.end(); ++snapshot)
+    {
+        readers.push_back(shared_ptr<SnapshotReader>(new SnapshotReader(*snapshot, MaxSnapshotNumberSize)));
+        const SnapshotReader &reader(*readers.back());
+        if (readers.size() == 1)
+        {
+            if (reader.GetType() != FullSnapshot)
+                RaiseError("A chain must start with a full snapshot");
+        }
+        else if ((reader.GetType() != DeltaSnapshot) || (reader.GetLineage() != readers.front()->GetLineage()) ||
+                 (reader.GetSequence() != readers.front()->GetSequence() + readers.size() - 1))
+            RaiseError("The snapshots aren't a chain");
+    }
+
+    SnapshotWriter writer(path, FullSnapshot, readers.back()->GetLineage(), readers.back()->GetSequence());
+    string number;
+    for (vector<shared_ptr<SnapshotReader> >::const_iterator reader(readers.begin()); reader != readers.end(); ++reader)
+        while ((*reader)->Read(number))
+            writer.Visit(number);
+    writer.Commit();
 }
 
-shared_ptr<IUniqueNumberAlgorithm> IUniqueNumberAlgorithm::CreateInstance(const AlgorithmType algorithmType)
+void UniqueNumberCounter::GetPrefixCounts(vector<size_t> &counts) const
 {
-    shared_ptr<IUniqueNumberAlgorithm> algorithm;
-    switch (algorithmType)
+    // Sorted numbers haven't been given to the algorithm
+    if (m_Ordering != Unsorted)
+        counts = m_SortedPrefixCounts;
+    else
+        m_Algorithm->GetPrefixCounts(counts);
+}
+
+void UniqueNumberCounter::SetAlphabet(const IUniqueNumberAlgorithm::Alphabet alphabet)
+{
+    if (m_Count > 0)
+        RaiseError("Alphabet must be set before processing numbers");
+    if ((m_Ordering == DetectSorted) && (alphabet != IUniqueNumberAlgorithm::Decimal))
+        RaiseError("DetectSorted requires decimal numbers");
+
+    // Keep the partition table about as large as the decimal default regardless of the alphabet's size
+    const size_t size(GetAlphabetTable(alphabet).GetSize());
+    m_NumPartitionDigits = 0;
+    while ((m_NumPartitionDigits < min(m_MinDigits, DefaultNumPartitionDigits)) &&
+           (Power(size, m_NumPartitionDigits + 1) <= MaxNumPartitions))
+        ++m_NumPartitionDigits;
+    m_Alphabet = alphabet;
+}
+
+void UniqueNumberCounter::ProcessNumbers(const vector<string> &numbers)
+{
+    const uint64_t start(m_Metrics.get() != NULL ? GetMicroseconds() : 0);
+
+    // Check arguments before touching any state so that a bad batch is rejected as a whole
+    const string *previous(&m_Previous);
+    for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
     {
-        case CompactRadixTree:
-            algorithm.reset(new CompactRadixTreeAlgorithm);
-            break;
-        case Set:
-            algorithm.reset(new SetAlgorithm);
-            break;
-        default:
-            RaiseError("Invalid algorithmType");
+        m_CheckNumber(*number);
+        m_CheckOrder(*number, *previous);
+        previous = &*number;
+    }
+
+    // A batch is a cheap place to notice that a background snapshot has finished
+    if (m_SnapshotPid != 0)
+        PollSnapshot();
+
+    m_ProcessCheckedNumbers(numbers);
+    if (m_FrequencySketch.get() != NULL)
+        for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
+            m_FrequencySketch->Add(*number);
+    if (m_ReplicationSender.get() != NULL)
+        m_ReplicationSender->Flush();
+    if (m_Metrics.get() != NULL)
+    {
+        m_Metrics->AddProcessed(numbers.size());
+        m_Metrics->AddBatch((GetMicroseconds() - start) / 1e6);
+        m_Metrics->Publish(GetCount());
     }
-    return algorithm;
 }
 
-UniqueNumberCounter::UniqueNumberCounter(shared_ptr<IUniqueNumberAlgorithm> algorithm, const size_t numExpectedDigits) :
-    m_Algorithm(algorithm),
-    m_NumExpectedDigits(numExpectedDigits),
-    m_Count(0)
+void UniqueNumberCounter::MeasureMemory()
 {
-    // Check arguments
-    if (m_Algorithm.get() == NULL)
-       RaiseError("NULL ptr");
-    if (m_NumExpectedDigits <= 0)
-       RaiseError("numExpectedDigits cannot be zero");
+    if (m_Metrics.get() == NULL)
+        return;
+    const uint64_t start(GetMicroseconds());
+    const size_t memoryUsage(m_Algorithm->GetMemoryUsage());
+    m_Metrics->SetMemoryUsage(memoryUsage, (GetMicroseconds() - start) / 1e6);
+    m_Metrics->Publish(GetCount());
+}
 
-    // Reset the algorithm back to its intial state in case it's being reused
-    m_Algorithm->Reset();
+void UniqueNumberCounter::m_ProcessCheckedNumbers(const vector<string> &numbers)
+{
+    if (m_Ordering != Unsorted)
+    {
+        // Partitioning would destroy the order
+        for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
+            m_ProcessCheckedNumber(*number);
+        return;
+    }
+
+    if ((m_NumPartitionDigits == 0) && !m_TracksDeltas && (m_ReplicationSender.get() == NULL))
+    {
+        // Let the algorithm take advantage of seeing the whole batch, which it can't when each unique number
+        // must be tracked
+        const size_t numUnique(m_Algorithm->InsertBatch(numbers));
+        m_Count += numUnique;
+        if (numUnique > 0)
+            m_IsJournalComplete = false;
+        return;
+    }
+
+    // Partitions are stored back to back, so walking the reordered batch processes one partition at a time
+    m_PartitionNumbers(numbers);
+    for (vector<const string *>::const_iterator number(m_PartitionedNumbers.begin()); number != m_PartitionedNumbers.end(); ++number)
+    {
+        if (m_Algorithm->IsUnique(**number))
+        {
+            m_Count++;
+            m_TrackUnique(**number);
+        }
+    }
 }
 
-void UniqueNumberCounter::ProcessNumber(const string &number)
+void UniqueNumberCounter::SetNumPartitionDigits(const size_t numPartitionDigits)
 {
-    // Check arguments
-    m_CheckNumber(number);
+    if (numPartitionDigits > m_MinDigits)
+        RaiseError("numPartitionDigits cannot exceed the smallest number of digits");
+    m_NumPartitionDigits = numPartitionDigits;
+}
 
-    // If the number is unique, then increment the count
-    if (m_Algorithm->IsUnique(number))
-        m_Count++;
+void UniqueNumberCounter::m_PartitionNumbers(const vector<string> &numbers)
+{
+    const AlphabetTable &alphabet(GetAlphabetTable(m_Alphabet));
+    const size_t numPartitions(Power(alphabet.GetSize(), m_NumPartitionDigits));
+
+    // Count the size of each partition so that each one gets a contiguous range of the output
+    m_PartitionOffsets.assign(numPartitions + 1, 0);
+    for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
+        m_PartitionOffsets[GetLeadingValue(*number, m_NumPartitionDigits, alphabet) + 1]++;
+    for (size_t partition(0); partition < numPartitions; ++partition)
+        m_PartitionOffsets[partition + 1] += m_PartitionOffsets[partition];
+
+    // Scatter through the staging buffers. Writing whole cache lines to the output avoids touching a
+    // different output line (and often a different page) for every single number.
+    m_PartitionedNumbers.resize(numbers.size());
+    m_StagingBuffers.resize(numPartitions * NumStagingEntries);
+    m_StagingSizes.assign(numPartitions, 0);
+    vector<size_t> next(m_PartitionOffsets.begin(), m_PartitionOffsets.end() - 1);
+    for (vector<string>::const_iterator number(numbers.begin()); number != numbers.end(); ++number)
+    {
+        const size_t partition(GetLeadingValue(*number, m_NumPartitionDigits, alphabet));
+        const string **staging(&m_StagingBuffers[partition * NumStagingEntries]);
+        staging[m_StagingSizes[partition]++] = &*number;
+        if (m_StagingSizes[partition] == NumStagingEntries)
+        {
+            copy(staging, staging + NumStagingEntries, m_PartitionedNumbers.begin() + next[partition]);
+            next[partition] += NumStagingEntries;
+            m_StagingSizes[partition] = 0;
+        }
+    }
+    for (size_t partition(0); partition < numPartitions; ++partition)
+    {
+        const string **staging(&m_StagingBuffers[partition * NumStagingEntries]);
+        copy(staging, staging + m_StagingSizes[partition], m_PartitionedNumbers.begin() + next[partition]);
+    }
 }
 
 void UniqueNumberCounter::m_CheckNumber(const string &number) const
 {
-    if (number.size() != m_NumExpectedDigits)
-        RaiseError("Invalid number of digits");
-    for (string::const_iterator ch(number.begin()); ch != number.end(); ch++)
-        if (!isdigit(*ch))
-            RaiseError("Not a number");
+    const char *error(NULL);
+    if ((number.size() < m_MinDigits) || (number.size() > m_MaxDigits))
+        error = "Invalid number of digits";
+    const AlphabetTable &alphabet(GetAlphabetTable(m_Alphabet));
+    for (string::const_iterator ch(number.begin()); (error == NULL) && (ch != number.end()); ch++)
+        if (alphabet.GetIndex(*ch) >= alphabet.GetSize())
+            error = "Not a number";
+    if (error != NULL)
+        m_Reject(error);
+}
+
+void UniqueNumberCounter::m_CheckOrder(const string &number, const string &previous) const
+{
+    // Numbers have the same number of digits, so comparing strings compares values
+    if ((m_Ordering == Sorted) && !previous.empty() && (number < previous))
+        m_Reject("Number is out of order");
+}
+
+void UniqueNumberCounter::m_Reject(const char *error) const
+{
+    if (m_Metrics.get() != NULL)
+    {
+        m_Metrics->AddRejected();
+        m_Metrics->Publish(GetCount());
+    }
+    RaiseError(error);
+}
+
+ReplicationSender::ReplicationSender(const int fd, const size_t batchSize) :
+    m_Fd(fd),
+    m_IsSocket(IsSocket(fd)),
+    m_BatchSize(batchSize),
+    m_Sequence(0),
+    m_BatchTime(0),
+    m_BatchCount(0),
+    m_BacklogOffset(0),
+    m_IsBroken(false)
+{
+    if (batchSize == 0)
+        RaiseError("batchSize cannot be zero");
+    const int flags(fcntl(fd, F_GETFL));
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+        RaiseError("Couldn't make the replication descriptor non-blocking");
+}
+
+void ReplicationSender::Add(const string &number)
+{
+    if (m_IsBroken)
+        return;
+    if (m_BatchCount == 0)
+        m_BatchTime = GetMicroseconds();
+    AppendVarint(number.size(), m_Batch);
+    m_Batch.insert(m_Batch.end(), number.begin(), number.end());
+    if (++m_BatchCount == m_BatchSize)
+    {
+        m_EndBatch();
+        m_Write();
+    }
+}
+
+void ReplicationSender::Flush()
+{
+    if (m_IsBroken)
+        return;
+    if (m_BatchCount > 0)
+        m_EndBatch();
+    m_Write();
+}
+
+void ReplicationSender::m_EndBatch()
+{
+    vector<unsigned char> header;
+    AppendVarint(++m_Sequence, header);
+    AppendVarint(m_BatchTime, header);
+    AppendVarint(m_BatchCount, header);
+    const size_t size(header.size() + m_Batch.size());
+    for (size_t byte(0); byte < FrameHeaderSize; ++byte)
+        m_Backlog.push_back(static_cast<unsigned char>(size >> (8 * byte)));
+    m_Backlog.insert(m_Backlog.end(), header.begin(), header.end());
+    m_Backlog.insert(m_Backlog.end(), m_Batch.begin(), m_Batch.end());
+    m_Batch.clear();
+    m_BatchCount = 0;
+}
+
+void ReplicationSender::m_Write()
+{
+    while (m_BacklogOffset < m_Backlog.size())
+    {
+        const size_t size(m_Backlog.size() - m_BacklogOffset);
+        const ssize_t written(m_IsSocket ? send(m_Fd, &m_Backlog[m_BacklogOffset], size, MSG_NOSIGNAL) :
+                                           write(m_Fd, &m_Backlog[m_BacklogOffset], size));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+
+            // The standby has gone, so stop streaming rather than let the backlog grow without bound
+            m_IsBroken = true;
+            vector<unsigned char>().swap(m_Backlog);
+            vector<unsigned char>().swap(m_Batch);
+            m_BacklogOffset = 0;
+            m_BatchCount = 0;
+            return;
+        }
+        m_BacklogOffset += static_cast<size_t>(written);
+    }
+
+    // Only move the unwritten bytes down once they're at most half the backlog, so that moving them is amortized
+    if (m_BacklogOffset == m_Backlog.size())
+    {
+        m_Backlog.clear();
+        m_BacklogOffset = 0;
+    }
+    else if (m_BacklogOffset * 2 >= m_Backlog.size())
+    {
+        m_Backlog.erase(m_Backlog.begin(), m_Backlog.begin() + m_BacklogOffset);
+        m_BacklogOffset = 0;
+    }
+}
+
+ReplicationReceiver::ReplicationReceiver(const int fd, UniqueNumberCounter &counter) :
+    m_Fd(fd),
+    m_Counter(counter),
+    m_CaughtUp(false),
+    m_Sequence(0),
+    m_NumBatches(0),
+    m_NumNumbers(0),
+    m_LagSeconds(0),
+    m_MaxLagSeconds(0),
+    m_BufferOffset(0),
+    m_IsBroken(false)
+{
+}
+
+void ReplicationReceiver::CatchUp(const string &path)
+{
+    if (m_NumBatches > 0)
+        RaiseError("A standby can only catch up before applying batches");
+    m_Counter.LoadSnapshot(path);
+    m_CaughtUp = true;
+}
+
+bool ReplicationReceiver::Receive(const bool wait)
+{
+    if (m_IsBroken)
+        RaiseError("The standby missed a batch of the replication stream");
+    pollfd request;
+    request.fd = m_Fd;
+    request.events = POLLIN;
+    request.revents = 0;
+    int numReady;
+    do
+        numReady = poll(&request, 1, wait ? -1 : 0);
+    while ((numReady < 0) && (errno == EINTR));
+    if (numReady < 0)
+        RaiseError("Couldn't poll the replication stream");
+    if (numReady == 0)
+        return true;
+
+    const size_t ChunkSize(65536);
+    const size_t size(m_Buffer.size());
+    m_Buffer.resize(size + ChunkSize);
+    ssize_t numRead;
+    do
+        numRead = read(m_Fd, &m_Buffer[size], ChunkSize);
+    while ((numRead < 0) && (errno == EINTR));
+    if (numRead < 0)
+    {
+        m_Buffer.resize(size);
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return true;
+        RaiseError("Couldn't read the replication stream");
+    }
+    m_Buffer.resize(size + static_cast<size_t>(numRead));
+    try
+    {
+        m_ApplyBatches();
+    }
+    catch (...)
+    {
+        // The failed batch stays at the front of the buffer, so nothing after it can be applied either
+        m_IsBroken = true;
+        throw;
+    }
+    if (numRead > 0)
+        return true;
+    if (GetPendingSize() > 0)
+        RaiseError("The replication stream ended within a batch");
+    return false;
+}
+
+void ReplicationReceiver::m_ApplyBatches()
+{
+    while (m_Buffer.size() - m_BufferOffset >= FrameHeaderSize)
+    {
+        size_t size(0);
+        for (size_t byte(0); byte < FrameHeaderSize; ++byte)
+            size |= static_cast<size_t>(m_Buffer[m_BufferOffset + byte]) << (8 * byte);
+        if (size > MaxFrameSize)
+            RaiseError("The replication stream is corrupt");
+        if (m_Buffer.size() - m_BufferOffset - FrameHeaderSize < size)
+            break;
+
+        size_t offset(m_BufferOffset + FrameHeaderSize);
+        const size_t end(offset + size);
+        uint64_t sequence;
+        uint64_t time;
+        uint64_t count;
+        if (!ReadVarint(m_Buffer, offset, end, sequence) || !ReadVarint(m_Buffer, offset, end, time) ||
+            !ReadVarint(m_Buffer, offset, end, count) || (count > size / 2))
+            RaiseError("The replication stream is corrupt");
+
+        // A standby that caught up from a snapshot may join the stream after its first batch
+        if ((sequence != m_Sequence + 1) && ((m_Sequence != 0) || !m_CaughtUp))
+            RaiseError("The replication stream skipped a batch");
+
+        m_Numbers.resize(static_cast<size_t>(count));
+        for (vector<string>::iterator number(m_Numbers.begin()); number != m_Numbers.end(); ++number)
+        {
+            uint64_t length;
+            if (!ReadVarint(m_Buffer, offset, end, length) || (length > end - offset))
+                RaiseError("The replication stream is corrupt");
+            number->assign(m_Buffer.begin() + offset, m_Buffer.begin() + offset + static_cast<size_t>(length));
+            offset += static_cast<size_t>(length);
+        }
+        if (offset != end)
+            RaiseError("The replication stream is corrupt");
+        m_Counter.ProcessNumbers(m_Numbers);
+
+        const uint64_t now(GetMicroseconds());
+        m_Sequence = sequence;
+        ++m_NumBatches;
+        m_NumNumbers += count;
+        m_LagSeconds = (now > time) ? (now - time) / 1e6 : 0;
+        m_MaxLagSeconds = max(m_MaxLagSeconds, m_LagSeconds);
+        m_BufferOffset = end;
+    }
+
+    // Only move the incomplete batch down once it's at most half the buffer, so that moving it is amortized
+    if (m_BufferOffset == m_Buffer.size())
+    {
+        m_Buffer.clear();
+        m_BufferOffset = 0;
+    }
+    else if (m_BufferOffset * 2 >= m_Buffer.size())
+    {
+        m_Buffer.erase(m_Buffer.begin(), m_Buffer.begin() + m_BufferOffset);
+        m_BufferOffset = 0;
+    }
+}
+
+CounterMetrics::CounterMetrics(const string &counterName, const string &algorithmName) :
+    m_CounterName(counterName),
+    m_AlgorithmName(algorithmName),
+    m_NumUnpublished(0),
+    m_Version(0)
+{
+    memset(&m_Current, 0, sizeof(m_Current));
+    memset(&m_Published, 0, sizeof(m_Published));
+}
+
+double CounterMetrics::GetLatencyBound(const size_t bucket)
+{
+    return 1e-5 * static_cast<double>(uint64_t(1) << (2 * bucket));
+}
+
+void CounterMetrics::AddBatch(const double seconds)
+{
+    size_t bucket(0);
+    while ((bucket < NumLatencyBuckets) && (seconds > GetLatencyBound(bucket)))
+        ++bucket;
+    ++m_Current.batchLatencyBuckets[bucket];
+    ++m_Current.numBatches;
+    m_Current.batchSeconds += seconds;
+}
+
+void CounterMetrics::Publish(const size_t numUnique)
+{
+    m_Current.numUnique = numUnique;
+    m_Current.publishTime = GetMicroseconds();
+
+    // A seqlock: readers retry while the version is odd or changes under them, so publishing never waits. The
+    // atomic increments are full barriers, which keep the copy between them.
+    __sync_fetch_and_add(&m_Version, 1);
+    m_Published = m_Current;
+    __sync_fetch_and_add(&m_Version, 1);
+}
+
+void CounterMetrics::GetSnapshot(Snapshot &snapshot) const
+{
+    for (;;)
+    {
+        const uint64_t version(m_Version);
+        __sync_synchronize();
+        snapshot = m_Published;
+        __sync_synchronize();
+        if (((version & 1) == 0) && (m_Version == version))
+            return;
+        sched_yield();
+    }
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+    pthread_mutex_init(&m_Mutex, NULL);
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    pthread_mutex_destroy(&m_Mutex);
+}
+
+void MetricsRegistry::Add(shared_ptr<CounterMetrics> metrics)
+{
+    if (metrics.get() == NULL)
+        RaiseError("NULL ptr");
+    pthread_mutex_lock(&m_Mutex);
+    m_Metrics.push_back(metrics);
+    pthread_mutex_unlock(&m_Mutex);
+}
+
+void MetricsRegistry::Remove(shared_ptr<CounterMetrics> metrics)
+{
+    pthread_mutex_lock(&m_Mutex);
+    m_Metrics.erase(remove(m_Metrics.begin(), m_Metrics.end(), metrics), m_Metrics.end());
+    pthread_mutex_unlock(&m_Mutex);
+}
+
+void MetricsRegistry::Format(string &text) const
+{
+    // Only the list is copied under the lock; the snapshots are read without blocking any counter
+    pthread_mutex_lock(&m_Mutex);
+    const vector<shared_ptr<CounterMetrics> > metrics(m_Metrics);
+    pthread_mutex_unlock(&m_Mutex);
+    vector<CounterMetrics::Snapshot> snapshots(metrics.size());
+    vector<string> labels(metrics.size());
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+    {
+        metrics[counter]->GetSnapshot(snapshots[counter]);
+        labels[counter] = "counter=\"" + EscapeLabel(metrics[counter]->GetCounterName()) + "\",algorithm=\"" +
+                          EscapeLabel(metrics[counter]->GetAlgorithmName()) + "\"";
+    }
+
+    ostringstream out;
+    out << setprecision(10);
+    WriteMetricHeader(out, "unique_number_counter_unique_numbers", "gauge", "Unique numbers counted.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+        out << "unique_number_counter_unique_numbers{" << labels[counter] << "} " << snapshots[counter].numUnique << "\n";
+    WriteMetricHeader(out, "unique_number_counter_processed_total", "counter", "Numbers processed, unique or not.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+        out << "unique_number_counter_processed_total{" << labels[counter] << "} " << snapshots[counter].numProcessed << "\n";
+    WriteMetricHeader(out, "unique_number_counter_rejected_total", "counter", "Numbers rejected as malformed.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+        out << "unique_number_counter_rejected_total{" << labels[counter] << "} " << snapshots[counter].numRejected << "\n";
+    WriteMetricHeader(out, "unique_number_counter_memory_bytes", "gauge", "Bytes used by the algorithm when last measured.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+        out << "unique_number_counter_memory_bytes{" << labels[counter] << "} " << snapshots[counter].memoryUsage << "\n";
+    WriteMetricHeader(out, "unique_number_counter_memory_measurement_seconds", "gauge",
+                      "Time taken by the last measurement of the algorithm's memory.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+        out << "unique_number_counter_memory_measurement_seconds{" << labels[counter] << "} " << snapshots[counter].memorySeconds << "\n";
+    WriteMetricHeader(out, "unique_number_counter_batch_duration_seconds", "histogram", "Time taken by ProcessNumbers.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+    {
+        const CounterMetrics::Snapshot &snapshot(snapshots[counter]);
+        uint64_t cumulative(0);
+        for (size_t bucket(0); bucket < CounterMetrics::NumLatencyBuckets; ++bucket)
+        {
+            cumulative += snapshot.batchLatencyBuckets[bucket];
+            out << "unique_number_counter_batch_duration_seconds_bucket{" << labels[counter] << ",le=\""
+                << CounterMetrics::GetLatencyBound(bucket) << "\"} " << cumulative << "\n";
+        }
+        out << "unique_number_counter_batch_duration_seconds_bucket{" << labels[counter] << ",le=\"+Inf\"} "
+            << snapshot.numBatches << "\n"
+            << "unique_number_counter_batch_duration_seconds_sum{" << labels[counter] << "} " << snapshot.batchSeconds << "\n"
+            << "unique_number_counter_batch_duration_seconds_count{" << labels[counter] << "} " << snapshot.numBatches << "\n";
+    }
+    WriteMetricHeader(out, "unique_number_counter_publish_timestamp_seconds", "gauge",
+                      "When the metrics were last published by the counter.");
+    for (size_t counter(0); counter < metrics.size(); ++counter)
+        out << "unique_number_counter_publish_timestamp_seconds{" << labels[counter] << "} "
+            << fixed << setprecision(3) << snapshots[counter].publishTime / 1e6 << "\n";
+    text = out.str();
+}
+
+MetricsEndpoint::MetricsEndpoint(shared_ptr<MetricsRegistry> registry, const unsigned short port) :
+    m_Registry(registry),
+    m_Listener(socket(AF_INET, SOCK_STREAM, 0)),
+    m_Port(port)
+{
+    if (registry.get() == NULL)
+        RaiseError("NULL ptr");
+    if (m_Listener < 0)
+        RaiseError("Couldn't create the metrics socket");
+    const int enabled(1);
+    setsockopt(m_Listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size(sizeof(address));
+    if ((bind(m_Listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) || (listen(m_Listener, 16) != 0) ||
+        (getsockname(m_Listener, reinterpret_cast<sockaddr *>(&address), &size) != 0))
+    {
+        close(m_Listener);
+        RaiseError("Couldn't listen for metrics scrapes");
+    }
+    m_Port = ntohs(address.sin_port);
+    if (pipe(m_StopPipe) != 0)
+    {
+        close(m_Listener);
+        RaiseError("Couldn't create the metrics stop pipe");
+    }
+    if (pthread_create(&m_Thread, NULL, m_Run, this) != 0)
+    {
+        close(m_Listener);
+        close(m_StopPipe[0]);
+        close(m_StopPipe[1]);
+        RaiseError("Couldn't start the metrics thread");
+    }
+}
+
+MetricsEndpoint::~MetricsEndpoint()
+{
+    const char stop(0);
+    while ((write(m_StopPipe[1], &stop, 1) < 0) && (errno == EINTR))
+        ;
+    pthread_join(m_Thread, NULL);
+    close(m_Listener);
+    close(m_StopPipe[0]);
+    close(m_StopPipe[1]);
+}
+
+void *MetricsEndpoint::m_Run(void *endpoint)
+{
+    const MetricsEndpoint &self(*static_cast<MetricsEndpoint *>(endpoint));
+    pollfd requests[2];
+    requests[0].fd = self.m_Listener;
+    requests[0].events = POLLIN;
+    requests[1].fd = self.m_StopPipe[0];
+    requests[1].events = POLLIN;
+    for (;;)
+    {
+        requests[0].revents = 0;
+        requests[1].revents = 0;
+        if (poll(requests, 2, -1) < 0)
+            continue;
+        if (requests[1].revents != 0)
+            return NULL;
+        if ((requests[0].revents & POLLIN) != 0)
+        {
+            const int client(accept(self.m_Listener, NULL, NULL));
+            if (client < 0)
+                continue;
+            try
+            {
+                self.m_Serve(client);
+            }
+            catch (...)
+            {
+            }
+            close(client);
+        }
+    }
+}
+
+void MetricsEndpoint::m_Serve(const int client) const
+{
+    // A client that stalls can hold up the next scrape, but never the counters
+    timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    const size_t MaxRequestSize(8192);
+    string request;
+    char buffer[1024];
+    while ((request.find("\r\n\r\n") == string::npos) && (request.size() < MaxRequestSize))
+    {
+        const ssize_t numRead(recv(client, buffer, sizeof(buffer), 0));
+        if (numRead <= 0)
+            return;
+        request.append(buffer, static_cast<size_t>(numRead));
+    }
+
+    string status("200 OK");
+    string body;
+    const string path(request.substr(0, request.find_first_of(" ?\r", 4)));
+    if (path == "GET /metrics")
+        m_Registry->Format(body);
+    else
+    {
+        status = "404 Not Found";
+        body = "Metrics are served at /metrics\n";
+    }
+    ostringstream response;
+    response << "HTTP/1.1 " << status << "\r\n"
+             << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body;
+    const string text(response.str());
+    for (size_t offset(0); offset < text.size(); )
+    {
+        const ssize_t written(send(client, text.data() + offset, text.size() - offset, MSG_NOSIGNAL));
+        if (written <= 0)
+            return;
+        offset += static_cast<size_t>(written);
+    }
 }
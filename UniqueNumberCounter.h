@@ -1,6 +1,13 @@
 #pragma once
 
+#include <pthread.h>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
 #include <tr1/memory>
+#include <utility>
+#include <vector>
 
 /**
  * \brief An algorithm that can be used to detect unique numbers in a large stream of numbers.
@@ -15,32 +22,739 @@ public:
     {
        CompactRadixTree, /**< Implements the algorithm using a compact radix tree, which is slower but uses memory
                               more efficiently. */
-       Set               /**< Implements the algorithm using a STL set, which is faster but uses more momory. */
+       Set,              /**< Implements the algorithm using a STL set, which is faster but uses more momory. */
+       IntervalSet,      /**< Implements the algorithm using a B+tree of disjoint intervals, whose memory scales with
+                              the number of runs of consecutive numbers rather than the number of numbers. */
+       SparseBitmap,     /**< Implements the algorithm using a bitmap of up to 12 digit numbers whose 64 KB blocks
+                              are only allocated once a number falls in them. */
+       Hash,             /**< Implements the algorithm using a hash table of numbers of up to 38 digits packed into
+                              64 or 128 bit integer keys. Keys record each number's length, so numbers of
+                              different lengths can be counted together. */
+       Theta,            /**< Estimates the count using a ThetaSketch, whose memory is fixed by its size k. */
+       Cuckoo,           /**< Implements the algorithm approximately using a CuckooFilter, which supports Remove. */
+       SortedBlocks,     /**< Implements the algorithm using sorted blocks of a few hundred numbers of up to 19
+                              digits, each stored as bit packed deltas, which takes a byte or two per number when
+                              numbers are moderately dense. */
+       BTree,            /**< Implements the algorithm using a B+tree of numbers of up to 19 digits packed into
+                              integer keys, with cache line aligned nodes searched using SIMD. Supports Visit and
+                              VisitRange. */
+       BitmapTree,       /**< Implements the algorithm using a 64-way hierarchy of lazily allocated bitmaps over
+                              numbers of up to 19 digits packed into integer keys. Supports GetSuccessor and
+                              GetPredecessor in a few word operations per 6 bits of key, as well as Visit and
+                              VisitRange. */
+       SwissHash         /**< Like Hash, but using a Swiss table whose groups of 16 slots are probed with SSE2
+                              compares of per-slot control bytes, so that it can run 7/8 full. Its InsertBatch
+                              prefetches the groups a batch will probe. */
+    };
+
+    /**
+     * \brief The characters numbers may be written with. Only the CompactRadixTree, Set, Theta and Cuckoo
+     *        algorithms support alphabets other than Decimal.
+     */
+    enum Alphabet
+    {
+        Decimal,     /**< The digits 0-9. */
+        Hexadecimal, /**< The digits 0-9 and the lower case letters a-f. */
+        Base36,      /**< The digits 0-9 and the lower case letters a-z. */
+        Byte         /**< Any byte, so that arbitrary binary keys can be counted. */
+    };
+
+    /**
+     * \brief Receives numbers from Visit, VisitRange and Export.
+     */
+    class Visitor
+    {
+    public:
+        /**
+         * \brief Must be sub-classed.
+         */
+        virtual ~Visitor() {}
+
+        /**
+         * \brief Receives the next number.
+         *
+         * @return Returns false to stop the visit.
+         */
+        virtual bool Visit(const std::string &number) = 0;
+    };
+
+    /**
+     * \brief Optional hints that let an algorithm size itself for the numbers it will see. Algorithms ignore
+     *        hints they have no use for.
+     */
+    struct Options
+    {
+        /**
+         * \brief Initializes all hints to unknown.
+         */
+        Options() :
+            numExpectedDigits(0),
+            minExpectedDigits(0),
+            expectedPopulation(0),
+            alphabet(Decimal),
+            sketchSize(0),
+            fingerprintBits(0),
+            bucketSize(0)
+        {
+        }
+
+        size_t numExpectedDigits;  /**< Number of digits each number will have (the most digits when numbers vary
+                                        in length), or 0 if unknown. */
+        size_t minExpectedDigits;  /**< Fewest digits a number will have when numbers vary in length, or 0 if every
+                                        number has numExpectedDigits digits. */
+        size_t expectedPopulation; /**< Expected number of unique numbers, or 0 if unknown. */
+        Alphabet alphabet;         /**< The characters numbers are written with. This is a requirement rather
+                                        than a hint. */
+        size_t sketchSize;         /**< Number of hashes k a Theta sketch retains, or 0 for the default. */
+        size_t fingerprintBits;    /**< Bits per fingerprint in a Cuckoo filter, or 0 for the default. */
+        size_t bucketSize;         /**< Fingerprints per bucket in a Cuckoo filter, or 0 for the default. */
     };
 
     /**
      * \brief Returns an instance of this interface given the specified algorithm implementation.
      *
-     * @param[in] algorithmType Which algorithm to instantiate.
+     * @param[in] algorithmType Which algorithm to instantiate.
+     *
+     * @return Returns an algorithm according to the one specified by algorithmType.
+     */
+    static std::tr1::shared_ptr<IUniqueNumberAlgorithm> CreateInstance(const AlgorithmType algorithmType);
+
+    /**
+     * \brief Returns an instance of this interface given the specified algorithm implementation, sized
+     *        according to the specified hints. For example, a CompactRadixTree with known digits and
+     *        population replaces its nearly full upper levels with a flat directory, and a Set of numbers
+     *        with up to 38 known digits stores them as packed integers rather than strings.
+     *
+     * @param[in] algorithmType Which algorithm to instantiate.
+     * @param[in] options       Hints about the numbers the algorithm will see.
+     *
+     * @return Returns an algorithm according to the one specified by algorithmType.
+     */
+    static std::tr1::shared_ptr<IUniqueNumberAlgorithm> CreateInstance(const AlgorithmType algorithmType,
+                                                                       const Options &options);
+
+    /**
+     * \brief Must be sub-classed.
+     */
+    virtual ~IUniqueNumberAlgorithm() {}
+
+    /**
+     * \brief Resets the algorithm to its initial state so that it 'forgets' all numbers it has seen so far.
+     */
+    virtual void Reset() = 0;
+
+    /**
+     * \brief Returns true if the specified number is unique and has not been encountered in the number stream.
+     */
+    virtual bool IsUnique(const std::string &number) = 0;
+
+    /**
+     * \brief Equivalent to calling IsUnique on each number in turn. Implementations may override this to
+     *        take advantage of seeing many numbers at once.
+     *
+     * @param[in] numbers The numbers to insert.
+     *
+     * @return Returns how many of the numbers were unique.
+     */
+    virtual size_t InsertBatch(const std::vector<std::string> &numbers);
+
+    /**
+     * \brief Returns the number of unique numbers the algorithm has stored.
+     */
+    virtual size_t GetCount() const = 0;
+
+    /**
+     * \brief Returns an estimate of the number of bytes of memory the algorithm is using, including its heap
+     *        allocations.
+     */
+    virtual size_t GetMemoryUsage() const = 0;
+
+    /**
+     * \brief Returns true if GetCount is exact. Approximate algorithms may return false from IsUnique for a
+     *        number that hasn't been seen, so UniqueNumberCounter reports their GetCount instead.
+     */
+    virtual bool IsExact() const { return true; }
+
+    /**
+     * \brief Forgets a number so that it will be unique again, e.g. when it expires from a window. Only some
+     *        algorithms support this; the rest throw.
+     *
+     * @param[in] number The number to forget.
+     *
+     * @return Returns true if the number was found and removed.
+     */
+    virtual bool Remove(const std::string &number);
+
+    /**
+     * \brief Passes every stored number to visitor in ascending order, shorter numbers first. Only ordered
+     *        algorithms support this; the rest throw.
+     */
+    virtual void Visit(Visitor &visitor) const;
+
+    /**
+     * \brief Passes the stored numbers from low to high inclusive to visitor in ascending order, shorter numbers
+     *        first. Only ordered algorithms support this; the rest throw.
+     */
+    virtual void VisitRange(const std::string &low, const std::string &high, Visitor &visitor) const;
+
+    /**
+     * \brief Passes every stored number to visitor in no particular order, e.g. to write a snapshot. The default
+     *        uses Visit, so algorithms that support neither throw.
+     */
+    virtual void Export(Visitor &visitor) const;
+
+    /**
+     * \brief Finds the smallest stored number after the specified one, in the order used by Visit. Only some
+     *        ordered algorithms support this; the rest throw.
+     *
+     * @param[in]  number    The number to search from, which needn't be stored.
+     * @param[out] successor Receives the next number, if there is one.
+     *
+     * @return Returns false if no stored number follows number.
+     */
+    virtual bool GetSuccessor(const std::string &number, std::string &successor) const;
+
+    /**
+     * \brief Finds the largest stored number before the specified one, in the order used by Visit. Only some
+     *        ordered algorithms support this; the rest throw.
+     *
+     * @param[in]  number      The number to search from, which needn't be stored.
+     * @param[out] predecessor Receives the previous number, if there is one.
+     *
+     * @return Returns false if no stored number precedes number.
+     */
+    virtual bool GetPredecessor(const std::string &number, std::string &predecessor) const;
+
+    /**
+     * \brief Returns true if the specified number is stored, without storing it. Every exact algorithm supports
+     *        this, but Theta and Cuckoo throw.
+     */
+    virtual bool Contains(const std::string &number) const;
+
+    /**
+     * \brief Returns how many distinct prefixes of each length the stored numbers have, e.g. distinct regions,
+     *        exchanges and full numbers, which are kept up to date as numbers are inserted. Only some algorithms
+     *        support this; the rest throw.
+     *
+     * @param[out] counts Receives the number of distinct prefixes of length k + 1 in counts[k], up to the length
+     *                    of the longest stored number.
+     */
+    virtual void GetPrefixCounts(std::vector<size_t> &counts) const;
+
+    /**
+     * \brief Makes the stored numbers read only so that the algorithm can shrink them, e.g. before archiving a
+     *        finished set. Afterwards Contains still answers exactly and IsUnique returns false for stored numbers,
+     *        but throws rather than store a new one until Reset. Only some algorithms support this; the rest throw.
+     */
+    virtual void Freeze();
+
+    /**
+     * \brief Moves the stored numbers into fresh memory in the order lookups walk them, so that neighbours which
+     *        long runs of inserts scattered across the heap end up side by side, and gives the memory they leave
+     *        back to the operating system. A pass is done a slice at a time so that it can run between batches;
+     *        numbers stored while a pass is under way are found as usual but may wait for the next pass to be
+     *        moved. Only some algorithms support this; the rest throw.
+     *
+     * @param[in] maxNodes Most nodes to move in this call, which must be positive.
+     *
+     * @return Returns true once the current pass has finished, after which the next call starts another.
+     */
+    virtual bool Compact(const size_t maxNodes);
+};
+
+/**
+ * \brief Estimates the number of unique numbers by keeping the k smallest 64 bit hashes seen (a KMV, or theta,
+ *        sketch). Every retained hash is below theta, the fraction of the hash space sampled, so the count is
+ *        estimated as the number retained divided by theta with a relative standard error of about 1/sqrt(k).
+ *        Unlike HyperLogLog, the samples of sketches built with the same hash can be combined to estimate the
+ *        sizes of unions, intersections and differences.
+ */
+class ThetaSketch : public IUniqueNumberAlgorithm
+{
+public:
+    static const size_t DefaultSize = 4096; /**< Default number of hashes retained. */
+
+    /**
+     * \brief Creates an empty sketch.
+     *
+     * @param[in] size Number of hashes k to retain, which must be at least 2.
+     */
+    explicit ThetaSketch(const size_t size = DefaultSize);
+
+    /**
+     * \brief Recreates a sketch from the output of Serialize.
+     *
+     * @param[in] buffer The serialized sketch.
+     *
+     * @return Returns the sketch, or throws if the buffer is malformed.
+     */
+    static std::tr1::shared_ptr<ThetaSketch> Deserialize(const std::vector<unsigned char> &buffer);
+
+    /**
+     * \copydoc IUniqueNumberAlgorithm::Reset
+     */
+    virtual void Reset();
+
+    /**
+     * \brief Returns true if the number's hash was added to the sample, which is only an indication that the
+     *        number hasn't been seen before.
+     */
+    virtual bool IsUnique(const std::string &number);
+
+    /**
+     * \brief Returns GetEstimate rounded to the nearest integer.
+     */
+    virtual size_t GetCount() const;
+
+    /**
+     * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+     */
+    virtual size_t GetMemoryUsage() const;
+
+    /**
+     * \copydoc IUniqueNumberAlgorithm::IsExact
+     */
+    virtual bool IsExact() const { return false; }
+
+    /**
+     * \brief Returns the estimated number of unique numbers, which is exact until more than k have been seen.
+     */
+    double GetEstimate() const;
+
+    /**
+     * \brief Returns the fraction of the hash space that the sample covers.
+     */
+    double GetTheta() const;
+
+    /**
+     * \brief Makes this sketch estimate the union of itself and other. The result retains at most this
+     *        sketch's k hashes.
+     */
+    void Merge(const ThetaSketch &other);
+
+    /**
+     * \brief Makes this sketch estimate the intersection of itself and other.
+     */
+    void Intersect(const ThetaSketch &other);
+
+    /**
+     * \brief Makes this sketch estimate the numbers in itself that aren't in other.
+     */
+    void Subtract(const ThetaSketch &other);
+
+    /**
+     * \brief Replaces the contents of buffer with a compact form of the sketch, in which the sorted hashes are
+     *        delta encoded.
+     */
+    void Serialize(std::vector<unsigned char> &buffer) const;
+
+private:
+    /**
+     * \brief Lowers theta to the specified value, discarding the hashes that are no longer below it.
+     */
+    void m_LowerTheta(const uint64_t theta);
+
+    /**
+     * \brief Discards the largest hashes until at most k remain, lowering theta to the last one discarded.
+     */
+    void m_Trim();
+
+    size_t m_Size;               /**< Number of hashes k to retain. */
+    uint64_t m_Theta;            /**< Every retained hash is below this, out of 2^64. */
+    std::set<uint64_t> m_Hashes; /**< The retained hashes. */
+};
+
+/**
+ * \brief Remembers numbers approximately by storing a small fingerprint of each in one of two candidate
+ *        buckets of a cuckoo hash table. A number whose fingerprint is already in either bucket is reported as
+ *        seen, so a new number is occasionally mistaken for a duplicate, at a rate of at most
+ *        2 * bucketSize / 2^fingerprintBits. Unlike a Bloom filter, fingerprints can be removed again. Tables
+ *        of 4 slot buckets stay insertable up to a load factor of about 95%, after which IsUnique throws.
+ */
+class CuckooFilter : public IUniqueNumberAlgorithm
+{
+public:
+    static const size_t DefaultCapacity = 1 << 20;   /**< Default number of numbers the filter can hold. */
+    static const size_t DefaultFingerprintBits = 12; /**< Default bits per fingerprint. */
+    static const size_t DefaultBucketSize = 4;       /**< Default fingerprints per bucket. */
+
+    /**
+     * \brief Creates an empty filter.
+     *
+     * @param[in] capacity        Number of numbers the filter must hold, which is rounded up to fill a power of
+     *                            two buckets with some headroom.
+     * @param[in] fingerprintBits Bits per fingerprint, from 4 to 32.
+     * @param[in] bucketSize      Fingerprints per bucket, from 1 to 8.
+     */
+    explicit CuckooFilter(const size_t capacity = DefaultCapacity, const size_t fingerprintBits = DefaultFingerprintBits,
+                          const size_t bucketSize = DefaultBucketSize);
+
+    /**
+     * \copydoc IUniqueNumberAlgorithm::Reset
+     */
+    virtual void Reset();
+
+    /**
+     * \brief Returns true if the number's fingerprint wasn't found and has been stored.
+     */
+    virtual bool IsUnique(const std::string &number);
+
+    /**
+     * \brief Removes one copy of the number's fingerprint. Removing a number that was never stored may remove
+     *        the fingerprint of another number that shares it.
+     */
+    virtual bool Remove(const std::string &number);
+
+    /**
+     * \brief Returns the number of fingerprints stored.
+     */
+    virtual size_t GetCount() const { return m_Count; }
+
+    /**
+     * \copydoc IUniqueNumberAlgorithm::GetMemoryUsage
+     */
+    virtual size_t GetMemoryUsage() const;
+
+    /**
+     * \copydoc IUniqueNumberAlgorithm::IsExact
+     */
+    virtual bool IsExact() const { return false; }
+
+    /**
+     * \brief Returns the upper bound on the rate at which new numbers are mistaken for duplicates.
+     */
+    double GetFalsePositiveRate() const;
+
+    /**
+     * \brief Returns the fraction of slots holding a fingerprint.
+     */
+    double GetLoadFactor() const;
+
+private:
+    /**
+     * \brief Returns the fingerprint in the specified slot, or 0 if it's empty.
+     */
+    uint32_t m_GetSlot(const size_t slot) const;
+
+    /**
+     * \brief Stores a fingerprint, or 0 to empty the slot.
+     */
+    void m_SetSlot(const size_t slot, const uint32_t fingerprint);
+
+    /**
+     * \brief Returns the slot in a bucket holding the fingerprint, or an empty slot if fingerprint is 0, or
+     *        m_BucketSize if there isn't one.
+     */
+    size_t m_Find(const size_t bucket, const uint32_t fingerprint) const;
+
+    /**
+     * \brief Returns the other bucket a fingerprint in the specified bucket may live in.
+     */
+    size_t m_GetAlternateBucket(const size_t bucket, const uint32_t fingerprint) const;
+
+    /**
+     * \brief Computes a number's fingerprint and first bucket.
+     */
+    void m_Hash(const std::string &number, uint32_t &fingerprint, size_t &bucket) const;
+
+    size_t m_FingerprintBits;      /**< Bits per fingerprint. */
+    size_t m_BucketSize;           /**< Fingerprints per bucket. */
+    size_t m_NumBuckets;           /**< Number of buckets, a power of two. */
+    std::vector<uint64_t> m_Slots; /**< Bit packed fingerprints, bucket after bucket. */
+    size_t m_Count;                /**< Number of fingerprints stored, including the victim. */
+    uint32_t m_Victim;             /**< Fingerprint that couldn't be placed, or 0 if there isn't one. */
+    size_t m_VictimBucket;         /**< One of the victim's buckets. */
+    uint64_t m_Random;             /**< State used to choose which fingerprint to evict. */
+};
+
+/**
+ * \brief Estimates how often each number occurs using a count-min sketch: depth rows of width counters, where
+ *        each number increments one counter per row and its frequency is estimated by the smallest of them.
+ *        Estimates never undercount and, with probability 1 - e^-depth, overcount by at most e / width of the
+ *        total. Counters are updated conservatively (only those at the minimum are raised), which tightens
+ *        the estimates considerably for skewed streams. The most frequent numbers are tracked in a small heap.
+ *        Memory is fixed when the sketch is created.
+ */
+class CountMinSketch
+{
+public:
+    /**
+     * \brief Creates an empty sketch.
+     *
+     * @param[in] width       Number of counters per row, rounded up to a power of two.
+     * @param[in] depth       Number of rows, each with an independent hash.
+     * @param[in] numTopItems Number of most frequent numbers to track.
+     */
+    explicit CountMinSketch(const size_t width = 65536, const size_t depth = 4, const size_t numTopItems = 16);
+
+    /**
+     * \brief Forgets all numbers seen so far.
+     */
+    void Reset();
+
+    /**
+     * \brief Counts an occurrence of a number.
+     *
+     * @return Returns the number's estimated frequency, including this occurrence.
+     */
+    uint32_t Add(const std::string &number);
+
+    /**
+     * \brief Returns the estimated frequency of a number.
+     */
+    uint32_t GetEstimate(const std::string &number) const;
+
+    /**
+     * \brief Returns the number of occurrences counted.
+     */
+    uint64_t GetTotal() const { return m_Total; }
+
+    /**
+     * \brief Replaces the contents of items with the most frequent numbers seen and their estimated
+     *        frequencies, most frequent first.
+     */
+    void GetTopItems(std::vector<std::pair<std::string, uint32_t> > &items) const;
+
+    /**
+     * \brief Returns the number of bytes of memory the sketch is using, which doesn't grow as numbers are added.
+     */
+    size_t GetMemoryUsage() const;
+
+private:
+    /**
+     * \brief An entry in the heap of most frequent numbers.
+     */
+    struct TopItem
+    {
+        std::string number; /**< The number. */
+        uint32_t count;     /**< Its estimated frequency when last seen. */
+
+        bool operator<(const TopItem &other) const { return count > other.count; }
+    };
+
+    /**
+     * \brief Returns the index of a number's counter in the specified row.
+     */
+    size_t m_GetIndex(const uint64_t hash, const size_t row) const;
+
+    /**
+     * \brief Records a number's new estimated frequency in the heap of most frequent numbers.
+     */
+    void m_UpdateTopItems(const std::string &number, const uint32_t count);
+
+    size_t m_Width;                   /**< Number of counters per row, a power of two. */
+    size_t m_Depth;                   /**< Number of rows. */
+    size_t m_NumTopItems;             /**< Most numbers kept in m_TopItems. */
+    uint64_t m_Total;                 /**< Number of occurrences counted. */
+    std::vector<uint32_t> m_Counters; /**< The rows, one after another. */
+    std::vector<TopItem> m_TopItems;  /**< Heap of the most frequent numbers, least frequent at the front. */
+};
+
+/**
+ * \brief Receives the outcome of a background snapshot started by UniqueNumberCounter::StartSnapshot.
+ */
+class SnapshotListener
+{
+public:
+    /**
+     * \brief Must be sub-classed.
+     */
+    virtual ~SnapshotListener() {}
+
+    /**
+     * \brief Called once the snapshot process has exited.
+     *
+     * @param[in] path      The snapshot file.
+     * @param[in] succeeded False if the snapshot couldn't be written, in which case any earlier file at path is
+     *                      left as it was.
+     */
+    virtual void OnSnapshotComplete(const std::string &path, const bool succeeded) = 0;
+};
+
+/**
+ * \brief Streams the numbers that become unique in a primary counter to a standby, e.g. over a pipe or a Unix
+ *        domain socket, so that the standby stays current. Numbers are sent in sequence numbered batches, each a
+ *        frame of a 4 byte little-endian length followed by the varint sequence number, the varint time the batch
+ *        was started in microseconds, the varint count, and each number as a varint length and its characters.
+ *        Writes never block: what the descriptor won't take is kept in a backlog and retried on the next flush.
+ */
+class ReplicationSender
+{
+public:
+    /**
+     * \brief Makes the descriptor non-blocking.
+     *
+     * @param[in] fd        The descriptor the standby reads from. Its owner closes it. Writing to a pipe whose
+     *                      standby has gone raises SIGPIPE, which the process should ignore.
+     * @param[in] batchSize Numbers per batch.
+     */
+    explicit ReplicationSender(const int fd, const size_t batchSize = 4096);
+
+    /**
+     * \brief Adds a number to the current batch, sending the batch once it's full. Does nothing once broken.
+     */
+    void Add(const std::string &number);
+
+    /**
+     * \brief Ends the current batch, if it holds any numbers, and writes as much of the backlog as the
+     *        descriptor takes. UniqueNumberCounter::ProcessNumbers flushes after every batch; callers processing
+     *        numbers one at a time should flush periodically.
+     */
+    void Flush();
+
+    /**
+     * \brief Returns the sequence number of the last batch ended, or 0 if none.
+     */
+    uint64_t GetSequence() const { return m_Sequence; }
+
+    /**
+     * \brief Returns the bytes of ended batches not yet written.
+     */
+    size_t GetBacklogSize() const { return m_Backlog.size() - m_BacklogOffset; }
+
+    /**
+     * \brief Returns true once writing has failed, e.g. because the standby has gone. Nothing more is sent, and
+     *        a new standby must catch up from a snapshot taken after a new sender was attached.
+     */
+    bool IsBroken() const { return m_IsBroken; }
+
+private:
+    ReplicationSender(const ReplicationSender &);
+    ReplicationSender &operator=(const ReplicationSender &);
+
+    /**
+     * \brief Moves the current batch into the backlog as a frame.
+     */
+    void m_EndBatch();
+
+    /**
+     * \brief Writes as much of the backlog as the descriptor takes without blocking.
+     */
+    void m_Write();
+
+    const int m_Fd;                       /**< Descriptor the standby reads from. */
+    const bool m_IsSocket;                /**< True if m_Fd is a socket, which can be written without SIGPIPE. */
+    const size_t m_BatchSize;             /**< Numbers per batch. */
+    uint64_t m_Sequence;                  /**< Sequence number of the last batch ended. */
+    uint64_t m_BatchTime;                 /**< Microseconds since the epoch when the current batch was started. */
+    size_t m_BatchCount;                  /**< Numbers in the current batch. */
+    std::vector<unsigned char> m_Batch;   /**< The current batch's numbers, encoded. */
+    std::vector<unsigned char> m_Backlog; /**< Frames not yet written, from m_BacklogOffset on. */
+    size_t m_BacklogOffset;               /**< Bytes at the start of m_Backlog already written. */
+    bool m_IsBroken;                      /**< True once writing has failed. */
+};
+
+/**
+ * \brief Operational metrics of a UniqueNumberCounter, for scraping from another thread. The counter's own thread
+ *        updates plain fields with no synchronization and publishes a copy of them after each batch, each rejected
+ *        number, each memory measurement and every few thousand numbers processed one at a time; readers copy the
+ *        published metrics and retry if a publish overlapped, so the counter never waits for a reader.
+ */
+class CounterMetrics
+{
+public:
+    /**
+     * \brief Number of finite batch latency buckets. Bucket k holds batches of at most 10us * 4^k, up to 42s.
+     */
+    static const size_t NumLatencyBuckets = 12;
+
+    /**
+     * \brief The metrics as of a publish.
+     */
+    struct Snapshot
+    {
+        uint64_t numUnique;                                  /**< Unique numbers counted. */
+        uint64_t numProcessed;                               /**< Numbers processed, unique or not. */
+        uint64_t numRejected;                                /**< Numbers rejected as malformed. A rejected batch
+                                                                  counts once. */
+        uint64_t memoryUsage;                                /**< Bytes used by the algorithm when last measured
+                                                                  by UniqueNumberCounter::MeasureMemory. */
+        double memorySeconds;                                /**< Time taken by the last memory measurement. */
+        uint64_t numBatches;                                 /**< Batches processed with ProcessNumbers. */
+        double batchSeconds;                                 /**< Total time spent in ProcessNumbers. */
+        uint64_t batchLatencyBuckets[NumLatencyBuckets + 1]; /**< Batches by latency, non-cumulative; the last
+                                                                  bucket holds those slower than every bound. */
+        uint64_t publishTime;                                /**< Microseconds since the epoch of the publish, or
+                                                                  0 if none. */
+    };
+
+    /**
+     * \brief Stores the parameters to be used in other methods, but otherwise has no side-effects.
+     *
+     * @param[in] counterName   Names the counter in the metrics' labels.
+     * @param[in] algorithmName Names its algorithm in the metrics' labels.
+     */
+    CounterMetrics(const std::string &counterName, const std::string &algorithmName);
+
+    const std::string &GetCounterName() const { return m_CounterName; }
+    const std::string &GetAlgorithmName() const { return m_AlgorithmName; }
+
+    /**
+     * \brief Returns the upper bound in seconds of a latency bucket.
+     */
+    static double GetLatencyBound(const size_t bucket);
+
+    /**
+     * \brief Counts a rejected number. Only called by the counter's thread.
+     */
+    void AddRejected() { ++m_Current.numRejected; }
+
+    /**
+     * \brief Counts processed numbers. Only called by the counter's thread.
      *
-     * @return Returns an algorithm according to the one specified by algorithmType.
+     * @return Returns true every few thousand numbers, when the metrics should be published.
      */
-    static std::tr1::shared_ptr<IUniqueNumberAlgorithm> CreateInstance(const AlgorithmType algorithmType);
+    bool AddProcessed(const uint64_t count)
+    {
+        m_Current.numProcessed += count;
+        m_NumUnpublished += count;
+        if (m_NumUnpublished < PublishInterval)
+            return false;
+        m_NumUnpublished = 0;
+        return true;
+    }
 
     /**
-     * \brief Must be sub-classed.
+     * \brief Counts a batch and its latency. Only called by the counter's thread.
      */
-    virtual ~IUniqueNumberAlgorithm() {}
+    void AddBatch(const double seconds);
 
     /**
-     * \brief Resets the algorithm to its initial state so that it 'forgets' all numbers it has seen so far.
+     * \brief Records the algorithm's memory and how long measuring it took. Only called by the counter's thread.
      */
-    virtual void Reset() = 0;
+    void SetMemoryUsage(const size_t bytes, const double seconds)
+    {
+        m_Current.memoryUsage = bytes;
+        m_Current.memorySeconds = seconds;
+    }
 
     /**
-     * \brief Returns true if the specified number is unique and has not been encountered in the number stream.
+     * \brief Publishes the metrics. Only called by the counter's thread.
+     *
+     * @param[in] numUnique The counter's count.
      */
-    virtual bool IsUnique(const std::string &number) = 0;
+    void Publish(const size_t numUnique);
+
+    /**
+     * \brief Copies the published metrics. May be called from any thread.
+     */
+    void GetSnapshot(Snapshot &snapshot) const;
+
+private:
+    CounterMetrics(const CounterMetrics &);
+    CounterMetrics &operator=(const CounterMetrics &);
+
+    /**
+     * \brief Numbers processed one at a time between publishes.
+     */
+    static const uint64_t PublishInterval = 4096;
+
+    const std::string m_CounterName;   /**< Names the counter in labels. */
+    const std::string m_AlgorithmName; /**< Names its algorithm in labels. */
+    uint64_t m_NumUnpublished;         /**< Numbers processed since AddProcessed last returned true. */
+    Snapshot m_Current;                /**< The metrics, written only by the counter's thread. */
+    Snapshot m_Published;              /**< The metrics as of the last publish. */
+    volatile uint64_t m_Version;       /**< Odd while m_Published is being written. */
 };
 
 /**
@@ -49,6 +763,32 @@ public:
 class UniqueNumberCounter
 {
 public:
+    /**
+     * \brief Describes the order in which numbers arrive.
+     */
+    enum Ordering
+    {
+        Unsorted,    /**< Numbers arrive in any order, so every number is given to the algorithm. */
+        Sorted,      /**< Numbers are guaranteed to arrive in ascending order, so each number only needs to be
+                          compared with the previous one and the algorithm is never used. A number that is out
+                          of order is an error. */
+        DetectSorted /**< Numbers are treated as sorted until the first number that is out of order. The run seen
+                          until then is kept delta encoded (a byte or two per number for dense keys) and is
+                          inserted into the algorithm in bulk when the order is violated, after which numbers
+                          are processed as Unsorted. Requires at most 19 digits. */
+    };
+
+    /**
+     * \brief What a snapshot holds. Every snapshot is a checkpoint in a chain, and a delta can only be loaded
+     *        or compacted onto the checkpoint before it.
+     */
+    enum SnapshotType
+    {
+        FullSnapshot, /**< Every unique number encountered so far. */
+        DeltaSnapshot /**< The numbers that became unique since the previous checkpoint, which requires delta
+                           tracking. */
+    };
+
     /**
      * \brief Stores the parameters to be used in other methods, but otherwise has no side-effects.
      *
@@ -57,17 +797,199 @@ public:
      */
     UniqueNumberCounter(std::tr1::shared_ptr<IUniqueNumberAlgorithm> algorithm, const size_t numExpectedDigits);
 
+    /**
+     * \brief Stores the parameters to be used in other methods, but otherwise has no side-effects. Numbers may
+     *        have any number of digits in the specified range, and numbers that differ only in leading zeros
+     *        (e.g. "0123" and "123") are different numbers.
+     *
+     * @param[in] algorithm The algorithm this object should use for rememberingn numbers.
+     * @param[in] minDigits The fewest digits a number may have.
+     * @param[in] maxDigits The most digits a number may have.
+     */
+    UniqueNumberCounter(std::tr1::shared_ptr<IUniqueNumberAlgorithm> algorithm, const size_t minDigits,
+                        const size_t maxDigits);
+
+    /**
+     * \brief Waits for a background snapshot that is still being written.
+     */
+    ~UniqueNumberCounter();
+
     /**
      * \brief Processes a number from the number stream.
      */
     void ProcessNumber(const std::string &number);
 
     /**
-     * \brief Returns the number of unique numbers encountered so far.
+     * \brief Processes a batch of numbers from the number stream. The numbers are first scattered into
+     *        partitions by their leading digits and each partition is then fed to the algorithm in turn,
+     *        so that consecutive inserts touch the same region of the algorithm's memory. The resulting
+     *        count is identical to calling ProcessNumber on each number.
+     *
+     * @param[in] numbers The numbers to process. All numbers are checked before any of them are processed,
+     *                    including their order when it's Sorted.
+     */
+    void ProcessNumbers(const std::vector<std::string> &numbers);
+
+    /**
+     * \brief Sets how many leading digits ProcessNumbers uses to partition a batch. Zero disables
+     *        partitioning and hands each batch to IUniqueNumberAlgorithm::InsertBatch whole, which suits
+     *        algorithms that gain nothing from locality, such as hash tables.
+     *
+     * @param[in] numPartitionDigits Number of leading digits, which cannot exceed the smallest number of digits.
+     */
+    void SetNumPartitionDigits(const size_t numPartitionDigits);
+
+    /**
+     * \brief Sets the characters numbers are written with. Must be called before any numbers are processed, and
+     *        the algorithm must have been created with the same alphabet. The default is Decimal. Changing the
+     *        alphabet resets the number of partition digits to suit its size.
+     *
+     * @param[in] alphabet The alphabet, which must be Decimal when the ordering is DetectSorted.
+     */
+    void SetAlphabet(const IUniqueNumberAlgorithm::Alphabet alphabet);
+
+    /**
+     * \brief Sets a sketch that counts every occurrence of every processed number, alongside the algorithm.
+     *
+     * @param[in] sketch The sketch, or NULL to stop counting frequencies.
+     */
+    void SetFrequencySketch(std::tr1::shared_ptr<CountMinSketch> sketch) { m_FrequencySketch = sketch; }
+
+    /**
+     * \brief Forgets a number so that it will be counted again if it reappears, e.g. when it expires from a
+     *        window. Requires an algorithm that supports IUniqueNumberAlgorithm::Remove and Unsorted ordering.
+     *        Removals aren't in delta snapshots or the replication stream, so they're refused while either is
+     *        kept.
+     *
+     * @param[in] number The number to forget.
+     */
+    void RemoveNumber(const std::string &number);
+
+    /**
+     * \brief Sets the order in which numbers are expected to arrive. Must be called before any numbers are
+     *        processed. The default is Unsorted, which is the only ordering allowed when numbers vary in length or
+     *        the algorithm isn't exact.
+     *
+     * @param[in] ordering The expected order.
+     */
+    void SetOrdering(const Ordering ordering);
+
+    /**
+     * \brief Returns the order in which numbers are currently being processed. DetectSorted becomes Unsorted
+     *        once a number arrives out of order.
+     */
+    Ordering GetOrdering() const { return m_Ordering; }
+
+    /**
+     * \brief Returns the number of unique numbers encountered so far, which is an estimate when the algorithm
+     *        isn't exact.
+     */
+    size_t GetCount() const;
+
+    /**
+     * \brief Returns how many distinct prefixes of each length the numbers encountered so far have. Sorted
+     *        numbers are counted here as they arrive; otherwise the algorithm must support
+     *        IUniqueNumberAlgorithm::GetPrefixCounts.
+     *
+     * @param[out] counts Receives the number of distinct prefixes of length k + 1 in counts[k].
+     */
+    void GetPrefixCounts(std::vector<size_t> &counts) const;
+
+    /**
+     * \brief Turns on remembering the numbers that become unique after each checkpoint, so that delta snapshots
+     *        can be written. They're kept until the next snapshot as a varint length followed by the number's
+     *        characters, i.e. one byte more than the number itself for numbers of under 128 characters. Numbers
+     *        counted since the latest checkpoint while tracking was off can't be in the next delta, so delta
+     *        snapshots are refused until a full snapshot has been written.
+     *
+     * @param[in] enabled False to stop tracking and forget the numbers tracked so far.
+     */
+    void SetDeltaTracking(const bool enabled);
+
+    /**
+     * \brief Sets a sender that streams every number that becomes unique to a standby. Partitioning still
+     *        applies, but an unpartitioned batch is no longer handed to the algorithm whole.
+     *
+     * @param[in] sender The sender, or NULL to stop streaming.
+     */
+    void SetReplicationSender(std::tr1::shared_ptr<ReplicationSender> sender) { m_ReplicationSender = sender; }
+
+    /**
+     * \brief Sets the metrics this counter updates as it processes numbers, e.g. to add to a MetricsRegistry.
+     *        Each batch given to ProcessNumbers is timed.
+     *
+     * @param[in] metrics The metrics, or NULL to stop updating them.
+     */
+    void SetMetrics(std::tr1::shared_ptr<CounterMetrics> metrics) { m_Metrics = metrics; }
+
+    /**
+     * \brief Measures the algorithm's memory into the metrics, if they're set. This walks the whole structure for
+     *        some algorithms, e.g. over a second for a tree of millions of numbers, so it's never done while
+     *        processing numbers; callers measure between batches, e.g. every 30 seconds. The time taken is
+     *        published alongside, apart from the batch latencies.
+     */
+    void MeasureMemory();
+
+    /**
+     * \brief Writes a snapshot file and makes it the latest checkpoint. The file is written alongside and renamed
+     *        into place so that a failed snapshot never replaces a good one. Full snapshots require an algorithm
+     *        that supports IUniqueNumberAlgorithm::Export, which every exact algorithm does but Theta and Cuckoo
+     *        don't, and an ordering other than Sorted, which doesn't keep its numbers.
+     *
+     * @param[in] path The snapshot file.
+     * @param[in] type Whether to write every number, or only those since the previous checkpoint.
+     */
+    void WriteSnapshot(const std::string &path, const SnapshotType type = FullSnapshot);
+
+    /**
+     * \brief Forks the process and writes the snapshot from the child, so that ingestion only pauses for the
+     *        fork. The child sees the counter as it was when forked, and the kernel copies the pages the parent
+     *        modifies meanwhile, so memory grows by at most the pages touched until the snapshot finishes. Only
+     *        one snapshot may run at a time. ProcessNumbers polls for its completion; callers processing numbers
+     *        one at a time should call PollSnapshot.
+     *
+     * @param[in] path     The snapshot file.
+     * @param[in] listener Optional, told when the snapshot has finished.
+     * @param[in] type     Whether to write every number, or only those since the previous checkpoint. If the
+     *                     snapshot fails, the numbers it would have written are kept for the next delta.
+     */
+    void StartSnapshot(const std::string &path,
+                       std::tr1::shared_ptr<SnapshotListener> listener = std::tr1::shared_ptr<SnapshotListener>(),
+                       const SnapshotType type = FullSnapshot);
+
+    /**
+     * \brief Checks whether the background snapshot has finished and, if so, tells its listener.
+     *
+     * @param[in] wait True to block until it finishes.
+     *
+     * @return Returns true if a snapshot is still being written.
+     */
+    bool PollSnapshot(const bool wait = false);
+
+    /**
+     * \brief Processes every number in a snapshot file, e.g. to restore a counter after a restart, and adopts it
+     *        as the latest checkpoint, so that the counter's own deltas continue its chain. A delta can only be
+     *        loaded onto the checkpoint before it. The loaded numbers aren't added to the frequency sketch or
+     *        counted as processed in the metrics.
+     *
+     * @param[in] path The snapshot file.
+     */
+    void LoadSnapshot(const std::string &path);
+
+    /**
+     * \brief Folds a chain of snapshots into a new full snapshot of its last checkpoint, without loading them.
+     *
+     * @param[in] paths The chain: a full snapshot followed by the deltas written after it, in order.
+     * @param[in] path  The new full snapshot, which may replace the first file of the chain.
      */
-    size_t GetCount() const { return m_Count; }
+    static void CompactSnapshots(const std::vector<std::string> &paths, const std::string &path);
 
 private:
+    /**
+     * \brief Checks the constructor arguments and resets the algorithm.
+     */
+    void m_Initialize();
+
     /**
      * \brief Checks a number to make sure it's valid (e.g. correct number of digits, is actually a number, etc...)
      *
@@ -75,7 +997,265 @@ private:
      */
     void m_CheckNumber(const std::string &number) const;
 
-    const size_t m_NumExpectedDigits;                         /**< Number of digits each number in the stream should contain. */
-    std::tr1::shared_ptr<IUniqueNumberAlgorithm> m_Algorithm; /**< Algorithm to use to detect unique numbers */
-    size_t m_Count;                                           /**< Number of unique numbers detected so far */
+    /**
+     * \brief Checks that a number doesn't sort before the one before it when the ordering is Sorted.
+     *
+     * @param[in] number   The number to check.
+     * @param[in] previous The number before it, or an empty string if there isn't one.
+     */
+    void m_CheckOrder(const std::string &number, const std::string &previous) const;
+
+    /**
+     * \brief Counts a rejected number in the metrics and raises an error.
+     */
+    void m_Reject(const char *error) const;
+
+    /**
+     * \brief Processes a number that has already been checked.
+     *
+     * @param[in] number The number to process.
+     */
+    void m_ProcessCheckedNumber(const std::string &number);
+
+    /**
+     * \brief Processes a batch of numbers that have already been checked.
+     *
+     * @param[in] numbers The numbers to process.
+     */
+    void m_ProcessCheckedNumbers(const std::vector<std::string> &numbers);
+
+    /**
+     * \brief Inserts the sorted run collected in DetectSorted mode into the algorithm and switches to Unsorted.
+     */
+    void m_FlushSortedRun();
+
+    /**
+     * \brief Records a number that has just become unique, if deltas are being tracked or replicated.
+     */
+    void m_TrackUnique(const std::string &number);
+
+    /**
+     * \brief Raises an error if a snapshot of a type can't be written now.
+     */
+    void m_CheckSnapshotType(const SnapshotType type) const;
+
+    /**
+     * \brief Writes a snapshot file for the checkpoint after the latest one, without making it the latest.
+     */
+    void m_WriteSnapshot(const std::string &path, const SnapshotType type) const;
+
+    /**
+     * \brief Scatters numbers into m_PartitionedNumbers ordered by partition, staging each partition's
+     *        entries in a small cache line sized buffer before writing them out.
+     *
+     * @param[in] numbers The numbers to partition.
+     */
+    void m_PartitionNumbers(const std::vector<std::string> &numbers);
+
+    const size_t m_MinDigits;                                  /**< Fewest digits a number in the stream may contain. */
+    const size_t m_MaxDigits;                                  /**< Most digits a number in the stream may contain. */
+    std::tr1::shared_ptr<IUniqueNumberAlgorithm> m_Algorithm;  /**< Algorithm to use to detect unique numbers */
+    size_t m_Count;                                            /**< Number of unique numbers detected so far */
+    size_t m_NumPartitionDigits;                               /**< Number of leading digits used to partition batches. */
+    std::vector<const std::string *> m_PartitionedNumbers;     /**< Batch numbers reordered by partition. */
+    std::vector<size_t> m_PartitionOffsets;                    /**< Start of each partition in m_PartitionedNumbers. */
+    std::vector<const std::string *> m_StagingBuffers;         /**< Write-combining buffers, one cache line per partition. */
+    std::vector<unsigned char> m_StagingSizes;                 /**< Number of entries in each staging buffer. */
+    Ordering m_Ordering;                                       /**< Order in which numbers are currently being processed. */
+    IUniqueNumberAlgorithm::Alphabet m_Alphabet;               /**< Characters numbers are written with. */
+    std::tr1::shared_ptr<CountMinSketch> m_FrequencySketch;    /**< Counts occurrences, if set. */
+    std::string m_Previous;                                    /**< Last number seen while the input is treated as sorted. */
+    std::vector<unsigned char> m_SortedRun;                    /**< Varint deltas of the run seen in DetectSorted mode. */
+    std::vector<size_t> m_SortedPrefixCounts;                  /**< Distinct prefixes of each length while sorted. */
+    pid_t m_SnapshotPid;                                       /**< Process writing a snapshot, or 0 if none. */
+    std::string m_SnapshotPath;                                /**< File being written by m_SnapshotPid. */
+    std::tr1::shared_ptr<SnapshotListener> m_SnapshotListener; /**< Told when m_SnapshotPid finishes, if set. */
+    bool m_TracksDeltas;                                       /**< True if m_Journal is kept. */
+    std::vector<unsigned char> m_Journal;                      /**< Numbers that became unique since the last checkpoint,
+                                                                    each as its length and characters. */
+    std::vector<unsigned char> m_PendingJournal;               /**< m_Journal as of the snapshot being written. */
+    bool m_IsJournalComplete;                                  /**< True while m_Journal holds every number counted
+                                                                    since the latest checkpoint. */
+    bool m_IsPendingJournalComplete;                           /**< m_IsJournalComplete as of the snapshot being
+                                                                    written. */
+    uint64_t m_Lineage;                                        /**< Identifies this counter's chain of checkpoints. */
+    uint64_t m_Sequence;                                       /**< Position of the last checkpoint, or 0 if none. */
+    std::tr1::shared_ptr<ReplicationSender> m_ReplicationSender; /**< Streams unique numbers to a standby, if set. */
+    std::tr1::shared_ptr<CounterMetrics> m_Metrics;              /**< Updated as numbers are processed, if set. */
+};
+
+/**
+ * \brief Applies the batches streamed by a ReplicationSender to a standby counter, and measures how far behind
+ *        the primary the standby is. Batches are applied in bulk with UniqueNumberCounter::ProcessNumbers.
+ */
+class ReplicationReceiver
+{
+public:
+    /**
+     * \brief Stores the parameters to be used in other methods, but otherwise has no side-effects.
+     *
+     * @param[in] fd      The descriptor the primary's sender writes to. Its owner closes it.
+     * @param[in] counter The standby counter, which must outlive the receiver.
+     */
+    ReplicationReceiver(const int fd, UniqueNumberCounter &counter);
+
+    /**
+     * \brief Loads a snapshot of the primary into the standby before any batch is applied, so that a standby can
+     *        join a stream that has already started. The snapshot must have been started after the sender was
+     *        attached; batches overlapping it only repeat numbers it holds, which don't count twice.
+     *
+     * @param[in] path The snapshot file, which may be followed by deltas with further calls.
+     */
+    void CatchUp(const std::string &path);
+
+    /**
+     * \brief Reads up to 64KB from the descriptor and applies every batch that completes. Batches must arrive
+     *        in sequence, starting with the first unless the standby caught up from a snapshot. A batch that
+     *        can't be applied, e.g. because the stream is corrupt or the standby counter rejects its numbers,
+     *        raises an error and breaks the receiver.
+     *
+     * @param[in] wait True to block until something can be read.
+     *
+     * @return Returns false once the primary has closed the stream.
+     */
+    bool Receive(const bool wait = false);
+
+    /**
+     * \brief Returns the sequence number of the last batch applied, or 0 if none.
+     */
+    uint64_t GetSequence() const { return m_Sequence; }
+
+    /**
+     * \brief Returns the number of batches applied.
+     */
+    uint64_t GetNumBatches() const { return m_NumBatches; }
+
+    /**
+     * \brief Returns the number of numbers applied.
+     */
+    uint64_t GetNumNumbers() const { return m_NumNumbers; }
+
+    /**
+     * \brief Returns the bytes received but not yet applied because their batch is incomplete.
+     */
+    size_t GetPendingSize() const { return m_Buffer.size() - m_BufferOffset; }
+
+    /**
+     * \brief Returns the seconds between the last applied batch being started on the primary and being applied
+     *        here, which includes the time it spent filling up.
+     */
+    double GetLagSeconds() const { return m_LagSeconds; }
+
+    /**
+     * \brief Returns the largest GetLagSeconds so far.
+     */
+    double GetMaxLagSeconds() const { return m_MaxLagSeconds; }
+
+    /**
+     * \brief Returns true once a batch couldn't be applied. Every later Receive raises an error, since the
+     *        standby has missed the batch, and it must catch up again with a new receiver.
+     */
+    bool IsBroken() const { return m_IsBroken; }
+
+private:
+    ReplicationReceiver(const ReplicationReceiver &);
+    ReplicationReceiver &operator=(const ReplicationReceiver &);
+
+    /**
+     * \brief Applies the complete batches in m_Buffer.
+     */
+    void m_ApplyBatches();
+
+    const int m_Fd;                      /**< Descriptor the primary's sender writes to. */
+    UniqueNumberCounter &m_Counter;      /**< The standby counter. */
+    bool m_CaughtUp;                     /**< True if the stream may start after the first batch. */
+    uint64_t m_Sequence;                 /**< Sequence number of the last batch applied. */
+    uint64_t m_NumBatches;               /**< Batches applied. */
+    uint64_t m_NumNumbers;               /**< Numbers applied. */
+    double m_LagSeconds;                 /**< Lag of the last batch applied. */
+    double m_MaxLagSeconds;              /**< Largest lag so far. */
+    std::vector<unsigned char> m_Buffer; /**< Bytes received, from m_BufferOffset on. */
+    size_t m_BufferOffset;               /**< Bytes at the start of m_Buffer already applied. */
+    std::vector<std::string> m_Numbers;  /**< The batch being applied. */
+    bool m_IsBroken;                     /**< True once a batch couldn't be applied. */
+};
+
+/**
+ * \brief The CounterMetrics of a process's counters, formatted for Prometheus.
+ */
+class MetricsRegistry
+{
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    /**
+     * \brief Adds a counter's metrics. May be called from any thread.
+     */
+    void Add(std::tr1::shared_ptr<CounterMetrics> metrics);
+
+    /**
+     * \brief Removes a counter's metrics. May be called from any thread.
+     */
+    void Remove(std::tr1::shared_ptr<CounterMetrics> metrics);
+
+    /**
+     * \brief Formats the published metrics of every counter in the Prometheus text exposition format. Rates,
+     *        such as numbers inserted per second, are left to Prometheus' rate() over the totals.
+     *
+     * @param[out] text Receives the metrics.
+     */
+    void Format(std::string &text) const;
+
+private:
+    MetricsRegistry(const MetricsRegistry &);
+    MetricsRegistry &operator=(const MetricsRegistry &);
+
+    mutable pthread_mutex_t m_Mutex;                               /**< Guards m_Metrics. */
+    std::vector<std::tr1::shared_ptr<CounterMetrics> > m_Metrics; /**< The counters' metrics. */
+};
+
+/**
+ * \brief Serves a MetricsRegistry over HTTP on the loopback interface, from a thread of its own, at /metrics.
+ */
+class MetricsEndpoint
+{
+public:
+    /**
+     * \brief Starts listening and serving.
+     *
+     * @param[in] registry The metrics to serve.
+     * @param[in] port     The TCP port, or 0 to pick a free one.
+     */
+    MetricsEndpoint(std::tr1::shared_ptr<MetricsRegistry> registry, const unsigned short port);
+
+    /**
+     * \brief Stops serving and waits for the thread.
+     */
+    ~MetricsEndpoint();
+
+    /**
+     * \brief Returns the port being listened on.
+     */
+    unsigned short GetPort() const { return m_Port; }
+
+private:
+    MetricsEndpoint(const MetricsEndpoint &);
+    MetricsEndpoint &operator=(const MetricsEndpoint &);
+
+    /**
+     * \brief The thread's entry point, which accepts clients until told to stop.
+     */
+    static void *m_Run(void *endpoint);
+
+    /**
+     * \brief Answers a client's request and closes the connection.
+     */
+    void m_Serve(const int client) const;
+
+    const std::tr1::shared_ptr<MetricsRegistry> m_Registry; /**< The metrics to serve. */
+    int m_Listener;                                         /**< The listening socket. */
+    unsigned short m_Port;                                  /**< The port being listened on. */
+    int m_StopPipe[2];                                      /**< Written to by the destructor to stop the thread. */
+    pthread_t m_Thread;                                     /**< The serving thread. */
 };